@@ -0,0 +1,96 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+//Blocking FIFO with a fixed capacity, connecting two pipeline stages.
+//push() waits while the queue is full, pop() waits while it is empty. After close(), pushes fail and
+//pop() drains the remaining items before failing. Keeps depth and waiting time statistics.
+template<typename T>
+class BoundedQueue {
+public:
+	struct Stats {
+		long pushes;
+		int max_depth;
+		double mean_depth;			//depth seen by push, before adding the item
+		double push_wait_ms;		//producer time blocked on a full queue
+		double pop_wait_ms;			//consumer time blocked on an empty queue
+	};
+
+	explicit BoundedQueue(int capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+	bool push(const T &item)
+	{
+		std::unique_lock<std::mutex> lock(mu);
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		not_full.wait(lock, [this]() { return closed || items.size() < capacity; });
+		push_wait_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		if (closed)
+			return false;
+		depth_sum += items.size();
+		pushes++;
+		items.push_back(item);
+		if (items.size() > max_depth)
+			max_depth = items.size();
+		not_empty.notify_one();
+		return true;
+	}
+
+	bool pop(T &item)
+	{
+		std::unique_lock<std::mutex> lock(mu);
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+		pop_wait_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+		if (items.empty())
+			return false;
+		item = items.front();
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			closed = true;
+		}
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+
+	int size()
+	{
+		std::lock_guard<std::mutex> lock(mu);
+		return items.size();
+	}
+
+	Stats stats()
+	{
+		std::lock_guard<std::mutex> lock(mu);
+		Stats s;
+		s.pushes = pushes;
+		s.max_depth = max_depth;
+		s.mean_depth = pushes > 0 ? (double)depth_sum / pushes : 0;
+		s.push_wait_ms = push_wait_ms;
+		s.pop_wait_ms = pop_wait_ms;
+		return s;
+	}
+
+private:
+	const size_t capacity;
+	std::mutex mu;
+	std::condition_variable not_full, not_empty;
+	std::deque<T> items;
+	bool closed = false;
+	long pushes = 0;
+	long depth_sum = 0;
+	size_t max_depth = 0;
+	double push_wait_ms = 0, pop_wait_ms = 0;
+};
+
+#endif
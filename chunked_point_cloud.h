@@ -0,0 +1,81 @@
+#ifndef CHUNKED_POINT_CLOUD_H
+#define CHUNKED_POINT_CLOUD_H
+
+#include <memory>
+#include <vector>
+#include <Eigen/Core>
+#include <pcl/point_cloud.h>
+#include "compact_point_cloud.h"
+
+//Accumulated point cloud stored as chunks (one per cycle) in the coordinates they were added in, each with a
+//composed rigid transform to the current world frame. A correction of everything added so far only updates
+//the 4x4 matrices, O(chunks) instead of rewriting every point. Points are materialized on demand.
+//Chunks are kept as CompactPointClouds with coordinates quantized to quantum, 10 bytes per point.
+template<typename PointT>
+class ChunkedPointCloud {
+public:
+	struct Chunk {
+		std::shared_ptr<CompactPointCloud> points;
+		Eigen::Matrix4f transform;
+	};
+
+	explicit ChunkedPointCloud(double quantum = 0.005) : quantum(quantum) {}
+
+	//quantum of chunks added afterwards
+	void setQuantum(double q) { quantum = q; }
+
+	void addChunk(typename pcl::PointCloud<PointT>::Ptr cloud)
+	{
+		if (cloud->points.empty())
+			return;
+		Chunk chunk;
+		chunk.points = std::make_shared<CompactPointCloud>(quantum);
+		chunk.points->append(*cloud);
+		chunk.points->shrinkToFit();
+		chunk.transform = Eigen::Matrix4f::Identity();
+		chunks.push_back(chunk);
+		n_points += chunk.points->size();
+	}
+
+	//left multiply the transform of every chunk added so far
+	void applyCorrection(const Eigen::Matrix4f &T)
+	{
+		for (int i = 0; i < chunks.size(); i++)
+			chunks[i].transform = T * chunks[i].transform;
+	}
+
+	//write all points in world coordinates into cloud
+	void materialize(pcl::PointCloud<PointT> &cloud) const
+	{
+		cloud.points.resize(n_points);
+		size_t out = 0;
+		for (int c = 0; c < chunks.size(); c++)
+		{
+			if (chunks[c].points->size() > 0)
+				chunks[c].points->decode(&cloud.points[out], chunks[c].transform);
+			out += chunks[c].points->size();
+		}
+		cloud.width = cloud.points.size();
+		cloud.height = 1;
+		cloud.is_dense = true;
+	}
+
+	size_t size() const { return n_points; }
+	int numChunks() const { return chunks.size(); }
+
+	//bytes of the stored points
+	size_t sizeBytes() const
+	{
+		size_t bytes = 0;
+		for (int c = 0; c < chunks.size(); c++)
+			bytes += chunks[c].points->sizeBytes();
+		return bytes;
+	}
+
+private:
+	std::vector<Chunk, Eigen::aligned_allocator<Chunk> > chunks;
+	double quantum;
+	size_t n_points = 0;
+};
+
+#endif
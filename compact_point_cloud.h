@@ -0,0 +1,134 @@
+#ifndef COMPACT_POINT_CLOUD_H
+#define COMPACT_POINT_CLOUD_H
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include <Eigen/Core>
+
+//10 byte point: coordinates in quanta relative to the center of its tile and 24 bit color
+struct CompactPoint {
+	int16_t x, y, z;
+	uint8_t r, g, b;
+};
+
+//Point cloud of CompactPoints, instead of the 32 bytes of a pcl::PointXYZRGB. Space is split into cubic tiles of
+//65534 quanta, every tile keeps its center and the points inside it, so any extent is stored with the same
+//precision: coordinates are within quantum / 2 of the originals. Conversion from and to pcl style clouds is a
+//bulk pass over the points, decoding applies an optional rigid transform on the way.
+class CompactPointCloud {
+public:
+	struct Tile {
+		double origin[3];
+		std::vector<CompactPoint> points;
+	};
+
+	explicit CompactPointCloud(double quantum = 0.005) : q(quantum), inv_q(1.0 / quantum), tile_size(65534 * quantum) {}
+
+	double quantum() const { return q; }
+
+	//append the points of a pcl style cloud of xyz + rgb points. non finite points are skipped
+	template<typename CloudT>
+	void append(const CloudT &cloud)
+	{
+		int tile = -1;
+		int64_t tile_idx[3] = { 0, 0, 0 };
+		for (size_t i = 0; i < cloud.points.size(); i++)
+		{
+			const typename CloudT::PointType &pt = cloud.points[i];
+			if (!std::isfinite(pt.x) || !std::isfinite(pt.y) || !std::isfinite(pt.z))
+				continue;
+			int64_t idx[3] = { (int64_t)std::floor(pt.x / tile_size), (int64_t)std::floor(pt.y / tile_size), (int64_t)std::floor(pt.z / tile_size) };
+			//consecutive points are mostly in the same tile
+			if (tile < 0 || idx[0] != tile_idx[0] || idx[1] != tile_idx[1] || idx[2] != tile_idx[2])
+			{
+				tile = findTile(idx);
+				tile_idx[0] = idx[0]; tile_idx[1] = idx[1]; tile_idx[2] = idx[2];
+			}
+			Tile &t = tiles[tile];
+			CompactPoint cp;
+			cp.x = (int16_t)std::lround((pt.x - t.origin[0]) * inv_q);
+			cp.y = (int16_t)std::lround((pt.y - t.origin[1]) * inv_q);
+			cp.z = (int16_t)std::lround((pt.z - t.origin[2]) * inv_q);
+			cp.r = pt.r;
+			cp.g = pt.g;
+			cp.b = pt.b;
+			t.points.push_back(cp);
+			n_points++;
+		}
+	}
+
+	//write all points, transformed by the rigid transform T, to out[0 .. size()), points of a pcl style cloud
+	template<typename PointT>
+	void decode(PointT *out, const Eigen::Matrix4f &T = Eigen::Matrix4f::Identity()) const
+	{
+		for (int k = 0; k < tiles.size(); k++)
+		{
+			//T (origin + q * p) = (q R) p + (R origin + t)
+			const Tile &t = tiles[k];
+			float M[12];
+			for (int i = 0; i < 3; i++)
+			{
+				double offset = T(i,3);
+				for (int j = 0; j < 3; j++)
+				{
+					M[4*i+j] = (float)(T(i,j) * q);
+					offset += T(i,j) * t.origin[j];
+				}
+				M[4*i+3] = (float)offset;
+			}
+			for (size_t p = 0; p < t.points.size(); p++)
+			{
+				const CompactPoint &cp = t.points[p];
+				const float x = cp.x, y = cp.y, z = cp.z;
+				PointT &pt = *out++;
+				pt.x = M[0] * x + M[1] * y + M[2] * z + M[3];
+				pt.y = M[4] * x + M[5] * y + M[6] * z + M[7];
+				pt.z = M[8] * x + M[9] * y + M[10] * z + M[11];
+				pt.r = cp.r;
+				pt.g = cp.g;
+				pt.b = cp.b;
+			}
+		}
+	}
+
+	//number of points and bytes used by them
+	size_t size() const { return n_points; }
+	size_t sizeBytes() const
+	{
+		size_t bytes = tiles.capacity() * sizeof(Tile);
+		for (int k = 0; k < tiles.size(); k++)
+			bytes += tiles[k].points.capacity() * sizeof(CompactPoint);
+		return bytes;
+	}
+	int numTiles() const { return tiles.size(); }
+
+	void shrinkToFit()
+	{
+		for (int k = 0; k < tiles.size(); k++)
+			tiles[k].points.shrink_to_fit();
+	}
+
+private:
+	double q, inv_q, tile_size;
+	std::vector<Tile> tiles;
+	std::unordered_map<uint64_t, int> tile_index;	//tile key -> index in tiles
+	size_t n_points = 0;
+
+	int findTile(const int64_t *idx)
+	{
+		uint64_t key = ((uint64_t)(idx[0] & 0x1FFFFF) << 42) | ((uint64_t)(idx[1] & 0x1FFFFF) << 21) | (uint64_t)(idx[2] & 0x1FFFFF);
+		std::unordered_map<uint64_t, int>::const_iterator it = tile_index.find(key);
+		if (it != tile_index.end())
+			return it->second;
+		Tile t;
+		for (int a = 0; a < 3; a++)
+			t.origin[a] = (idx[a] + 0.5) * tile_size;
+		tiles.push_back(t);
+		tile_index[key] = tiles.size() - 1;
+		return tiles.size() - 1;
+	}
+};
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef DISPARITY_FILTER_H
+#define DISPARITY_FILTER_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <opencv2/core.hpp>
+
+//Edge preserving denoising of a disparity image evaluated only at the pixels that are read afterwards, the
+//sampled grid and the keypoints, instead of the whole image. Single channel uchar, float or double images.
+//bilateral: the weights of cv::bilateralFilter(disp, dst, d, sigma_color, sigma_space) with the default reflect 101
+//	border and float accumulation. For uchar images, with OpenCV's color weight table and rounding, it reproduces the
+//	full image filter at the evaluated pixels up to float summation order. Float and double images use exp() of the
+//	exact difference where OpenCV interpolates a binned table, so results differ slightly. O(window area) per pixel.
+//guided: self guided filter q = mean + a * (I - mean), a = var / (var + sigma_color^2) over the (2r+1)^2 window,
+//	without the second averaging of a and b. Window sums come from integral images of I and I^2 built once in the
+//	constructor, O(image) there and O(1) per evaluated pixel.
+//Instances are read only after construction, rows can be filtered from several threads.
+class SparseDisparityFilter {
+public:
+	enum Mode { bilateral, guided };
+
+	SparseDisparityFilter(const cv::Mat &disp, int d, double sigma_color, double sigma_space, Mode mode) : src(disp), mode(mode)
+	{
+		if (sigma_color <= 0)
+			sigma_color = 1;
+		if (sigma_space <= 0)
+			sigma_space = 1;
+		radius = d <= 0 ? cvRound(sigma_space * 1.5) : d / 2;
+		radius = std::max(radius, 1);
+		double gauss_color_coeff = -0.5 / (sigma_color * sigma_color);
+		double gauss_space_coeff = -0.5 / (sigma_space * sigma_space);
+		color_coeff = gauss_color_coeff;
+		eps = sigma_color * sigma_color;
+
+		if (mode == guided)
+			buildIntegrals();
+
+		color_weight.resize(256);
+		for (int i = 0; i < 256; i++)
+			color_weight[i] = (float)std::exp(i * i * gauss_color_coeff);
+		for (int i = -radius; i <= radius; i++)
+		{
+			for (int j = -radius; j <= radius; j++)
+			{
+				double r = std::sqrt((double)i * i + (double)j * j);
+				if (r > radius)
+					continue;
+				space_weight.push_back((float)std::exp(r * r * gauss_space_coeff));
+				space_dy.push_back(i);
+				space_dx.push_back(j);
+			}
+		}
+	}
+
+	int windowRadius() const { return radius; }
+
+	//filter pixels x_start, x_start + step, ... < x_end of row y into the same row of dst, a copy of the source
+	void filterRow(cv::Mat &dst, int y, int x_start, int x_end, int step) const
+	{
+		switch (src.depth())
+		{
+		case CV_8U: filterRowT<unsigned char>(dst, y, x_start, x_end, step); break;
+		case CV_32F: filterRowT<float>(dst, y, x_start, x_end, step); break;
+		case CV_64F: filterRowT<double>(dst, y, x_start, x_end, step); break;
+		}
+	}
+
+	//filter a single pixel of dst
+	void filterPixel(cv::Mat &dst, int x, int y) const
+	{
+		switch (src.depth())
+		{
+		case CV_8U: store(dst.at<unsigned char>(y, x), valueAt<unsigned char>(x, y)); break;
+		case CV_32F: store(dst.at<float>(y, x), valueAt<float>(x, y)); break;
+		case CV_64F: store(dst.at<double>(y, x), valueAt<double>(x, y)); break;
+		}
+	}
+
+private:
+	cv::Mat src;
+	Mode mode;
+	int radius;
+	double color_coeff, eps;
+	std::vector<float> color_weight;	//by uchar difference
+	std::vector<float> space_weight;
+	std::vector<int> space_dy, space_dx;
+	std::vector<double> integral_s, integral_ss;	//(rows + 1) x (cols + 1) sums of I and I^2 above and left of a pixel
+
+	//reflect 101 border, like cv::BORDER_DEFAULT
+	static inline int reflect(int p, int n)
+	{
+		if (n == 1)
+			return 0;
+		while (p < 0 || p >= n)
+			p = p < 0 ? -p : 2 * n - 2 - p;
+		return p;
+	}
+
+	template<typename T>
+	inline float colorWeight(T a, T b) const
+	{
+		return (float)std::exp((double)(a - b) * (a - b) * color_coeff);
+	}
+
+	inline float colorWeight(unsigned char a, unsigned char b) const
+	{
+		return color_weight[std::abs((int)a - (int)b)];
+	}
+
+	static inline void store(unsigned char &out, double v) { out = cv::saturate_cast<unsigned char>(cvRound(v)); }
+	static inline void store(float &out, double v) { out = (float)v; }
+	static inline void store(double &out, double v) { out = v; }
+
+	template<typename T>
+	double valueAt(int x, int y) const
+	{
+		if (mode == guided)
+			return guidedValue(src.ptr<T>(y)[x], x, y);
+		bool inside = x >= radius && y >= radius && x + radius < src.cols && y + radius < src.rows;
+		T val0 = src.ptr<T>(y)[x];
+		float sum = 0, wsum = 0;
+		for (int k = 0; k < space_weight.size(); k++)
+		{
+			int yy = y + space_dy[k], xx = x + space_dx[k];
+			if (!inside)
+			{
+				yy = reflect(yy, src.rows);
+				xx = reflect(xx, src.cols);
+			}
+			T val = src.ptr<T>(yy)[xx];
+			float w = space_weight[k] * colorWeight(val, val0);
+			sum += val * w;
+			wsum += w;
+		}
+		return sum / wsum;
+	}
+
+	//guided filter output for value v at (x, y), window clipped at the image border
+	inline double guidedValue(double v, int x, int y) const
+	{
+		const size_t stride = src.cols + 1;
+		size_t x0 = std::max(x - radius, 0), x1 = std::min(x + radius, src.cols - 1) + 1;
+		size_t y0 = std::max(y - radius, 0), y1 = std::min(y + radius, src.rows - 1) + 1;
+		double s = integral_s[y1 * stride + x1] - integral_s[y0 * stride + x1] - integral_s[y1 * stride + x0] + integral_s[y0 * stride + x0];
+		double ss = integral_ss[y1 * stride + x1] - integral_ss[y0 * stride + x1] - integral_ss[y1 * stride + x0] + integral_ss[y0 * stride + x0];
+		int n = (x1 - x0) * (y1 - y0);
+		double mean = s / n;
+		double var = std::max(ss / n - mean * mean, 0.0);
+		double a = var / (var + eps);
+		return mean + a * (v - mean);
+	}
+
+	void buildIntegrals()
+	{
+		switch (src.depth())
+		{
+		case CV_8U: buildIntegralsT<unsigned char>(); break;
+		case CV_32F: buildIntegralsT<float>(); break;
+		case CV_64F: buildIntegralsT<double>(); break;
+		}
+	}
+
+	template<typename T>
+	void buildIntegralsT()
+	{
+		const size_t stride = src.cols + 1;
+		integral_s.assign((src.rows + 1) * stride, 0.0);
+		integral_ss.assign((src.rows + 1) * stride, 0.0);
+		for (int y = 0; y < src.rows; y++)
+		{
+			const T *row = src.ptr<T>(y);
+			double row_s = 0, row_ss = 0;
+			for (int x = 0; x < src.cols; x++)
+			{
+				row_s += row[x];
+				row_ss += (double)row[x] * row[x];
+				integral_s[(y + 1) * stride + x + 1] = integral_s[y * stride + x + 1] + row_s;
+				integral_ss[(y + 1) * stride + x + 1] = integral_ss[y * stride + x + 1] + row_ss;
+			}
+		}
+	}
+
+	template<typename T>
+	void filterRowT(cv::Mat &dst, int y, int x_start, int x_end, int step) const
+	{
+		T *out = dst.ptr<T>(y);
+		if (mode == bilateral)
+		{
+			for (int x = x_start; x < x_end; x += step)
+				store(out[x], valueAt<T>(x, y));
+			return;
+		}
+		const T *row = src.ptr<T>(y);
+		for (int x = x_start; x < x_end; x += step)
+			store(out[x], guidedValue(row[x], x, y));
+	}
+};
+
+#endif
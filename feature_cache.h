@@ -0,0 +1,211 @@
+#ifndef FEATURE_CACHE_H
+#define FEATURE_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <opencv2/core.hpp>
+
+//what the matching stage derives from one image: disparity variance gate input, ORB keypoints and descriptors,
+//keypoints lifted to 3D and their ROI flags. has_features is false for images rejected by the variance gate
+struct FeatureCacheEntry {
+	double disp_img_var = 0;
+	bool has_features = false;
+	std::vector<cv::KeyPoint> keypoints;
+	cv::Mat descriptors;	//CV_8U, one row per keypoint
+	std::vector<cv::Point3f> keypoints3D;
+	std::vector<bool> in_roi;
+};
+
+//On-disk cache of FeatureCacheEntry, one file per image named <img_num>_<params hash>.feat.
+//The hash covers everything the entries depend on (calibration, image size, ROI settings), so changing any of it
+//misses the cache instead of reading stale features. Files are read with mmap and written to a temporary name
+//first, so concurrent runs on the same directory never see partial files.
+//File layout: Header, n keypoints (StoredKeyPoint), n descriptor rows, n*3 floats of 3D keypoints, n ROI bytes.
+class FeatureCache {
+public:
+	FeatureCache() : params_hash(0), hits(0), misses(0), stores(0) {}
+
+	//empty dir disables the cache
+	void open(const std::string &cache_dir, uint64_t hash)
+	{
+		dir = cache_dir;
+		params_hash = hash;
+		if (!dir.empty())
+			mkdir(dir.c_str(), 0755);
+	}
+
+	bool enabled() const { return !dir.empty(); }
+
+	bool load(int img_num, FeatureCacheEntry &entry)
+	{
+		if (!enabled())
+			return false;
+		int fd = ::open(path(img_num).c_str(), O_RDONLY);
+		if (fd < 0)
+		{
+			misses++;
+			return false;
+		}
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(Header);
+		void *map = ok ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		close(fd);
+		if (map == MAP_FAILED)
+		{
+			misses++;
+			return false;
+		}
+		ok = parse((const unsigned char*)map, st.st_size, img_num, entry);
+		munmap(map, st.st_size);
+		if (ok)
+			hits++;
+		else
+			misses++;
+		return ok;
+	}
+
+	bool store(int img_num, const FeatureCacheEntry &entry)
+	{
+		if (!enabled())
+			return false;
+		Header h;
+		memcpy(h.magic, "POSEFEAT", 8);
+		h.version = version;
+		h.has_features = entry.has_features ? 1 : 0;
+		h.params_hash = params_hash;
+		h.img_num = img_num;
+		h.n_keypoints = entry.has_features ? entry.keypoints.size() : 0;
+		h.descriptor_bytes = entry.has_features && !entry.descriptors.empty() ? entry.descriptors.cols * entry.descriptors.elemSize() : 0;
+		h.reserved = 0;
+		h.disp_img_var = entry.disp_img_var;
+		if (h.n_keypoints > 0 && (entry.keypoints3D.size() != h.n_keypoints || entry.in_roi.size() != h.n_keypoints || entry.descriptors.rows != h.n_keypoints))
+			return false;
+
+		std::vector<unsigned char> buf(sizeof(Header) + (size_t)h.n_keypoints * (sizeof(StoredKeyPoint) + h.descriptor_bytes + 3 * sizeof(float) + 1));
+		unsigned char *p = buf.data();
+		memcpy(p, &h, sizeof(Header));
+		p += sizeof(Header);
+		for (int i = 0; i < h.n_keypoints; i++, p += sizeof(StoredKeyPoint))
+		{
+			const cv::KeyPoint &kp = entry.keypoints[i];
+			StoredKeyPoint s = { kp.pt.x, kp.pt.y, kp.size, kp.angle, kp.response, kp.octave, kp.class_id };
+			memcpy(p, &s, sizeof(StoredKeyPoint));
+		}
+		for (int i = 0; i < h.n_keypoints; i++, p += h.descriptor_bytes)
+			memcpy(p, entry.descriptors.ptr<unsigned char>(i), h.descriptor_bytes);
+		for (int i = 0; i < h.n_keypoints; i++, p += 3 * sizeof(float))
+		{
+			float xyz[3] = { entry.keypoints3D[i].x, entry.keypoints3D[i].y, entry.keypoints3D[i].z };
+			memcpy(p, xyz, sizeof(xyz));
+		}
+		for (int i = 0; i < h.n_keypoints; i++, p++)
+			*p = entry.in_roi[i] ? 1 : 0;
+
+		std::string final_path = path(img_num);
+		std::string tmp_path = final_path + ".tmp" + std::to_string(getpid()) + "_" + std::to_string(stores.fetch_add(1));
+		FILE *f = fopen(tmp_path.c_str(), "wb");
+		if (f == NULL)
+			return false;
+		bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+		ok = fclose(f) == 0 && ok;
+		if (!ok || rename(tmp_path.c_str(), final_path.c_str()) != 0)
+		{
+			remove(tmp_path.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	int hitCount() const { return hits; }
+	int missCount() const { return misses; }
+	int storeCount() const { return stores; }
+
+	//FNV-1a, chain calls to hash several fields
+	static uint64_t hashBytes(const void *data, size_t size, uint64_t h = 14695981039346656037ULL)
+	{
+		const unsigned char *p = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++)
+		{
+			h ^= p[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+private:
+	static const uint32_t version = 1;	//bump when the layout or the way features are computed changes
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t has_features;
+		uint64_t params_hash;
+		int32_t img_num;
+		int32_t n_keypoints;
+		int32_t descriptor_bytes;
+		int32_t reserved;
+		double disp_img_var;
+	};
+	struct StoredKeyPoint {
+		float x, y, size, angle, response;
+		int32_t octave, class_id;
+	};
+
+	std::string dir;
+	uint64_t params_hash;
+	std::atomic<int> hits, misses, stores;
+
+	std::string path(int img_num) const
+	{
+		char hash_hex[17];
+		snprintf(hash_hex, sizeof(hash_hex), "%016llx", (unsigned long long)params_hash);
+		return dir + "/" + std::to_string(img_num) + "_" + hash_hex + ".feat";
+	}
+
+	bool parse(const unsigned char *data, size_t size, int img_num, FeatureCacheEntry &entry) const
+	{
+		Header h;
+		memcpy(&h, data, sizeof(Header));
+		if (memcmp(h.magic, "POSEFEAT", 8) != 0 || h.version != version || h.params_hash != params_hash || h.img_num != img_num
+			|| h.n_keypoints < 0 || h.descriptor_bytes < 0)
+			return false;
+		size_t n = h.n_keypoints;
+		if (size != sizeof(Header) + n * (sizeof(StoredKeyPoint) + h.descriptor_bytes + 3 * sizeof(float) + 1))
+			return false;
+
+		entry.disp_img_var = h.disp_img_var;
+		entry.has_features = h.has_features != 0;
+		const unsigned char *p = data + sizeof(Header);
+		entry.keypoints.resize(n);
+		for (size_t i = 0; i < n; i++, p += sizeof(StoredKeyPoint))
+		{
+			StoredKeyPoint s;
+			memcpy(&s, p, sizeof(StoredKeyPoint));
+			entry.keypoints[i] = cv::KeyPoint(s.x, s.y, s.size, s.angle, s.response, s.octave, s.class_id);
+		}
+		entry.descriptors.create(n, h.descriptor_bytes, CV_8U);
+		for (size_t i = 0; i < n; i++, p += h.descriptor_bytes)
+			memcpy(entry.descriptors.ptr<unsigned char>(i), p, h.descriptor_bytes);
+		entry.keypoints3D.resize(n);
+		for (size_t i = 0; i < n; i++, p += 3 * sizeof(float))
+		{
+			float xyz[3];
+			memcpy(xyz, p, sizeof(xyz));
+			entry.keypoints3D[i] = cv::Point3f(xyz[0], xyz[1], xyz[2]);
+		}
+		entry.in_roi.resize(n);
+		for (size_t i = 0; i < n; i++, p++)
+			entry.in_roi[i] = *p != 0;
+		return true;
+	}
+};
+
+#endif
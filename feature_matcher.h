@@ -0,0 +1,280 @@
+#ifndef FEATURE_MATCHER_H
+#define FEATURE_MATCHER_H
+
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <future>
+#include <opencv2/opencv_modules.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+#include <opencv2/cudafeatures2d.hpp>
+#endif
+#if defined(__AVX2__) || defined(__POPCNT__)
+#include <immintrin.h>
+#endif
+#include "thread_pool.h"
+
+//descriptors of one image, in the form the matcher backend needs them.
+//prepared once per image by FeatureMatcher::prepare and reused for every pair it is matched in
+struct MatchDescriptors {
+	cv::Mat cpu;
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+	cv::cuda::GpuMat gpu;
+#endif
+};
+
+//pluggable brute force knn descriptor matcher, selected at runtime with --matcher
+class FeatureMatcher {
+public:
+	virtual ~FeatureMatcher() {}
+	virtual std::string name() const = 0;
+	virtual void prepare(const cv::Mat &descriptors, MatchDescriptors &out) = 0;
+	//k nearest train descriptors of every query descriptor, sorted by distance
+	virtual void knnMatch(const MatchDescriptors &query, const MatchDescriptors &train, std::vector<std::vector<cv::DMatch> > &matches, int k) = 0;
+
+	//match one query set against many train sets with the ratio test: good_matches[i] gets the best match into
+	//train_sets[i] of every query whose distance < ratio * second best distance and < max_distance
+	virtual void matchMany(const MatchDescriptors &query, const std::vector<const MatchDescriptors*> &train_sets,
+		float ratio, float max_distance, std::vector<std::vector<cv::DMatch> > &good_matches)
+	{
+		good_matches.assign(train_sets.size(), std::vector<cv::DMatch>());
+		std::vector<std::vector<cv::DMatch> > matches;
+		for (int i = 0; i < train_sets.size(); i++)
+		{
+			knnMatch(query, *train_sets[i], matches, 2);
+			for (int q = 0; q < matches.size(); q++)
+				if (matches[q].size() == 2 && matches[q][0].distance < ratio * matches[q][1].distance && matches[q][0].distance < max_distance)
+					good_matches[i].push_back(matches[q][0]);
+		}
+	}
+};
+
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+//cuda brute force Hamming matcher, descriptors are uploaded to the gpu once in prepare
+class CudaFeatureMatcher : public FeatureMatcher {
+public:
+	CudaFeatureMatcher() : matcher(cv::cuda::DescriptorMatcher::createBFMatcher(cv::NORM_HAMMING)) {}
+	std::string name() const { return "cuda"; }
+	void prepare(const cv::Mat &descriptors, MatchDescriptors &out)
+	{
+		out.gpu.upload(descriptors);
+	}
+	void knnMatch(const MatchDescriptors &query, const MatchDescriptors &train, std::vector<std::vector<cv::DMatch> > &matches, int k)
+	{
+		matcher->knnMatch(query.gpu, train.gpu, matches, k);
+	}
+private:
+	cv::Ptr<cv::cuda::DescriptorMatcher> matcher;
+};
+#endif
+
+//multi threaded brute force Hamming kNN on the cpu for binary (ORB) descriptors.
+//descriptors are kept packed as rows of 64 bit words. 32 byte ORB descriptors are compared with AVX2
+//(4 train descriptors per step, nibble lookup popcount), otherwise with POPCNT or the compiler builtin.
+//queries are split in blocks over the task pool. Ties keep the lower train index, like cv::BFMatcher.
+class CpuHammingMatcher : public FeatureMatcher {
+public:
+	static const int query_block = 64;
+
+	explicit CpuHammingMatcher(ThreadPool *pool = NULL) : pool(pool) {}
+	std::string name() const { return "cpu"; }
+
+	void prepare(const cv::Mat &descriptors, MatchDescriptors &out)
+	{
+		if (descriptors.empty())
+		{
+			out.cpu = cv::Mat();
+			return;
+		}
+		if (descriptors.depth() != CV_8U)
+			throw "Exception: CpuHammingMatcher needs binary CV_8U descriptors!";
+		//pad rows to whole 64 bit words and make them continuous
+		int words = (descriptors.cols + 7) / 8;
+		out.cpu = cv::Mat::zeros(descriptors.rows, words * 8, CV_8U);
+		descriptors.copyTo(out.cpu(cv::Rect(0, 0, descriptors.cols, descriptors.rows)));
+	}
+
+	void knnMatch(const MatchDescriptors &query, const MatchDescriptors &train, std::vector<std::vector<cv::DMatch> > &matches, int k)
+	{
+		matches.clear();
+		const int n_query = query.cpu.rows;
+		matches.resize(n_query);
+		if (n_query == 0 || train.cpu.rows == 0 || k <= 0)
+			return;
+		if (query.cpu.cols != train.cpu.cols)
+			throw "Exception: CpuHammingMatcher descriptor sizes differ!";
+
+		if (pool == NULL || pool->size() <= 1 || n_query <= query_block)
+		{
+			matchRange(query.cpu, train.cpu, k, 0, n_query, matches);
+			return;
+		}
+		std::vector<std::future<void> > tasks;
+		for (int start = 0; start < n_query; start += query_block)
+			tasks.push_back(pool->submit(&CpuHammingMatcher::matchRange, this, std::cref(query.cpu), std::cref(train.cpu), k, start, std::min(start + query_block, n_query), std::ref(matches)));
+		pool->wait(tasks);
+	}
+
+	//one parallel job for all pairs: every (train set, query block) is a task running the 2-nn search and
+	//ratio test together, so no knn match vectors are built. Block results are joined in query order.
+	void matchMany(const MatchDescriptors &query, const std::vector<const MatchDescriptors*> &train_sets,
+		float ratio, float max_distance, std::vector<std::vector<cv::DMatch> > &good_matches)
+	{
+		const int n_sets = train_sets.size();
+		const int n_query = query.cpu.rows;
+		const int n_blocks = (n_query + query_block - 1) / query_block;
+		good_matches.assign(n_sets, std::vector<cv::DMatch>());
+		if (n_sets == 0 || n_query == 0)
+			return;
+		for (int i = 0; i < n_sets; i++)
+			if (train_sets[i]->cpu.rows > 0 && train_sets[i]->cpu.cols != query.cpu.cols)
+				throw "Exception: CpuHammingMatcher descriptor sizes differ!";
+
+		std::vector<std::vector<cv::DMatch> > block_matches(n_sets * n_blocks);
+		if (pool == NULL || pool->size() <= 1)
+		{
+			for (int i = 0; i < n_sets; i++)
+				ratioMatchRange(query.cpu, train_sets[i]->cpu, ratio, max_distance, 0, n_query, block_matches[i * n_blocks]);
+		}
+		else
+		{
+			std::vector<std::future<void> > tasks;
+			for (int i = 0; i < n_sets; i++)
+				for (int b = 0; b < n_blocks; b++)
+					tasks.push_back(pool->submit(&CpuHammingMatcher::ratioMatchRange, this, std::cref(query.cpu), std::cref(train_sets[i]->cpu), ratio, max_distance,
+						b * query_block, std::min((b + 1) * query_block, n_query), std::ref(block_matches[i * n_blocks + b])));
+			pool->wait(tasks);
+		}
+		for (int i = 0; i < n_sets; i++)
+			for (int b = 0; b < n_blocks; b++)
+				good_matches[i].insert(good_matches[i].end(), block_matches[i * n_blocks + b].begin(), block_matches[i * n_blocks + b].end());
+	}
+
+	static inline int popcount64(uint64_t x)
+	{
+#if defined(__POPCNT__)
+		return (int)_mm_popcnt_u64(x);
+#else
+		return __builtin_popcountll(x);
+#endif
+	}
+
+	static inline int hamming(const uint64_t *a, const uint64_t *b, int words)
+	{
+		int d = 0;
+		for (int w = 0; w < words; w++)
+			d += popcount64(a[w] ^ b[w]);
+		return d;
+	}
+
+private:
+	ThreadPool *pool;
+
+	void matchRange(const cv::Mat &query, const cv::Mat &train, int k, int start, int end, std::vector<std::vector<cv::DMatch> > &matches) const
+	{
+		const int words = query.cols / 8;
+		const int n_train = train.rows;
+		const int kk = std::min(k, n_train);
+		std::vector<int> best_dist(kk), best_idx(kk);
+		std::vector<int> dist(n_train);
+
+		for (int q = start; q < end; q++)
+		{
+			const uint64_t *qd = query.ptr<uint64_t>(q);
+			distances(qd, train, words, &dist[0]);
+
+			//keep the kk smallest distances, insertion sorted
+			int n_best = 0;
+			for (int t = 0; t < n_train; t++)
+			{
+				int d = dist[t];
+				if (n_best == kk && d >= best_dist[kk - 1])
+					continue;
+				int pos = (n_best < kk) ? n_best++ : kk - 1;
+				while (pos > 0 && best_dist[pos - 1] > d)
+				{
+					best_dist[pos] = best_dist[pos - 1];
+					best_idx[pos] = best_idx[pos - 1];
+					pos--;
+				}
+				best_dist[pos] = d;
+				best_idx[pos] = t;
+			}
+
+			std::vector<cv::DMatch> &m = matches[q];
+			m.resize(n_best);
+			for (int j = 0; j < n_best; j++)
+				m[j] = cv::DMatch(q, best_idx[j], 0, (float)best_dist[j]);
+		}
+	}
+
+	void ratioMatchRange(const cv::Mat &query, const cv::Mat &train, float ratio, float max_distance, int start, int end, std::vector<cv::DMatch> &good) const
+	{
+		const int words = query.cols / 8;
+		const int n_train = train.rows;
+		if (n_train < 2)
+			return;
+		std::vector<int> dist(n_train);
+		for (int q = start; q < end; q++)
+		{
+			distances(query.ptr<uint64_t>(q), train, words, &dist[0]);
+			int best = INT_MAX, second = INT_MAX, best_idx = -1;
+			for (int t = 0; t < n_train; t++)
+			{
+				int d = dist[t];
+				if (d < best)
+				{
+					second = best;
+					best = d;
+					best_idx = t;
+				}
+				else if (d < second)
+					second = d;
+			}
+			if (best < ratio * second && best < max_distance)
+				good.push_back(cv::DMatch(q, best_idx, 0, (float)best));
+		}
+	}
+
+	//Hamming distances of one query descriptor to all train descriptors
+	static void distances(const uint64_t *qd, const cv::Mat &train, int words, int *dist)
+	{
+		const int n_train = train.rows;
+		int t = 0;
+#if defined(__AVX2__)
+		if (words == 4)
+		{
+			const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4, 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+			const __m256i low_mask = _mm256_set1_epi8(0x0f);
+			const __m256i vq = _mm256_loadu_si256((const __m256i*)qd);
+			const uint8_t *base = train.ptr<uint8_t>(0);
+			for (; t + 4 <= n_train; t += 4)
+			{
+				__m256i s[4];
+				for (int j = 0; j < 4; j++)
+				{
+					__m256i x = _mm256_xor_si256(vq, _mm256_loadu_si256((const __m256i*)(base + (size_t)(t + j) * 32)));
+					__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low_mask)),
+						_mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask)));
+					s[j] = _mm256_sad_epu8(cnt, _mm256_setzero_si256());		//4 partial sums per descriptor
+				}
+				//reduce the partial sums of the 4 descriptors into one vector of 4 distances
+				__m256i s01 = _mm256_add_epi64(_mm256_unpacklo_epi64(s[0], s[1]), _mm256_unpackhi_epi64(s[0], s[1]));
+				__m256i s23 = _mm256_add_epi64(_mm256_unpacklo_epi64(s[2], s[3]), _mm256_unpackhi_epi64(s[2], s[3]));
+				__m256i d = _mm256_add_epi64(_mm256_permute2x128_si256(s01, s23, 0x20), _mm256_permute2x128_si256(s01, s23, 0x31));
+				int64_t out[4];
+				_mm256_storeu_si256((__m256i*)out, d);
+				dist[t] = (int)out[0]; dist[t + 1] = (int)out[1]; dist[t + 2] = (int)out[2]; dist[t + 3] = (int)out[3];
+			}
+		}
+#endif
+		for (; t < n_train; t++)
+			dist[t] = hamming(qd, train.ptr<uint64_t>(t), words);
+	}
+};
+
+#endif
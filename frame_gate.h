@@ -0,0 +1,119 @@
+#ifndef FRAME_GATE_H
+#define FRAME_GATE_H
+
+#include <cmath>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+//why a frame was dropped before it got a pose
+enum FrameRejection {
+	reject_missing_disparity,
+	reject_noisy_disparity,
+	reject_missing_rgb,
+	reject_missing_segment_label,
+	reject_low_matches,
+	n_frame_rejections
+};
+
+inline const char* frameRejectionName(int reason)
+{
+	static const char* names[n_frame_rejections] = { "missing_disparity", "noisy_disparity", "missing_rgb", "missing_segment_label", "low_matches" };
+	return names[reason];
+}
+
+//Disparity statistics of the region x_start <= x < x_end, y_start <= y < y_end of a uchar disparity image,
+//on every step-th row and column. Only disparities > min_disparity contribute to the sums, but the mean and variance
+//are normalized by all sampled pixels, exactly like the original two pass getMean/getVariance.
+//One pass: the sums of d and d*d are exact integers, so the variance follows from them without the
+//cancellation a floating point single pass has, and equals the two pass result up to rounding.
+struct DisparityStats {
+	int64_t n_sampled = 0;
+	int64_t n_valid = 0;
+	double mean = 0;
+	double variance = 0;
+};
+
+inline DisparityStats disparityStats(const cv::Mat &disp, int x_start, int x_end, int y_start, int y_end, double min_disparity, int step = 1)
+{
+	DisparityStats stats;
+	if (step < 1)
+		step = 1;
+	if (x_end <= x_start || y_end <= y_start)
+		return stats;
+	//for integer d, d > min_disparity <=> d > floor(min_disparity)
+	int threshold = (int)std::floor(min_disparity);
+	threshold = threshold < -1 ? -1 : (threshold > 255 ? 255 : threshold);
+	int64_t n_x = (x_end - x_start + step - 1) / step;
+	int64_t n_y = (y_end - y_start + step - 1) / step;
+
+	int64_t s1 = 0, s2 = 0, n = 0;
+	for (int y = y_start; y < y_end; y += step)
+	{
+		const unsigned char *row = disp.ptr<unsigned char>(y);
+		int x = x_start;
+#if defined(__AVX2__)
+		if (step == 1 && threshold < 255)
+		{
+			//valid bytes: max(d, threshold + 1) == d
+			const __m256i lower = _mm256_set1_epi8((char)(threshold + 1));
+			const __m256i zero = _mm256_setzero_si256();
+			const __m256i one = _mm256_set1_epi8(1);
+			__m256i v_s1 = zero, v_n = zero, v_s2 = zero;
+			//32 bit lanes of v_s2 take at most 2*255*255 per iteration, flushed well before they could overflow
+			int since_flush = 0;
+			for (; x + 32 <= x_end; x += 32)
+			{
+				__m256i d = _mm256_loadu_si256((const __m256i*)(row + x));
+				__m256i valid = _mm256_cmpeq_epi8(_mm256_max_epu8(d, lower), d);
+				d = _mm256_and_si256(d, valid);
+				v_s1 = _mm256_add_epi64(v_s1, _mm256_sad_epu8(d, zero));
+				v_n = _mm256_add_epi64(v_n, _mm256_sad_epu8(_mm256_and_si256(valid, one), zero));
+				__m256i lo = _mm256_unpacklo_epi8(d, zero), hi = _mm256_unpackhi_epi8(d, zero);
+				v_s2 = _mm256_add_epi32(v_s2, _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi)));
+				if (++since_flush == 4096)
+				{
+					int32_t part[8];
+					_mm256_storeu_si256((__m256i*)part, v_s2);
+					for (int k = 0; k < 8; k++)
+						s2 += (uint32_t)part[k];
+					v_s2 = zero;
+					since_flush = 0;
+				}
+			}
+			int64_t part64[4];
+			_mm256_storeu_si256((__m256i*)part64, v_s1);
+			s1 += part64[0] + part64[1] + part64[2] + part64[3];
+			_mm256_storeu_si256((__m256i*)part64, v_n);
+			n += part64[0] + part64[1] + part64[2] + part64[3];
+			int32_t part[8];
+			_mm256_storeu_si256((__m256i*)part, v_s2);
+			for (int k = 0; k < 8; k++)
+				s2 += (uint32_t)part[k];
+		}
+#endif
+		for (; x < x_end; x += step)
+		{
+			int d = row[x];
+			if (d > threshold)
+			{
+				s1 += d;
+				s2 += d * d;
+				n++;
+			}
+		}
+	}
+
+	double n_total = (double)(n_x * n_y);
+	stats.n_sampled = n_x * n_y;
+	stats.n_valid = n;
+	stats.mean = s1 / n_total;
+	//sum over valid d of (d - mean)^2 = s2 - 2*mean*s1 + n*mean^2
+	double sq = s2 - 2.0 * stats.mean * s1 + n * stats.mean * stats.mean;
+	stats.variance = n_total > 1 ? sq / (n_total - 1) : 0;
+	return stats;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef KEYPOINT_STORE_H
+#define KEYPOINT_STORE_H
+
+#include <cstdint>
+#include <vector>
+#include <Eigen/Core>
+#include <opencv2/core.hpp>
+#include <pcl/point_cloud.h>
+
+//3D positions of the keypoints of one image, stored column wise (12 bytes per keypoint instead of a 32 byte
+//PointXYZRGB) with a bitmap of the keypoints inside the ROI. Indices are keypoint indices, the same the
+//matcher reports in DMatch::queryIdx/trainIdx. Descriptor rows stay in ImageData::match_descriptors.
+class KeypointStore {
+public:
+	std::vector<float> x, y, z;
+
+	void reserve(int n)
+	{
+		x.reserve(n);
+		y.reserve(n);
+		z.reserve(n);
+		roi_bits.reserve((n + 63) / 64);
+	}
+
+	void add(float px, float py, float pz, bool in_roi)
+	{
+		int i = x.size();
+		x.push_back(px);
+		y.push_back(py);
+		z.push_back(pz);
+		if ((i & 63) == 0)
+			roi_bits.push_back(0);
+		if (in_roi)
+		{
+			roi_bits[i >> 6] |= (uint64_t)1 << (i & 63);
+			n_roi++;
+		}
+	}
+
+	int size() const { return x.size(); }
+	int roiCount() const { return n_roi; }
+	bool inROI(int i) const { return (roi_bits[i >> 6] >> (i & 63)) & 1; }
+
+	//append the matches with both keypoints inside the ROI to src_out and dst_out, transformed by src_tf and dst_tf.
+	//returns the number of correspondences added. Nothing is allocated if the outputs have room for all matches
+	template<typename PointT>
+	static int gatherMatches(const KeypointStore &src, const KeypointStore &dst, const std::vector<cv::DMatch> &matches,
+		const Eigen::Matrix4f &src_tf, const Eigen::Matrix4f &dst_tf, pcl::PointCloud<PointT> &src_out, pcl::PointCloud<PointT> &dst_out)
+	{
+		int added = 0;
+		for (int m = 0; m < matches.size(); m++)
+		{
+			int s = matches[m].queryIdx;
+			int d = matches[m].trainIdx;
+			if (!src.inROI(s) || !dst.inROI(d))
+				continue;
+			src_out.points.push_back(transformed<PointT>(src_tf, src.x[s], src.y[s], src.z[s]));
+			dst_out.points.push_back(transformed<PointT>(dst_tf, dst.x[d], dst.y[d], dst.z[d]));
+			added++;
+		}
+		src_out.width = src_out.points.size();
+		src_out.height = 1;
+		dst_out.width = dst_out.points.size();
+		dst_out.height = 1;
+		return added;
+	}
+
+private:
+	std::vector<uint64_t> roi_bits;
+	int n_roi = 0;
+
+	template<typename PointT>
+	static inline PointT transformed(const Eigen::Matrix4f &T, float px, float py, float pz)
+	{
+		PointT p;
+		p.x = T(0, 0) * px + T(0, 1) * py + T(0, 2) * pz + T(0, 3);
+		p.y = T(1, 0) * px + T(1, 1) * py + T(1, 2) * pz + T(1, 3);
+		p.z = T(2, 0) * px + T(2, 1) * py + T(2, 2) * pz + T(2, 3);
+		return p;
+	}
+};
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef LOCKED_STREAM_H
+#define LOCKED_STREAM_H
+
+#include <mutex>
+#include <ostream>
+
+//Stream shared by several threads, locked for one statement: the temporary returned by a function like
+//Pose::logStream() holds the mutex until the end of the full expression, so
+//	logStream() << a << b << endl;
+//is written as a whole. Do not call functions that write the same stream inside such a statement.
+class LockedStream {
+public:
+	LockedStream(std::ostream &out, std::mutex &mu) : out(out), lock(mu) {}
+
+	template<typename T>
+	LockedStream& operator<<(const T &v)
+	{
+		out << v;
+		return *this;
+	}
+
+	//endl, flush
+	LockedStream& operator<<(std::ostream& (*manip)(std::ostream&))
+	{
+		manip(out);
+		return *this;
+	}
+
+private:
+	std::ostream &out;
+	std::unique_lock<std::mutex> lock;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef MATCH_CACHE_H
+#define MATCH_CACHE_H
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <opencv2/core.hpp>
+
+//Ratio tested matches of image pairs, keyed by (src, dst) raw image index. A pair is matched once: retries with a
+//larger search radius and later re-alignment passes only match pairs that are not in the cache yet.
+//Pairs with too few matches to be used are kept too, as empty lists, so they are not matched again either.
+//When the matches take more than max_bytes, the pairs of the oldest source images are dropped.
+//Entries stay valid until their source image is erased or evicted. Not thread safe.
+class MatchCache {
+public:
+	explicit MatchCache(size_t max_bytes = 256u << 20) : max_bytes(max_bytes) {}
+
+	void setMaxBytes(size_t bytes) { max_bytes = bytes; }
+
+	//matches of the pair, NULL if it was not matched yet
+	const std::vector<cv::DMatch>* find(int src, int dst)
+	{
+		std::unordered_map<uint64_t, std::vector<cv::DMatch> >::const_iterator it = pairs.find(key(src, dst));
+		if (it == pairs.end())
+		{
+			misses++;
+			return NULL;
+		}
+		hits++;
+		return &it->second;
+	}
+
+	//matches are moved into the cache, an existing entry of the pair is kept
+	const std::vector<cv::DMatch>* insert(int src, int dst, std::vector<cv::DMatch> &matches, bool keep_matches)
+	{
+		std::pair<std::unordered_map<uint64_t, std::vector<cv::DMatch> >::iterator, bool> res = pairs.insert(std::make_pair(key(src, dst), std::vector<cv::DMatch>()));
+		if (!res.second)
+			return &res.first->second;
+		if (keep_matches)
+		{
+			res.first->second.swap(matches);
+			bytes += res.first->second.size() * sizeof(cv::DMatch);
+		}
+		std::vector<int> &dsts = sources[src];
+		if (dsts.empty())
+			source_order.push_back(src);
+		dsts.push_back(dst);
+		evict(src);
+		return &res.first->second;
+	}
+
+	//drop all pairs of a source image, e.g. when it got rejected
+	void eraseSource(int src)
+	{
+		std::unordered_map<int, std::vector<int> >::iterator it = sources.find(src);
+		if (it == sources.end())
+			return;
+		for (int i = 0; i < it->second.size(); i++)
+		{
+			std::unordered_map<uint64_t, std::vector<cv::DMatch> >::iterator p = pairs.find(key(src, it->second[i]));
+			bytes -= p->second.size() * sizeof(cv::DMatch);
+			pairs.erase(p);
+		}
+		sources.erase(it);
+	}
+
+	int size() const { return pairs.size(); }
+	size_t sizeBytes() const { return bytes; }
+	long hitCount() const { return hits; }
+	long missCount() const { return misses; }
+
+private:
+	size_t max_bytes;
+	size_t bytes = 0;
+	long hits = 0, misses = 0;
+	std::unordered_map<uint64_t, std::vector<cv::DMatch> > pairs;
+	std::unordered_map<int, std::vector<int> > sources;		//source image -> its dst images in the cache
+	std::deque<int> source_order;		//source images in order of their first pair, may hold erased ones
+
+	static uint64_t key(int src, int dst) { return ((uint64_t)(uint32_t)src << 32) | (uint32_t)dst; }
+
+	//drop the oldest source images until the limit holds, never the one being inserted
+	void evict(int current_src)
+	{
+		while (bytes > max_bytes && !source_order.empty() && source_order.front() != current_src)
+		{
+			eraseSource(source_order.front());
+			source_order.pop_front();
+		}
+		//erased sources leave stale entries behind, drop them from the front
+		while (!source_order.empty() && source_order.front() != current_src && sources.find(source_order.front()) == sources.end())
+			source_order.pop_front();
+	}
+};
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef ORGANIZED_GRID_H
+#define ORGANIZED_GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+//3D points of the sampled pixel grid of one image, kept in their rows and columns so that image neighbours are
+//grid neighbours. Coordinates are stored per plane; cells without a point have valid = 0 and zero coordinates,
+//which keeps the filter loops free of branches and NaNs.
+class OrganizedGrid {
+public:
+	int rows = 0, cols = 0;
+	std::vector<float> x, y, z;
+	std::vector<float> valid;	//1 or 0
+
+	void resize(int n_rows, int n_cols)
+	{
+		rows = n_rows;
+		cols = n_cols;
+		size_t n = (size_t)rows * cols;
+		x.assign(n, 0.0f);
+		y.assign(n, 0.0f);
+		z.assign(n, 0.0f);
+		valid.assign(n, 0.0f);
+	}
+
+	void set(int r, int c, float px_x, float px_y, float px_z)
+	{
+		size_t i = (size_t)r * cols + c;
+		x[i] = px_x;
+		y[i] = px_y;
+		z[i] = px_z;
+		valid[i] = 1.0f;
+	}
+
+	bool isValid(int r, int c) const { return valid[(size_t)r * cols + c] != 0.0f; }
+};
+
+//Statistical outlier removal on grid neighbourhoods: the mean distance of every point to the valid points of the
+//(2*half_window+1)^2 cells around it replaces the mean distance to its k nearest neighbours, and points above
+//mean + std_mul * stddev of all mean distances are removed, like pcl::StatisticalOutlierRemoval. Points across a
+//depth discontinuity from most of their neighbours, and points without valid neighbours, are removed this way.
+//Linear in the number of cells, the inner loops run along rows over contiguous planes and vectorize.
+//Returns the number of points removed.
+inline int removeGridOutliers(OrganizedGrid &grid, int half_window, double std_mul)
+{
+	const int rows = grid.rows, cols = grid.cols;
+	std::vector<float> dist_sum((size_t)rows * cols, 0.0f), n_neighbours((size_t)rows * cols, 0.0f);
+	for (int r = 0; r < rows; r++)
+	{
+		const float *cx = &grid.x[(size_t)r * cols], *cy = &grid.y[(size_t)r * cols], *cz = &grid.z[(size_t)r * cols];
+		float *sum = &dist_sum[(size_t)r * cols], *cnt = &n_neighbours[(size_t)r * cols];
+		for (int dr = -half_window; dr <= half_window; dr++)
+		{
+			int nr = r + dr;
+			if (nr < 0 || nr >= rows)
+				continue;
+			const float *nx = &grid.x[(size_t)nr * cols], *ny = &grid.y[(size_t)nr * cols], *nz = &grid.z[(size_t)nr * cols];
+			const float *nv = &grid.valid[(size_t)nr * cols];
+			for (int dc = -half_window; dc <= half_window; dc++)
+			{
+				if (dr == 0 && dc == 0)
+					continue;
+				int c_begin = dc < 0 ? -dc : 0, c_end = dc > 0 ? cols - dc : cols;
+				for (int c = c_begin; c < c_end; c++)
+				{
+					float ddx = cx[c] - nx[c + dc], ddy = cy[c] - ny[c + dc], ddz = cz[c] - nz[c + dc];
+					float v = nv[c + dc];
+					sum[c] += v * std::sqrt(ddx * ddx + ddy * ddy + ddz * ddz);
+					cnt[c] += v;
+				}
+			}
+		}
+	}
+
+	//mean and sample stddev of the mean distances of points with neighbours
+	double s = 0, ss = 0;
+	int n = 0;
+	for (size_t i = 0; i < dist_sum.size(); i++)
+	{
+		if (grid.valid[i] == 0.0f || n_neighbours[i] == 0.0f)
+			continue;
+		double d = dist_sum[i] / n_neighbours[i];
+		s += d;
+		ss += d * d;
+		n++;
+	}
+	if (n == 0)
+		return 0;
+	double mean = s / n;
+	double variance = n > 1 ? (ss - s * s / n) / (n - 1) : 0;
+	double threshold = mean + std_mul * std::sqrt(std::max(variance, 0.0));
+
+	int removed = 0;
+	for (size_t i = 0; i < dist_sum.size(); i++)
+	{
+		if (grid.valid[i] == 0.0f)
+			continue;
+		if (n_neighbours[i] == 0.0f || dist_sum[i] / n_neighbours[i] > threshold)
+		{
+			grid.valid[i] = 0.0f;
+			removed++;
+		}
+	}
+	return removed;
+}
+
+#endif
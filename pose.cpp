@@ -16,6 +16,7 @@
 #include "pose.h"
 #include <boost/filesystem.hpp>
 #include "pose_functions.cpp"
+#include "pose_benchmarks.cpp"
 
 #include <pcl/sample_consensus/ransac.h>
 #include <pcl/sample_consensus/sac_model_line.h>
@@ -24,6 +25,11 @@ Pose::Pose(int argc, char* argv[])
 {
 	if (parseCmdArgs(argc, argv) == -1) return;
 	
+	//one persistent task pool for all parallel work
+	pool = boost::shared_ptr<ThreadPool>(new ThreadPool(num_threads));
+	cout << "task pool threads " << pool->size() << endl;
+	createMatcher();
+	
 	if (visualize)
 	{
 		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb = read_PLY_File(read_PLY_filename0);
@@ -49,6 +55,12 @@ Pose::Pose(int argc, char* argv[])
 		return;
 	}
 	
+	if (!benchmark_name.empty())
+	{
+		runBenchmark();
+		return;
+	}
+	
 	currentDateTimeStr = currentDateTime();
 	cout << "currentDateTime=" << currentDateTimeStr << "\n\n";
 	
@@ -125,12 +137,27 @@ Pose::Pose(int argc, char* argv[])
 	
 	//initialize some variables
 	finder = makePtr<OrbFeaturesFinder>();
+	//frames current_idx .. current_idx + speculate_frames can be in flight at once, as speculateFrames(current_idx)
+	//submits the last one before current_idx is taken
+	for (int i = 0; i < speculate_frames + 1; i++)
+		speculative_finders.push_back(makePtr<OrbFeaturesFinder>());
+	accepted_positions_index.reset(dist_nearby);
 	
 	//main point clouds
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_big (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	//with dont_downsample, the cloud of every cycle is kept as a chunk with its own transform, ICP only updates the transforms
+	ChunkedPointCloud<pcl::PointXYZRGB> cloud_big(map_quantum > 0 ? map_quantum : voxel_size / 20);
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_small (new pcl::PointCloud<pcl::PointXYZRGB> ());
-	cloud_big->is_dense = true;
 	cloud_small->is_dense = true;
+	//when downsampling, the clouds of every cycle are absorbed into a persistent 2.5D map of voxel_size columns
+	//(cubes with voxel_3d) instead of being appended to cloud_big and re-voxelized on every preview and at the end
+	VoxelMap voxel_map(voxel_size, voxel_3d ? voxel_size : 0);
+	if (map_memory_mb > 0)
+	{
+		//tiles beyond the budget go to disk
+		string tile_dir = folder + "map_tiles/";
+		boost::filesystem::create_directories(boost::filesystem::path(tile_dir));
+		voxel_map.setTileStore(tile_dir, (size_t)(map_memory_mb * 1024 * 1024));
+	}
 	
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_MAVLink (new pcl::PointCloud<pcl::PointXYZRGB> ());
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_FM (new pcl::PointCloud<pcl::PointXYZRGB> ());
@@ -141,6 +168,26 @@ Pose::Pose(int argc, char* argv[])
 	
 	boost::thread the_visualization_thread;
 	
+	//point clouds of a cycle are built on their own thread while the next cycle is matched.
+	//no reallocation of acceptedImageDataVec while that thread reads it
+	acceptedImageDataVec.reserve(rawImageDataVec.size());
+	BoundedQueue<boost::shared_ptr<CloudBatch> > cloud_queue(pipeline_queue_size);
+	boost::thread cloud_building_thread;
+	if (!dont_pipeline)
+		cloud_building_thread = boost::thread(&Pose::cloudBuildingLoop, this, &cloud_queue, &voxel_map, &cloud_big, &the_visualization_thread);
+	//the thread uses locals of this function: stop and join it however the function is left, also on exceptions
+	struct PipelineGuard {
+		BoundedQueue<boost::shared_ptr<CloudBatch> > &queue;
+		boost::thread &thread;
+		~PipelineGuard()
+		{
+			queue.close();
+			if (thread.joinable())
+				thread.join();
+		}
+	} pipeline_guard = { cloud_queue, cloud_building_thread };
+	int64 pipeline_start_time = getTickCount();
+	
 	bool log_uav_positions = false;
 	
 	int current_idx = 0;
@@ -152,45 +199,65 @@ Pose::Pose(int argc, char* argv[])
 	while(current_idx <= last_idx)
 	{
 		int64 t0 = getTickCount();
+		ScopedStageTimer cycle_timer(timings, "cycle");
 		
 		int cycle_start_idx = current_idx;
 		
 		cout << "\nCycle " << cycle << endl;
-		log_file << "\nCycle " << cycle << endl;
+		logStream() << "\nCycle " << cycle << endl;
 		int images_in_cycle = 0;
 	
 		while(images_in_cycle < seq_len && current_idx <= last_idx)
 		{
-			if (rawImageDataVec[current_idx].rgb_image.empty())
+			ScopedStageTimer frame_timer(timings, "frame", rawImageDataVec[current_idx].img_num);
+			if(stream_frames)
+				waitForFrame(current_idx);
+			
+			//start matching the next frames, and take the result of this one if it was started earlier
+			speculateFrames(current_idx);
+			boost::shared_ptr<SpeculativeFrame> speculative = takeSpeculativeFrame(current_idx);
+			
+			//the variance gate ran while the frame was loaded. Frames failing it, or known by the feature cache to fail it,
+			//have no rgb image and segment label map decoded, so the gate is checked before those
+			bool cached_noisy = rawImageDataVec[current_idx].cached_features && !rawImageDataVec[current_idx].cached_features->has_features;
+			if (!cached_noisy && rawImageDataVec[current_idx].disparity_image.empty())
 			{
-				cout << rawImageDataVec[current_idx].img_num << " could not read rgb image. \tRejected!" << endl;
-				log_file << rawImageDataVec[current_idx].img_num << " could not read rgb image. \tRejected!" << endl;
+				cout << rawImageDataVec[current_idx].img_num << " could not read disparity image. \tRejected!" << endl;
+				logStream() << rawImageDataVec[current_idx].img_num << " could not read disparity image. \tRejected!" << endl;
+				rejectFrame(current_idx, reject_missing_disparity);
 				current_idx++;
 				continue;
 			}
-			if (rawImageDataVec[current_idx].disparity_image.empty())
+			
+			double disp_img_var;
+			if (speculative && speculative->has_variance)
+				disp_img_var = speculative->disp_img_var;
+			else
+				disp_img_var = getDisparityVariance(current_idx);
+			cout << rawImageDataVec[current_idx].img_num << " " << flush;
+			logStream() << rawImageDataVec[current_idx].img_num << " disp_img_var " << disp_img_var << "\t";
+			if (disp_img_var > 5)
 			{
-				cout << rawImageDataVec[current_idx].img_num << " could not read disparity image. \tRejected!" << endl;
-				log_file << rawImageDataVec[current_idx].img_num << " could not read disparity image. \tRejected!" << endl;
+				cout << " disp_img_var = " << disp_img_var << " > 5.\tRejected!" << endl;
+				logStream() << " disp_img_var = " << disp_img_var << " > 5.\tRejected!" << endl;
+				rejectFrame(current_idx, reject_noisy_disparity);
 				current_idx++;
 				continue;
 			}
-			if (use_segment_labels && rawImageDataVec[current_idx].segment_label.empty())
+			
+			if (rawImageDataVec[current_idx].rgb_image.empty())
 			{
-				cout << rawImageDataVec[current_idx].img_num << " could not read segment_label image. \tRejected!" << endl;
-				log_file << rawImageDataVec[current_idx].img_num << " could not read segment_label image. \tRejected!" << endl;
+				cout << " could not read rgb image. \tRejected!" << endl;
+				logStream() << " could not read rgb image. \tRejected!" << endl;
+				rejectFrame(current_idx, reject_missing_rgb);
 				current_idx++;
 				continue;
 			}
-			
-			
-			double disp_img_var = getVariance(rawImageDataVec[current_idx].disparity_image, false);
-			cout << rawImageDataVec[current_idx].img_num << " " << flush;
-			log_file << rawImageDataVec[current_idx].img_num << " disp_img_var " << disp_img_var << "\t";
-			if (disp_img_var > 5)
+			if (use_segment_labels && rawImageDataVec[current_idx].segment_label.empty())
 			{
-				cout << " disp_img_var = " << disp_img_var << " > 5.\tRejected!" << endl;
-				log_file << " disp_img_var = " << disp_img_var << " > 5.\tRejected!" << endl;
+				cout << " could not read segment_label image. \tRejected!" << endl;
+				logStream() << " could not read segment_label image. \tRejected!" << endl;
+				rejectFrame(current_idx, reject_missing_segment_label);
 				current_idx++;
 				continue;
 			}
@@ -207,19 +274,22 @@ Pose::Pose(int argc, char* argv[])
 			pcl::PointXYZRGB hexPosMAVLink = generateUAVpos(current_idx);
 			
 			//Find Features
-			ImageData currentImageDataObj = findFeatures(current_idx);
+			ImageData currentImageDataObj = speculative && speculative->has_features ? speculative->imageData : findFeatures(current_idx);
 			currentImageDataObj.t_mat_MAVLink = t_mat_MAVLink;
+			int good = currentImageDataObj.keypoints3D->roiCount();
+			logStream() << " g" << good << "/b" << currentImageDataObj.keypoints3D->size() - good << flush;
 			
 			if (!only_MAVLink && current_idx > 0)
 			{
 				//Feature Matching Alignment
 				//generate point clouds of matched keypoints and estimate rigid body transform between them
 				bool acceptDecision = true;
-				pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 T_SVD_matched_pts = generate_tf_of_Matched_Keypoints(currentImageDataObj, acceptDecision);
+				pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 T_SVD_matched_pts = generate_tf_of_Matched_Keypoints(currentImageDataObj, acceptDecision, speculative.get());
 				
 				if (!acceptDecision)
 				{//rejected point -> no matches found
 					cout << "\tLow Feature Matches.\tRejected!" << endl;
+					rejectFrame(current_idx, reject_low_matches);
 					current_idx++;
 					continue;
 				}
@@ -248,6 +318,7 @@ Pose::Pose(int argc, char* argv[])
 			}
 			
 			acceptedImageDataVec.push_back(currentImageDataObj);
+			accepted_positions_index.add(currentImageDataObj.raw_img_data_ptr->tx, currentImageDataObj.raw_img_data_ptr->ty);
 			current_idx++;
 			images_in_cycle++;
 			//cout << "current_idx " << current_idx << " images_in_cycle " << images_in_cycle << endl;
@@ -256,7 +327,7 @@ Pose::Pose(int argc, char* argv[])
 		
 		int64 t2 = getTickCount();
 		cout << "\nMatching features and finding transformations time: " << (t2 - t0) / getTickFrequency() << " sec" << endl;
-		log_file << "Matching features n transformations time:\t" << (t2 - t0) / getTickFrequency() << " sec" << endl;
+		logStream() << "Matching features n transformations time:\t" << (t2 - t0) / getTickFrequency() << " sec" << endl;
 		
 		////finding normals of the hexPos
 		//cout << "cloud_hexPos_FM: ";
@@ -267,52 +338,13 @@ Pose::Pose(int argc, char* argv[])
 		pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 tf_icp;
 		if (!(only_MAVLink || dont_icp))
 		{
-			//transforming the camera positions using ICP
-			tf_icp = runICPalignment(cloud_hexPos_FM, cloud_hexPos_MAVLink);
-			//pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 tf_icp = runICPalignment(row12_FM_UAV_pos, row12_MAV_UAV_pos);
-			
-			////correcting old tf_mats
-			//for (int i = 0; i < acceptedImageDataVec.size(); i++)
-			//	acceptedImageDataVec[i].t_mat_FeatureMatched = tf_icp * acceptedImageDataVec[i].t_mat_FeatureMatched;
-			
-			//fit FM camera positions to MAVLink camera positions using ICP and use the tf to correct point cloud
-			transformPtCloud(cloud_hexPos_FM, cloud_hexPos_FM, tf_icp);
-			
-			//new code to correct translation
-			pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 t_translation_bw_clouds;
-			for (int i = 0; i <= 3; i++)
-			{
-				for (int j = 0; j < 3; j++)
-				{
-					if (i == j)
-						t_translation_bw_clouds(i,j) = 1;
-					else
-						t_translation_bw_clouds(i,j) = 0;
-				}
-			}
-			t_translation_bw_clouds(0,3) = cloud_hexPos_MAVLink->points[0].x - cloud_hexPos_FM->points[0].x;
-			t_translation_bw_clouds(1,3) = cloud_hexPos_MAVLink->points[0].y - cloud_hexPos_FM->points[0].y;
-			t_translation_bw_clouds(2,3) = cloud_hexPos_MAVLink->points[0].z - cloud_hexPos_FM->points[0].z;
-			cout << "t_translation_bw_clouds:\n" << t_translation_bw_clouds << endl;
-			transformPtCloud(cloud_hexPos_FM, cloud_hexPos_FM, t_translation_bw_clouds);
-			tf_icp = t_translation_bw_clouds * tf_icp;
-			
-			//correct z height by averaging out the error in z
-			double avg_z_FM = 0, avg_z_MAVLink = 0;
-			for (int i = 0; i < cloud_hexPos_MAVLink->points.size(); i++)
-			{
-				avg_z_FM += cloud_hexPos_FM->points[i].z;
-				avg_z_MAVLink += cloud_hexPos_MAVLink->points[i].z;
-			}
-			avg_z_FM /= cloud_hexPos_MAVLink->points.size();
-			avg_z_MAVLink /= cloud_hexPos_MAVLink->points.size();
-			cout << "z Height diff b/w cloud_hexPos_MAVLink and cloud_hexPos_FM: " << avg_z_MAVLink - avg_z_FM << endl;
-			t_translation_bw_clouds(0,3) = 0;
-			t_translation_bw_clouds(1,3) = 0;
-			t_translation_bw_clouds(2,3) = avg_z_MAVLink - avg_z_FM;
-			cout << "t_translation_bw_clouds:\n" << t_translation_bw_clouds << endl;
-			transformPtCloud(cloud_hexPos_FM, cloud_hexPos_FM, t_translation_bw_clouds);
-			tf_icp = t_translation_bw_clouds * tf_icp;
+			//fit FM camera positions to MAVLink camera positions and use the tf to correct point cloud
+			ScopedStageTimer icp_timer(timings, "icp");
+			if (legacy_icp)
+				tf_icp = correctTrajectoryICP(cloud_hexPos_FM, cloud_hexPos_MAVLink);
+			else
+				tf_icp = correctTrajectory(cloud_hexPos_FM, cloud_hexPos_MAVLink);
+			icp_timer.stop();
 			
 			//correcting old tf_mats
 			for (int i = 0; i < acceptedImageDataVec.size(); i++)
@@ -349,103 +381,39 @@ Pose::Pose(int argc, char* argv[])
 		
 		if (!(only_MAVLink || dont_icp))
 		{
-			//correcting old point cloud
-			transformPtCloud(cloud_big, cloud_big, tf_icp);
+			//correcting old point cloud, in order with the point clouds of earlier cycles
+			boost::shared_ptr<CloudBatch> correction(new CloudBatch());
+			correction->is_correction = true;
+			correction->correction = tf_icp;
+			if (dont_pipeline)
+				processCloudBatch(correction, voxel_map, cloud_big, the_visualization_thread);
+			else if (!cloud_queue.push(correction))
+				break;		//cloud building failed, its exception is rethrown below
 		}
 		
 		int64 t3 = getTickCount();
 		cout << "\nICP alignment and point cloud correction time: " << (t3 - t2) / getTickFrequency() << " sec\n" << endl;
-		log_file << "ICP point cloud correction time:\t\t" << (t3 - t2) / getTickFrequency() << " sec" << endl;
-		
+		logStream() << "ICP point cloud correction time:\t\t" << (t3 - t2) / getTickFrequency() << " sec" << endl;
 		
-		//adding new points to point cloud
-		cout << "Adding Point Cloud number/points ";
-		log_file << "Adding Point Cloud number/points ";
-		
-		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb_FeatureMatched (new pcl::PointCloud<pcl::PointXYZRGB> ());
-		
-		int i = seq_len * cycle;
-		int acceptedImageDataVecSize = acceptedImageDataVec.size();
-		//cout << "\nacceptedImageDataVec.size() " << acceptedImageDataVecSize << endl;
-		//cout << "i from " << seq_len * cycle << " to " << min(seq_len * (cycle + 1), seq_len * cycle + images_in_cycle) << endl;
-		while(i < min(seq_len * (cycle + 1), seq_len * cycle + images_in_cycle))
+		//hand the accepted images of this cycle over to point cloud building, with a snapshot of their transforms
+		//as later ICP corrections change acceptedImageDataVec while the clouds are being built
+		boost::shared_ptr<CloudBatch> batch(new CloudBatch());
+		batch->cycle = cycle;
+		batch->last_cycle = current_idx > last_idx;
+		for (int i = acceptedImageDataVec.size() - images_in_cycle; i < acceptedImageDataVec.size(); i++)
 		{
-			if(false)
-			{//single threaded
-				pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb1 ( new pcl::PointCloud<pcl::PointXYZRGB>() );
-				createAndTransformPtCloud(i, transformed_cloudrgb1);
-				//generating the bigger point cloud
-				cloudrgb_FeatureMatched->insert(cloudrgb_FeatureMatched->end(),transformed_cloudrgb1->begin(),transformed_cloudrgb1->end());
-				i++;
-			}
-			else
-			{
-				int i0 = i;
-				pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb1 ( new pcl::PointCloud<pcl::PointXYZRGB>() );
-				pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb2 ( new pcl::PointCloud<pcl::PointXYZRGB>() );
-				pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb3 ( new pcl::PointCloud<pcl::PointXYZRGB>() );
-				pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb4 ( new pcl::PointCloud<pcl::PointXYZRGB>() );
-				pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb5 ( new pcl::PointCloud<pcl::PointXYZRGB>() );
-				pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb6 ( new pcl::PointCloud<pcl::PointXYZRGB>() );
-				pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb7 ( new pcl::PointCloud<pcl::PointXYZRGB>() );
-				
-				boost::thread pt_cloud_thread1, pt_cloud_thread2, pt_cloud_thread3, pt_cloud_thread4, pt_cloud_thread5, pt_cloud_thread6, pt_cloud_thread7;
-				
-				//cout << "Start threads for creation of single image point clouds... i " << i << endl;
-				//for (int j = i; j < min(i+7, (int)acceptedImageDataVec.size()); j++)
-				//	cout << acceptedImageDataVec[j].raw_img_data_ptr->img_num << " " << flush;
-				//cout << endl;
-				pt_cloud_thread1 = boost::thread(&Pose::createAndTransformPtCloud, this, i, transformed_cloudrgb1); i++;
-				if(i < acceptedImageDataVecSize) { pt_cloud_thread2 = boost::thread(&Pose::createAndTransformPtCloud, this, i, transformed_cloudrgb2); i++; }
-				if(i < acceptedImageDataVecSize) { pt_cloud_thread3 = boost::thread(&Pose::createAndTransformPtCloud, this, i, transformed_cloudrgb3); i++; }
-				if(i < acceptedImageDataVecSize) { pt_cloud_thread4 = boost::thread(&Pose::createAndTransformPtCloud, this, i, transformed_cloudrgb4); i++; }
-				if(i < acceptedImageDataVecSize) { pt_cloud_thread5 = boost::thread(&Pose::createAndTransformPtCloud, this, i, transformed_cloudrgb5); i++; }
-				if(i < acceptedImageDataVecSize) { pt_cloud_thread6 = boost::thread(&Pose::createAndTransformPtCloud, this, i, transformed_cloudrgb6); i++; }
-				if(i < acceptedImageDataVecSize) { pt_cloud_thread7 = boost::thread(&Pose::createAndTransformPtCloud, this, i, transformed_cloudrgb7); i++; }
-				//cout << "Created threads.." << endl;
-				
-				pt_cloud_thread1.join();
-				pt_cloud_thread2.join();
-				pt_cloud_thread3.join();
-				pt_cloud_thread4.join();
-				pt_cloud_thread5.join();
-				pt_cloud_thread6.join();
-				pt_cloud_thread7.join();
-				
-				//generating the bigger point cloud
-				//cout << "\nPoint Cloud Creation and Downsampling done." << endl;
-				i = i0;
-				cloudrgb_FeatureMatched->insert(cloudrgb_FeatureMatched->end(),transformed_cloudrgb1->begin(),transformed_cloudrgb1->end()); i++;
-				if(i < acceptedImageDataVecSize) { cloudrgb_FeatureMatched->insert(cloudrgb_FeatureMatched->end(),transformed_cloudrgb2->begin(),transformed_cloudrgb2->end()); i++; }
-				if(i < acceptedImageDataVecSize) { cloudrgb_FeatureMatched->insert(cloudrgb_FeatureMatched->end(),transformed_cloudrgb3->begin(),transformed_cloudrgb3->end()); i++; }
-				if(i < acceptedImageDataVecSize) { cloudrgb_FeatureMatched->insert(cloudrgb_FeatureMatched->end(),transformed_cloudrgb4->begin(),transformed_cloudrgb4->end()); i++; }
-				if(i < acceptedImageDataVecSize) { cloudrgb_FeatureMatched->insert(cloudrgb_FeatureMatched->end(),transformed_cloudrgb5->begin(),transformed_cloudrgb5->end()); i++; }
-				if(i < acceptedImageDataVecSize) { cloudrgb_FeatureMatched->insert(cloudrgb_FeatureMatched->end(),transformed_cloudrgb6->begin(),transformed_cloudrgb6->end()); i++; }
-				if(i < acceptedImageDataVecSize) { cloudrgb_FeatureMatched->insert(cloudrgb_FeatureMatched->end(),transformed_cloudrgb7->begin(),transformed_cloudrgb7->end()); i++; }
-				//cout << "Point Clouds Added. i " << i << endl;
-			}
+			batch->accepted_indices.push_back(i);
+			batch->t_mats.push_back(acceptedImageDataVec[i].t_mat_FeatureMatched);
 		}
-		
-		int64 t4 = getTickCount();
-		cout << "\n\nPoint Cloud Creation time: " << (t4 - t3) / getTickFrequency() << " sec" << endl;
-		log_file << "Point Cloud Creation time:\t\t\t" << (t4 - t3) / getTickFrequency() << " sec" << endl;
-		
-		//adding the new downsampled points to old downsampled cloud
-		cloud_big->insert(cloud_big->end(),cloudrgb_FeatureMatched->begin(),cloudrgb_FeatureMatched->end());
-		
-		//visualize
-		if(preview)
+		if (preview)
 		{
-			bool last_cycle = current_idx > last_idx;
-			
-			pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_big_copy (new pcl::PointCloud<pcl::PointXYZRGB>());
-			copyPointCloud(*cloud_big, *cloud_big_copy);
-			
-			if(cycle > 0)
-				the_visualization_thread.join();
-			
-			the_visualization_thread = boost::thread(&Pose::displayPointCloudOnline, this, cloud_big_copy, cloud_hexPos_FM, cloud_hexPos_MAVLink, cycle, last_cycle);
+			batch->hexPos_FM = pcl::PointCloud<pcl::PointXYZRGB>::Ptr(new pcl::PointCloud<pcl::PointXYZRGB>(*cloud_hexPos_FM));
+			batch->hexPos_MAVLink = pcl::PointCloud<pcl::PointXYZRGB>::Ptr(new pcl::PointCloud<pcl::PointXYZRGB>(*cloud_hexPos_MAVLink));
 		}
+		if (dont_pipeline)
+			processCloudBatch(batch, voxel_map, cloud_big, the_visualization_thread);
+		else if (!cloud_queue.push(batch))
+			break;
 		
 		finder->collectGarbage();
 		//increment cycle
@@ -454,11 +422,52 @@ Pose::Pose(int argc, char* argv[])
 		int64 t6 = getTickCount();
 		
 		cout << "\nCycle time: " << (t6 - t0) / getTickFrequency() << " sec" << endl;
-		log_file << "Cycle time:\t\t\t\t\t" << (t6 - t0) / getTickFrequency() << " sec" << endl;
+		logStream() << "Cycle time:\t\t\t\t\t" << (t6 - t0) / getTickFrequency() << " sec" << endl;
 	}
 	
+	//wait for the point clouds of the last cycles
+	cloud_queue.close();
+	if (!dont_pipeline)
+		cloud_building_thread.join();
+	if (cloud_stage_error)
+		std::rethrow_exception(cloud_stage_error);
+	
 	int64 tend = getTickCount();
 	
+	if (!dont_pipeline)
+	{
+		double pipeline_ms = (tend - pipeline_start_time) / getTickFrequency() * 1000;
+		BoundedQueue<boost::shared_ptr<CloudBatch> >::Stats queue_stats = cloud_queue.stats();
+		double matching_stage_busy_ms = pipeline_ms - queue_stats.push_wait_ms;
+		cout << "\nPipeline stats over " << pipeline_ms << " ms:"
+			<< "\nmatching stage busy " << matching_stage_busy_ms << " ms (" << 100 * matching_stage_busy_ms / pipeline_ms << "%), blocked on full queue " << queue_stats.push_wait_ms << " ms"
+			<< "\ncloud stage busy " << cloud_stage_busy_ms << " ms (" << 100 * cloud_stage_busy_ms / pipeline_ms << "%), waiting on empty queue " << queue_stats.pop_wait_ms << " ms"
+			<< "\nqueue messages " << queue_stats.pushes << ", depth max " << queue_stats.max_depth << " mean " << queue_stats.mean_depth << " of " << pipeline_queue_size << endl;
+		logStream() << "\nPipeline stats over " << pipeline_ms << " ms:"
+			<< "\nmatching stage busy " << matching_stage_busy_ms << " ms (" << 100 * matching_stage_busy_ms / pipeline_ms << "%), blocked on full queue " << queue_stats.push_wait_ms << " ms"
+			<< "\ncloud stage busy " << cloud_stage_busy_ms << " ms (" << 100 * cloud_stage_busy_ms / pipeline_ms << "%), waiting on empty queue " << queue_stats.pop_wait_ms << " ms"
+			<< "\nqueue messages " << queue_stats.pushes << ", depth max " << queue_stats.max_depth << " mean " << queue_stats.mean_depth << " of " << pipeline_queue_size << endl;
+	}
+	
+	cout << "\nRejected frames:";
+	logStream() << "\nRejected frames:";
+	for (int r = 0; r < n_frame_rejections; r++)
+	{
+		cout << " " << frameRejectionName(r) << " " << rejection_counts[r];
+		logStream() << " " << frameRejectionName(r) << " " << rejection_counts[r];
+	}
+	cout << endl;
+	logStream() << endl;
+	
+	cout << "match cache: hits " << match_cache.hitCount() << " misses " << match_cache.missCount() << " pairs " << match_cache.size() << " " << match_cache.sizeBytes() / 1024 << " KB" << endl;
+	logStream() << "match cache: hits " << match_cache.hitCount() << " misses " << match_cache.missCount() << " pairs " << match_cache.size() << " " << match_cache.sizeBytes() / 1024 << " KB" << endl;
+	
+	if (feature_cache.enabled())
+	{
+		cout << "\nfeature cache: hits " << feature_cache.hitCount() << " misses " << feature_cache.missCount() << " stored " << feature_cache.storeCount() << endl;
+		logStream() << "\nfeature cache: hits " << feature_cache.hitCount() << " misses " << feature_cache.missCount() << " stored " << feature_cache.storeCount() << endl;
+	}
+	
 	cout << "\nFinished Pose Estimation, total time: " << ((tend - app_start_time) / getTickFrequency()) << " sec at " << 1.0*acceptedImageDataVec.size()/((tend - app_start_time) / getTickFrequency()) << " fps" 
 		<< "\nraw_images " << rawImageDataVec.size()
 		<< "\naccepted_images " << acceptedImageDataVec.size()
@@ -471,7 +480,7 @@ Pose::Pose(int argc, char* argv[])
 		<< "\ndist_nearby " << dist_nearby
 		<< "\ngood_matched_imgs " << good_matched_imgs
 		<< endl;
-	log_file << "\nFinished Pose Estimation, total time: " << ((tend - app_start_time) / getTickFrequency()) << " sec at " << 1.0*acceptedImageDataVec.size()/((tend - app_start_time) / getTickFrequency()) << " fps" 
+	logStream() << "\nFinished Pose Estimation, total time: " << ((tend - app_start_time) / getTickFrequency()) << " sec at " << 1.0*acceptedImageDataVec.size()/((tend - app_start_time) / getTickFrequency()) << " fps" 
 		<< "\nraw_images " << rawImageDataVec.size()
 		<< "\naccepted_images " << acceptedImageDataVec.size()
 		<< "\njump_pixels " << jump_pixels
@@ -484,17 +493,17 @@ Pose::Pose(int argc, char* argv[])
 		<< "\ngood_matched_imgs " << good_matched_imgs
 		<< endl;
 	
-	log_file << "\nMAVLink hexacopter positions" << endl;
+	logStream() << "\nMAVLink hexacopter positions" << endl;
 	for (int i = 0; i < acceptedImageDataVec.size(); i++)
-		log_file << acceptedImageDataVec[i].raw_img_data_ptr->img_num << "," << cloud_hexPos_MAVLink->points[i].x << "," << cloud_hexPos_MAVLink->points[i].y << "," << cloud_hexPos_MAVLink->points[i].z << endl;
+		logStream() << acceptedImageDataVec[i].raw_img_data_ptr->img_num << "," << cloud_hexPos_MAVLink->points[i].x << "," << cloud_hexPos_MAVLink->points[i].y << "," << cloud_hexPos_MAVLink->points[i].z << endl;
 	
-	log_file << "\nFeature Matched and ICP corrected hexacopter positions" << endl;
+	logStream() << "\nFeature Matched and ICP corrected hexacopter positions" << endl;
 	for (int i = 0; i < acceptedImageDataVec.size(); i++)
-		log_file << acceptedImageDataVec[i].raw_img_data_ptr->img_num << "," << cloud_hexPos_FM->points[i].x << "," << cloud_hexPos_FM->points[i].y << "," << cloud_hexPos_FM->points[i].z << endl;
+		logStream() << acceptedImageDataVec[i].raw_img_data_ptr->img_num << "," << cloud_hexPos_FM->points[i].x << "," << cloud_hexPos_FM->points[i].y << "," << cloud_hexPos_FM->points[i].z << endl;
 	
-	log_file << "\nerror in uav positions" << endl;
+	logStream() << "\nerror in uav positions" << endl;
 	for (int i = 0; i < acceptedImageDataVec.size(); i++)
-		log_file << acceptedImageDataVec[i].raw_img_data_ptr->img_num << "," << cloud_hexPos_MAVLink->points[i].x - cloud_hexPos_FM->points[i].x << "," << cloud_hexPos_MAVLink->points[i].y - cloud_hexPos_FM->points[i].y << "," << cloud_hexPos_MAVLink->points[i].z - cloud_hexPos_FM->points[i].z << endl;
+		logStream() << acceptedImageDataVec[i].raw_img_data_ptr->img_num << "," << cloud_hexPos_MAVLink->points[i].x - cloud_hexPos_FM->points[i].x << "," << cloud_hexPos_MAVLink->points[i].y - cloud_hexPos_FM->points[i].y << "," << cloud_hexPos_MAVLink->points[i].z - cloud_hexPos_FM->points[i].z << endl;
 	
 	double error_x = 0, error_y = 0, error_z = 0;
 	for (int i = 0; i <= last_idx; i++)
@@ -520,24 +529,43 @@ Pose::Pose(int argc, char* argv[])
 		stddev_error_z = sqrt(var_error_z / (last_idx * last_idx));
 	//cout << "total localization errors in x " << error_x << " y " << error_y << " z " << error_z << endl;
 	cout << "\navg UAV localization error (m) in x " << mean_error_x << " y " << mean_error_y << " z " << mean_error_z << endl;
-	log_file << "\navg UAV localization error (m) in x " << mean_error_x << " y " << mean_error_y << " z " << mean_error_z << endl;
+	logStream() << "\navg UAV localization error (m) in x " << mean_error_x << " y " << mean_error_y << " z " << mean_error_z << endl;
 	cout << "std deviation in UAV localization error in x " << stddev_error_x << " y " << stddev_error_y << " z " << stddev_error_z << endl << endl;
-	log_file << "std deviation in UAV localization error in x " << stddev_error_x << " y " << stddev_error_y << " z " << stddev_error_z << endl << endl;
+	logStream() << "std deviation in UAV localization error in x " << stddev_error_x << " y " << stddev_error_y << " z " << stddev_error_z << endl << endl;
 	
+	//with a memory budget the map is written tile by tile instead of being materialized, unless it is segmented afterwards
+	bool stream_map_export = !dont_downsample && map_memory_mb > 0 && !segment_cloud;
 	if (!dont_downsample)
 	{
-		cout << "downsample before saving..." << endl;
-		cloud_small = downsamplePtCloud(cloud_big, true);
-		cout << "downsampled." << endl;
+		if (!stream_map_export)
+			voxel_map.exportTo(*cloud_small, min_points_per_voxel);
+		cout << "voxel map: " << voxel_map.pointsAdded() << " points in " << voxel_map.size() << " cells" << endl;
+		logStream() << "voxel map: " << voxel_map.pointsAdded() << " points in " << voxel_map.size() << " cells" << endl;
+		if (map_memory_mb > 0)
+		{
+			cout << "map tiles: " << voxel_map.numTiles() << ", " << voxel_map.numSpilledTiles() << " on disk, " << voxel_map.spillCount() << " spills, " 
+				<< voxel_map.loadCount() << " loads, " << voxel_map.residentBytes() / (1024.0 * 1024.0) << " MB resident" << endl;
+			logStream() << "map tiles: " << voxel_map.numTiles() << ", " << voxel_map.numSpilledTiles() << " on disk, " << voxel_map.spillCount() << " spills, " 
+				<< voxel_map.loadCount() << " loads, " << voxel_map.residentBytes() / (1024.0 * 1024.0) << " MB resident" << endl;
+		}
 	}
 	else
 	{
-		cloud_small = cloud_big;
+		cloud_big.materialize(*cloud_small);
+		cout << "point cloud: " << cloud_big.size() << " points in " << cloud_big.numChunks() << " chunks, " << cloud_big.sizeBytes() / (1024.0 * 1024.0) << " MB" << endl;
+		logStream() << "point cloud: " << cloud_big.size() << " points in " << cloud_big.numChunks() << " chunks, " << cloud_big.sizeBytes() / (1024.0 * 1024.0) << " MB" << endl;
 	}
 	
 	cout << "Saving point clouds..." << endl;
 	read_PLY_filename0 = folder + "cloud.ply";
-	save_pt_cloud_to_PLY_File(cloud_small, read_PLY_filename0);
+	if (stream_map_export)
+	{
+		ScopedStageTimer timer(timings, "ply_write");
+		size_t n_written = voxel_map.writePLY(read_PLY_filename0, min_points_per_voxel);
+		std::cerr << "Saved Point Cloud with " << n_written << " data points to " << read_PLY_filename0 << endl;
+	}
+	else
+		save_pt_cloud_to_PLY_File(cloud_small, read_PLY_filename0);
 	//read_PLY_filename0 = "cloudrgb_MAVLink_" + currentDateTimeStr + ".ply";
 	//save_pt_cloud_to_PLY_File(cloudrgb_MAVLink, read_PLY_filename0);
 	//read_PLY_filename1 = folder + "cloud_big.ply";
@@ -562,6 +590,7 @@ Pose::Pose(int argc, char* argv[])
 		segmentCloud(cloud_small);
 	}
 	
+	writeTimingReport();
 }
 
 void Pose::findNormalOfPtCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud)
@@ -593,22 +622,32 @@ void Pose::findNormalOfPtCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud)
 	
 }
 
-void Pose::createAndTransformPtCloud(int accepted_img_index, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb_return)
+void Pose::createAndTransformPtCloud(int accepted_img_index, const pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 &t_mat_FeatureMatched, 
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb_return)
 {
 	try
 	{
+		if (!dont_downsample && !legacy_pt_cloud)
+		{
+			createFusedVoxelizedPtCloud(accepted_img_index, t_mat_FeatureMatched, cloudrgb_return);
+			return;
+		}
+		
 		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb (new pcl::PointCloud<pcl::PointXYZRGB> ());
 		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb_transformed (new pcl::PointCloud<pcl::PointXYZRGB> ());
 		
 		createSingleImgPtCloud(accepted_img_index, cloudrgb);
 		//cout << "Created point cloud " << img_index << endl;
 		
-		pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 t_mat_FeatureMatched = acceptedImageDataVec[accepted_img_index].t_mat_FeatureMatched;
+		ScopedStageTimer transform_timer(timings, "transform", acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->img_num);
 		transformPtCloud(cloudrgb, cloudrgb_transformed, t_mat_FeatureMatched);
+		transform_timer.stop();
 		//cout << "transformed point cloud " << img_index << endl;
 		if (!dont_downsample)
 		{
+			ScopedStageTimer voxelization_timer(timings, "voxelization", acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->img_num);
 			pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb_downsampled = downsamplePtCloud(cloudrgb_transformed, false);
+			voxelization_timer.stop();
 			//cout << "Downsampled point cloud " << img_index << endl;
 			copyPointCloud(*cloudrgb_downsampled, *cloudrgb_return);
 		}
@@ -635,19 +674,102 @@ void Pose::createAndTransformPtCloud(int accepted_img_index, pcl::PointCloud<pcl
 	}
 }
 
-void Pose::displayPointCloudOnline(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud_combined_copy, 
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud_hexPos_FM, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud_hexPos_MAVLink, int cycle, bool last_cycle)
+//point cloud building stage: apply an ICP correction, or build, merge and preview the clouds of one cycle
+void Pose::processCloudBatch(boost::shared_ptr<CloudBatch> batch, VoxelMap &voxel_map, ChunkedPointCloud<pcl::PointXYZRGB> &cloud_big, boost::thread &the_visualization_thread)
 {
-	wait_at_visualizer = false;
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb (new pcl::PointCloud<pcl::PointXYZRGB> ());
-	if(!dont_downsample)
+	if (batch->is_correction)
 	{
-		cloudrgb = downsamplePtCloud(cloud_combined_copy, true);
+		if (!dont_downsample)
+			voxel_map.applyCorrection(batch->correction);
+		else
+			cloud_big.applyCorrection(batch->correction);
+		return;
 	}
+	
+	int64 t3 = getTickCount();
+	ScopedStageTimer batch_timer(timings, "cloud_batch");
+	
+	//adding new points to point cloud
+	cout << "Adding Point Cloud number/points ";
+	logStream() << "Adding Point Cloud number/points ";
+	
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb_FeatureMatched (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	
+	//submit every image of this cycle to the task pool, then merge the clouds in original order
+	vector<pcl::PointCloud<pcl::PointXYZRGB>::Ptr> transformed_clouds;
+	vector<std::future<void> > cloud_tasks;
+	for (int j = 0; j < batch->accepted_indices.size(); j++)
+	{
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb ( new pcl::PointCloud<pcl::PointXYZRGB>() );
+		transformed_clouds.push_back(transformed_cloudrgb);
+		cloud_tasks.push_back(pool->submit(&Pose::createAndTransformPtCloud, this, batch->accepted_indices[j], std::cref(batch->t_mats[j]), transformed_cloudrgb));
+	}
+	pool->wait(cloud_tasks);
+	for (int j = 0; j < transformed_clouds.size(); j++)
+		cloudrgb_FeatureMatched->insert(cloudrgb_FeatureMatched->end(),transformed_clouds[j]->begin(),transformed_clouds[j]->end());
+	
+	int64 t4 = getTickCount();
+	cout << "\n\nPoint Cloud Creation time: " << (t4 - t3) / getTickFrequency() << " sec" << endl;
+	logStream() << "Point Cloud Creation time:\t\t\t" << (t4 - t3) / getTickFrequency() << " sec" << endl;
+	
+	//adding the new downsampled points to old downsampled cloud
+	ScopedStageTimer merge_timer(timings, "merge");
+	if (!dont_downsample)
+		voxel_map.addCloud(*cloudrgb_FeatureMatched);
 	else
+		cloud_big.addChunk(cloudrgb_FeatureMatched);
+	merge_timer.stop();
+	
+	//point clouds of this cycle are built, their images are not needed anymore
+	if(stream_frames)
+		for (int j = 0; j < batch->accepted_indices.size(); j++)
+			releaseRawImageData(acceptedImageDataVec[batch->accepted_indices[j]].features.img_idx);
+	
+	//visualize
+	if(preview)
+	{
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_big_copy (new pcl::PointCloud<pcl::PointXYZRGB>());
+		//under a memory budget only the resident tiles, the recently flown area, are shown
+		if (!dont_downsample)
+			voxel_map.exportTo(*cloud_big_copy, min_points_per_voxel, map_memory_mb > 0);
+		else
+			cloud_big.materialize(*cloud_big_copy);
+		
+		if(the_visualization_thread.joinable())
+			the_visualization_thread.join();
+		
+		the_visualization_thread = boost::thread(&Pose::displayPointCloudOnline, this, cloud_big_copy, batch->hexPos_FM, batch->hexPos_MAVLink, batch->cycle, batch->last_cycle);
+	}
+}
+
+//consumer thread of the main loop pipeline, processes batches in order until the queue is closed
+void Pose::cloudBuildingLoop(BoundedQueue<boost::shared_ptr<CloudBatch> > *cloud_queue, VoxelMap *voxel_map, ChunkedPointCloud<pcl::PointXYZRGB> *cloud_big, boost::thread *the_visualization_thread)
+{
+	boost::shared_ptr<CloudBatch> batch;
+	try
+	{
+		while (cloud_queue->pop(batch))
+		{
+			int64 t0 = getTickCount();
+			processCloudBatch(batch, *voxel_map, *cloud_big, *the_visualization_thread);
+			cloud_stage_busy_ms += (getTickCount() - t0) / getTickFrequency() * 1000;
+		}
+	}
+	catch (...)
 	{
-		cloudrgb = cloud_combined_copy;
+		//an exception leaving a thread terminates the program, hand it to the main thread. closing the
+		//queue makes the next push of the main loop fail, so it stops and joins this thread
+		cloud_stage_error = std::current_exception();
+		cloud_queue->close();
 	}
+}
+
+void Pose::displayPointCloudOnline(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud_combined_copy, 
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud_hexPos_FM, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud_hexPos_MAVLink, int cycle, bool last_cycle)
+{
+	wait_at_visualizer = false;
+	//cloud_combined_copy is already downsampled when exported from the voxel map
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb = cloud_combined_copy;
 	
 	displayUAVPositions = true;
 	pcl::PolygonMesh mesh;
@@ -37,27 +37,50 @@
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <stdio.h>
+#ifdef HAVE_OPENCV_CUDAARITHM
 #include <opencv2/cudaarithm.hpp>
+#endif
+#ifdef HAVE_OPENCV_CUDAIMGPROC
 #include <opencv2/cudaimgproc.hpp>
+#endif
 #include <opencv2/features2d.hpp>
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
 #include <opencv2/cudafeatures2d.hpp>
+#endif
 #include <thread>
 #include <mutex>
+#include "thread_pool.h"
+#include "reprojection.h"
+#include "voxel_grid.h"
+#include "voxel_downsample.h"
+#include "voxel_map.h"
+#include "chunked_point_cloud.h"
+#include "feature_matcher.h"
+#include "position_index.h"
+#include "stage_timer.h"
+#include "bounded_queue.h"
+#include "feature_cache.h"
+#include "pose_store.h"
+#include "segment_planes.h"
+#include "frame_gate.h"
+#include "keypoint_store.h"
+#include "trajectory_aligner.h"
+#include "match_cache.h"
+#include "disparity_filter.h"
+#include "organized_grid.h"
+#include "locked_stream.h"
 
 using namespace std;
 using namespace cv;
 using namespace cv::detail;
 
-typedef vector <double> record_t;
-typedef vector <record_t> data_t;
-
 class RawImageData {
 public:
 	int img_num;
 	Mat rgb_image;
 	Mat disparity_image;
 	Mat segment_label;
-	Mat double_disparity_image;
+	boost::shared_ptr<SegmentPlanes> disparity_planes;	//plane fitted disparity is disparity_planes->at(segment_label, x, y)
 	
 	double time;	//NSECS
 	double tx;
@@ -67,6 +90,9 @@ public:
 	double qy;
 	double qz;
 	double qw;
+	
+	double disp_img_var = -1;	//disparity variance gate input, -1 until computed
+	boost::shared_ptr<FeatureCacheEntry> cached_features;	//from the feature cache, empty on a miss
 };
 
 //accepted images with secondary data
@@ -75,15 +101,47 @@ public:
 	RawImageData* raw_img_data_ptr;
 	
 	ImageFeatures features;	//has features.keypoints and features.descriptors
-	cuda::GpuMat gpu_descriptors;
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr keypoints3D;
-	vector<bool> keypoints3D_ROI_Points;
+	MatchDescriptors match_descriptors;	//features.descriptors prepared for the matcher backend
+	boost::shared_ptr<KeypointStore> keypoints3D;	//3D keypoints with their ROI flags, by keypoint index
 	
 	pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 t_mat_MAVLink;
 	pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 t_mat_FeatureMatched;
 	
 };
 
+//a frame processed ahead of the serial pose chain: features found and matched against the images that were
+//accepted when the job was started. None of it depends on poses, so it stays valid whichever frames before it
+//are accepted or rejected. Images accepted after the job was started are matched when the frame's turn comes
+class SpeculativeFrame {
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+	int raw_idx = -1;
+	bool has_variance = false;	//false -> images missing
+	double disp_img_var = 0;
+	bool has_features = false;	//false -> images missing or disparity too noisy, the frame gets rejected
+	ImageData imageData;
+	vector<int> dst_indices;	//acceptedImageDataVec indices matched against
+	vector<vector<DMatch> > good_matches_vec;	//ratio tested matches, one list per dst_indices entry
+	std::future<void> done;
+};
+
+//message from the matching stage to the point cloud building stage of the main loop pipeline.
+//either an ICP correction for everything built so far, or the accepted images of one cycle
+//with their transforms and UAV positions as they were when the cycle was matched
+class CloudBatch {
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+	bool is_correction = false;
+	pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 correction;
+	
+	int cycle = 0;
+	bool last_cycle = false;
+	vector<int> accepted_indices;
+	vector<pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4, 
+		Eigen::aligned_allocator<pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4> > t_mats;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr hexPos_FM, hexPos_MAVLink;
+};
+
 class Pose {
 
 public:
@@ -96,9 +154,14 @@ int rows = 0, cols = 0, cols_start_aft_cutout = 0;
 int jump_pixels = 10;
 int seq_len = -1;
 int blur_kernel = 1;	//31 is a good number
+string disp_filter = "sparse";	//full: bilateralFilter on the whole image, sparse: bilateral at read pixels only (same as full for uchar), guided: O(1) per read pixel approximation
+string outlier_removal = "grid";	//grid: removeGridOutliers on the sampled pixel grid, sor: pcl::StatisticalOutlierRemoval (legacy_pt_cloud), none. not with dont_downsample
+int outlier_window = 3;		//half size of the grid neighbourhood, 7x7 cells ~ the 50 nearest neighbours of SOR
 double dist_nearby = 2;	//in meters
 int good_matched_imgs = 0;
-std::mutex mu;
+std::mutex log_mu;	//guards log_file, written from the main, cloud building and pool threads. see logStream()
+int num_threads = 0;	//0 -> use std::thread::hardware_concurrency()
+boost::shared_ptr<ThreadPool> pool;
 
 bool mesh_surface = false;
 bool smooth_surface = false;
@@ -106,12 +169,39 @@ int polynomial_order = 2;
 double search_radius = 0.02;//, sqr_gauss_param = 0.02;
 bool downsample = false;
 unsigned int min_points_per_voxel = 1;
+double map_memory_mb = 0;	//budget of the resident voxel map tiles, least recently used tiles beyond it are spilled to disk. 0: no limit
+bool voxel_3d = false;	//downsample the combined point cloud into voxel_size cubes instead of 2.5D columns
 
 //image data
 vector<RawImageData> rawImageDataVec;
 vector<ImageData> acceptedImageDataVec;
 
-//variables for k-D tree of UAV locations of accepted images
+//streaming ingestion: frames are decoded prefetch_frames ahead of current_idx instead of all at startup
+bool stream_frames = false;
+int prefetch_frames = 32;
+vector<std::future<void> > frame_loaded;	//one load task per raw image
+int next_prefetch_idx = 0;
+
+//speculative matching: up to speculate_frames frames after current_idx are matched on the pool ahead of the pose chain
+int speculate_frames = 4;
+map<int, boost::shared_ptr<SpeculativeFrame> > speculative_frames;	//by raw image index
+int next_speculate_idx = 0;
+vector<Ptr<FeaturesFinder> > speculative_finders;	//speculate_frames + 1, one per frame of the window including current_idx, finders are not shared between threads
+
+//persistent features per image for re-runs: warm runs skip ORB and keypoint lifting, and decoding of noisy images
+string feature_cache_dir = "";	//empty disables the cache
+FeatureCache feature_cache;
+
+//frame quality gate: disparity statistics on every gate_decimation-th row and column, run while frames are loaded
+int gate_decimation = 1;
+int rejection_counts[n_frame_rejections] = {};	//by FrameRejection, counted by the main loop
+
+//ratio tested matches of every image pair matched so far, the larger radius retry only matches new pairs
+MatchCache match_cache;
+int match_cache_mb = 256;
+
+//grid index of UAV locations of accepted images, ids are acceptedImageDataVec indices
+PositionGridIndex accepted_positions_index;
 const int featureMatchingThreshold = 100;
 const double z_threshold = 0.05;
 
@@ -126,6 +216,7 @@ double baseline = 600.0 / 1000;
 int cutout_ratio = 8;	//how much ratio of masking is to be done on left side of image as this area is not covered in stereo disparity images.
 string calib_file = "cam13calib.yml";
 Mat Q;
+DisparityReprojector reprojector;	//Q unrolled for fast disparity to 3D reprojection
 const string imageNumbersFile = "images/image_numbers.txt";
 const string dataFilesPrefix = "data_files/";
 const string pose_file = "pose.txt";
@@ -137,7 +228,7 @@ const string segmentlblPrefix = "segmentlabels/";
 string folder = "/mnt/win/WORK/pose_estimation_output/";
 
 //indices in pose and heading data files
-const int tx_ind=3,ty_ind=4,tz_ind=5,qx_ind=6,qy_ind=7,qz_ind=8,qw_ind=9;//,hdg_ind=3;
+const int time_ind=2,tx_ind=3,ty_ind=4,tz_ind=5,qx_ind=6,qy_ind=7,qz_ind=8,qw_ind=9;//,hdg_ind=3;
 //translation and rotation between image and head of hexacopter
 const double trans_x_hi = -0.300;
 const double trans_y_hi = -0.040;
@@ -147,16 +238,23 @@ const double theta_xi = -1.1408 * PI / 180;
 const double theta_yi = 1.1945 * PI / 180;
 bool only_MAVLink = false;
 bool dont_downsample = false;
+double map_quantum = 0;	//coordinate quantum of the accumulated point cloud with dont_downsample, 0: voxel_size / 20
+bool legacy_pt_cloud = false;
+bool dont_pipeline = false;
+int pipeline_queue_size = 2;	//cycles waiting for point cloud building
+double cloud_stage_busy_ms = 0;
+std::exception_ptr cloud_stage_error;	//exception thrown on the cloud building thread, rethrown by the main thread after join
 bool dont_icp = false;
+bool legacy_icp = false;	//correct the trajectory with PCL ICP over all UAV positions instead of TrajectoryAligner
+double align_decay = 1.0;	//weight factor of earlier UAV positions per cycle in the trajectory alignment
+TrajectoryAligner trajectory_aligner;
 
-//PROCESS: get times in NSECS from images_times_data and search for corresponding or nearby entry in pose_data and heading_data
-data_t pose_data;		//header.seq,secs,NSECS,position.x,position.y,position.z,orientation.x,orientation.y,orientation.z,orientation.w
+//PROCESS: get times in NSECS from images_times_file and search for the nearest or bracketing entries in pose_store
+PoseStore pose_store;		//pose_file: header.seq,secs,NSECS,position.x,position.y,position.z,orientation.x,orientation.y,orientation.z,orientation.w
 //data_t heading_data;	//header.seq,secs,NSECS,rostime,heading_in_degs
-data_t images_times_data;	//header.seq,secs,NSECS
-//vectors to store trigger times for easier searching
+vector<double> images_times_nums;	//images_times_file: header.seq,secs,NSECS. seq is the image number, sorted
 vector<double> images_times_seq;
-vector<double> pose_times_seq;
-//vector<double> heading_times_seq;
+bool interpolate_pose = false;	//interpolate between the poses before and after the image time, instead of taking the nearest
 
 bool displayUAVPositions = false;
 bool wait_at_visualizer = true;
@@ -166,6 +264,7 @@ float match_conf = 0.3f;
 string save_log_to = "";
 int range_width = 30;		//matching will be done between range_width number of sequential images.
 bool use_segment_labels = false;
+bool plane_disparity_float = false;	//materialize plane fitted disparity images as float instead of double for point clouds
 bool release = true;
 
 bool segment_cloud = false;
@@ -176,8 +275,10 @@ double convexhull_alpha = 1.5 * voxel_size;				//0.15
 //int size_cloud_divider = 10;				//10
 
 ofstream log_file;	//logging stuff
+StageTimings timings;	//per stage latencies, written to timings.csv/json in the output folder
 Ptr<FeaturesFinder> finder;
-Ptr<cuda::DescriptorMatcher> matcher = cv::cuda::DescriptorMatcher::createBFMatcher(cv::NORM_HAMMING);
+Ptr<FeatureMatcher> matcher;
+string matcher_backend = "";	//cpu or cuda, empty uses cuda when available
 
 //dumb variables -> try to remove them
 pcl::PointCloud<pcl::PointXYZRGB>::Ptr hexPos_cloud;
@@ -186,6 +287,7 @@ boost::shared_ptr<pcl::visualization::PCLVisualizer> viewer_online;
 bool run3d_reconstruction = true;
 
 bool test_bad_data_rejection = false;
+string benchmark_name = "";
 
 //declaring functions
 void readCalibFile();
@@ -196,22 +298,29 @@ void readPoseFile();
 void populateData();
 void createPtCloud(int img_index, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb);
 void createSingleImgPtCloud(int accepted_img_index, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb);
+void reprojectDisparityGrid(Mat &dispImg, Mat &rgb_image, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb);
+Mat getBlurredDisparityImage(int accepted_img_index);
+Mat filterDisparityImage(Mat &dispImg, const vector<KeyPoint> *keypoints);
+void reprojectKeypoints(int accepted_img_index, Mat &dispImg, Mat &rgb_image, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb);
+void createFusedVoxelizedPtCloud(int accepted_img_index, const pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 &t_mat, 
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb_return);
 void transformPtCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb, pcl::PointCloud<pcl::PointXYZRGB>::Ptr transformed_cloudrgb, pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 transform);
 void createPlaneFittedDisparityImages(int i);
 pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 generateTmat(int current_idx);
-int binarySearchUsingTime(vector<double> seq, int l, int r, double time);
-int binarySearchImageTime(int l, int r, int imageNumber);
+int findImageTimeIndex(int imageNumber);
 int data_index_finder(int image_number);
 void printPoints(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud, int num);
 const string currentDateTime();
 double getMean(Mat disp_img, bool planeFitted);
 double getVariance(Mat disp_img, bool planeFitted);
+double getPlaneFittedVariance(int i);
+Mat getDisparityImage(RawImageData* raw_img_data_ptr);
 boost::shared_ptr<pcl::visualization::PCLVisualizer> visualize_pt_cloud(bool showcloud, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb, bool showmesh, pcl::PolygonMesh &mesh, string pt_cloud_name);
 void visualize_pt_cloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb, string pt_cloud_name);
 void visualize_pt_cloud_update(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb, string pt_cloud_name, boost::shared_ptr<pcl::visualization::PCLVisualizer> viewer);
 pcl::PointCloud<pcl::PointXYZRGB>::Ptr read_PLY_File(string point_cloud_filename);
 void save_pt_cloud_to_PLY_File(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb, string &writePath);
-pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 generate_tf_of_Matched_Keypoints(ImageData &currentImageDataObj, bool &acceptDecision);
+pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 generate_tf_of_Matched_Keypoints(ImageData &currentImageDataObj, bool &acceptDecision, const SpeculativeFrame *speculative = NULL);
 pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 runICPalignment(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_in, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_out);
 pcl::PointCloud<pcl::PointXYZRGB>::Ptr downsamplePtCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb, bool combinedPtCloud);
 void orbcudaPairwiseMatching();
@@ -219,22 +328,32 @@ void smoothPtCloud();
 void meshSurface();
 pcl::PointXYZRGB generateUAVpos(int current_idx);
 pcl::PointXYZRGB transformPoint(pcl::PointXYZRGB hexPosMAVLink, pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 T_SVD_matched_pts);
-void populateDisparityImages(int start_index, int end_index);
 void readDisparityImage(int i);
-void populateSegmentLabelMaps(int start_index, int end_index);
 void readSegmentLabelMap(int i);
-void populateImages(int start_index, int end_index);
 void readImage(int i);
-void populateDoubleDispImages(int start_index, int end_index);
+void readDisparityAndPlaneFit(int i);
+void fitDisparityPlanes(int i);
+void readImagePose(int i);
+uint64_t featureCacheHash();
+bool readCachedFeatures(int i);
+double getDisparityVariance(int i);
+void loadFrame(int i);
+void prefetchFrames(int current_idx);
+void waitForFrame(int i);
+void releaseRawImageData(int i);
 void displayPointCloudOnline(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud_combined_copy, 
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud_hexPos_FM, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloud_hexPos_MAVLink, int cycle, bool last_cycle);
-void createAndTransformPtCloud(int accepted_img_index, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb_return);
+void createAndTransformPtCloud(int accepted_img_index, const pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 &t_mat_FeatureMatched, 
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb_return);
+void processCloudBatch(boost::shared_ptr<CloudBatch> batch, VoxelMap &voxel_map, ChunkedPointCloud<pcl::PointXYZRGB> &cloud_big, boost::thread &the_visualization_thread);
+void cloudBuildingLoop(BoundedQueue<boost::shared_ptr<CloudBatch> > *cloud_queue, VoxelMap *voxel_map, ChunkedPointCloud<pcl::PointXYZRGB> *cloud_big, boost::thread *the_visualization_thread);
 void findNormalOfPtCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud);
-ImageData findFeatures(int img_idx);
+ImageData findFeatures(int img_idx, Ptr<FeaturesFinder> frame_finder = Ptr<FeaturesFinder>());
 int generate_Matched_Keypoints_Point_Cloud
 	(ImageData &currentImageDataObj, 
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &current_img_matched_keypoints, 
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &fitted_cloud_matched_keypoints);
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &fitted_cloud_matched_keypoints,
+	const SpeculativeFrame *speculative = NULL);
 void segmentCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb_orig);
 pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 basicBundleAdjustmentErrorCalculator
 			(pcl::PointCloud<pcl::PointXYZRGB>::Ptr current_img_matched_keypoints, pcl::PointCloud<pcl::PointXYZRGB>::Ptr fitted_cloud_matched_keypoints,
@@ -242,6 +361,29 @@ pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>:
 			pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 T_SVD_matched_pts, double threshold,
 			double &avg_inliers_err, int &inliers);
 double distanceCalculator(RawImageData* img_obj_ptr_src, RawImageData* img_obj_ptr_dst);
+void runBenchmark();
+void findNearbyImages(RawImageData* img_obj_ptr, vector<int> &dst_indices);
+void reprojectDisparityGridReference(Mat &dispImg, Mat &rgb_image, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb);
+void benchmarkReprojection();
+void writeTimingReport();
+void benchmarkFusedPtCloud();
+void benchmarkMatcher();
+void createPlaneFittedDisparityImagesReference(int i, Mat &new_disp_img);
+void benchmarkPlaneFit();
+void benchmarkFrameGate();
+void benchmarkDisparityFilter();
+void benchmarkOutlierRemoval();
+void benchmarkVoxelDownsample();
+void benchmarkCompactCloud();
+void createMatcher();
+void speculateFrames(int current_idx);
+void matchFrameAhead(SpeculativeFrame *frame, Ptr<FeaturesFinder> frame_finder);
+boost::shared_ptr<SpeculativeFrame> takeSpeculativeFrame(int raw_idx);
+void rejectFrame(int raw_idx, int reason);
+pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 correctTrajectory(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_FM, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_MAVLink);
+pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 correctTrajectoryICP(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_FM, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_MAVLink);
+void reprojectOrganizedGrid(Mat &dispImg, OrganizedGrid &grid);
+LockedStream logStream();
 
 
 
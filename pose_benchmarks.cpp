@@ -0,0 +1,767 @@
+//microbenchmarks comparing optimized kernels against the original implementations
+//run with ./pose img1 img2 --benchmark [name] [flags], the first image is used as test data
+
+void Pose::runBenchmark()
+{
+	readCalibFile();
+	readImage(0);
+	readDisparityAndPlaneFit(0);
+	cout << endl;
+	if (rawImageDataVec[0].rgb_image.empty() || rawImageDataVec[0].disparity_image.empty())
+		throw "Exception: benchmark could not read test images!";
+	
+	if (benchmark_name == "reprojection")
+		benchmarkReprojection();
+	else if (benchmark_name == "fused_cloud")
+		benchmarkFusedPtCloud();
+	else if (benchmark_name == "matcher")
+		benchmarkMatcher();
+	else if (benchmark_name == "plane_fit")
+		benchmarkPlaneFit();
+	else if (benchmark_name == "frame_gate")
+		benchmarkFrameGate();
+	else if (benchmark_name == "disp_filter")
+		benchmarkDisparityFilter();
+	else if (benchmark_name == "outlier_removal")
+		benchmarkOutlierRemoval();
+	else if (benchmark_name == "voxel_grid")
+		benchmarkVoxelDownsample();
+	else if (benchmark_name == "compact_cloud")
+		benchmarkCompactCloud();
+	else
+		throw "Exception: unknown benchmark!";
+}
+
+//original per pixel reprojection of createSingleImgPtCloud, kept as reference
+void Pose::reprojectDisparityGridReference(Mat &dispImg, Mat &rgb_image, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb)
+{
+	cv::Mat_<double> vec_tmp(4,1);
+	for (int y = boundingBox; y < rows - boundingBox;)
+	{
+		for (int x = cols_start_aft_cutout; x < cols - boundingBox;)
+		{
+			double disp_val = 0;
+			if(dispImg.depth() == CV_64F)
+				disp_val = dispImg.at<double>(y,x);
+			else if(dispImg.depth() == CV_32F)
+				disp_val = dispImg.at<float>(y,x);
+			else
+				disp_val = (double)dispImg.at<uchar>(y,x);
+			
+			if (disp_val > minDisparity)
+			{
+				vec_tmp(0)=x; vec_tmp(1)=y; vec_tmp(2)=disp_val; vec_tmp(3)=1;
+				vec_tmp = Q*vec_tmp;
+				vec_tmp /= vec_tmp(3);
+				
+				pcl::PointXYZRGB pt_3drgb;
+				pt_3drgb.x = (float)vec_tmp(0);
+				pt_3drgb.y = (float)vec_tmp(1);
+				pt_3drgb.z = (float)vec_tmp(2);
+				Vec3b color = rgb_image.at<Vec3b>(Point(x, y));
+				
+				uint32_t rgb = ((uint32_t)color[2] << 16 | (uint32_t)color[1] << 8 | (uint32_t)color[0]);
+				pt_3drgb.rgb = *reinterpret_cast<float*>(&rgb);
+				
+				cloudrgb->points.push_back(pt_3drgb);
+			}
+			x += jump_pixels;
+		}
+		y += jump_pixels;
+	}
+}
+
+void Pose::benchmarkReprojection()
+{
+	const int iterations = 50;
+	if (jump_pixels < 1)
+		jump_pixels = 1;
+	Mat dispImg = getDisparityImage(&rawImageDataVec[0]);
+	Mat rgb_image = rawImageDataVec[0].rgb_image;
+	
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_ref (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_new (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	string outlier_setting = outlier_removal;
+	outlier_removal = "none";	//the reference does not remove outliers
+	
+	int64 t0 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+	{
+		cloud_ref->clear();
+		reprojectDisparityGridReference(dispImg, rgb_image, cloud_ref);
+	}
+	int64 t1 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+	{
+		cloud_new->clear();
+		reprojectDisparityGrid(dispImg, rgb_image, cloud_new);
+	}
+	int64 t2 = getTickCount();
+	outlier_removal = outlier_setting;
+	
+	double max_err = 0;
+	bool same_size = cloud_ref->size() == cloud_new->size();
+	for (int i = 0; same_size && i < cloud_ref->size(); i++)
+	{
+		max_err = max(max_err, (double)fabs(cloud_ref->points[i].x - cloud_new->points[i].x));
+		max_err = max(max_err, (double)fabs(cloud_ref->points[i].y - cloud_new->points[i].y));
+		max_err = max(max_err, (double)fabs(cloud_ref->points[i].z - cloud_new->points[i].z));
+	}
+	
+	double t_ref = (t1 - t0) / getTickFrequency() / iterations * 1000;
+	double t_new = (t2 - t1) / getTickFrequency() / iterations * 1000;
+	cout << "\nreprojection benchmark, image " << rawImageDataVec[0].img_num << " jump_pixels " << jump_pixels 
+		<< (use_segment_labels ? (plane_disparity_float ? " plane fitted float disparity" : " plane fitted double disparity") : " uchar disparity") << endl;
+#if defined(__AVX__)
+	cout << "kernel: AVX" << endl;
+#elif defined(__SSE2__)
+	cout << "kernel: SSE2" << endl;
+#else
+	cout << "kernel: scalar" << endl;
+#endif
+	cout << "reference: " << t_ref << " ms/img, " << cloud_ref->size() << " points" << endl;
+	cout << "kernel:    " << t_new << " ms/img, " << cloud_new->size() << " points" << endl;
+	cout << "speedup " << t_ref / t_new << "x" << endl;
+	if (same_size)
+		cout << "max abs difference " << max_err << " m" << endl;
+	else
+		cout << "point counts differ!" << endl;
+}
+
+//legacy createSingleImgPtCloud -> transformPtCloud -> downsamplePtCloud against createFusedVoxelizedPtCloud
+//accuracy is the distance of every fused point to the nearest legacy point
+void Pose::benchmarkFusedPtCloud()
+{
+	const int iterations = 10;
+	finder = makePtr<OrbFeaturesFinder>();
+	ImageData currentImageDataObj = findFeatures(0);
+	//some rotation and translation, so that voxel boundaries are not aligned with the camera frame
+	currentImageDataObj.t_mat_FeatureMatched = pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4::Identity();
+	double yaw = 0.5;
+	currentImageDataObj.t_mat_FeatureMatched(0,0) = cos(yaw);
+	currentImageDataObj.t_mat_FeatureMatched(0,1) = -sin(yaw);
+	currentImageDataObj.t_mat_FeatureMatched(1,0) = sin(yaw);
+	currentImageDataObj.t_mat_FeatureMatched(1,1) = cos(yaw);
+	currentImageDataObj.t_mat_FeatureMatched(0,3) = 12.3;
+	currentImageDataObj.t_mat_FeatureMatched(1,3) = -4.56;
+	currentImageDataObj.t_mat_FeatureMatched(2,3) = 7.89;
+	acceptedImageDataVec.clear();
+	acceptedImageDataVec.push_back(currentImageDataObj);
+	dont_downsample = false;
+	
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_legacy (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_fused (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	
+	//the legacy path as it was, with StatisticalOutlierRemoval, against the fused path with grid removal
+	string outlier_setting = outlier_removal;
+	string fused_outlier_removal = outlier_setting == "sor" ? "grid" : outlier_setting;
+	int64 t0 = getTickCount();
+	legacy_pt_cloud = true;
+	outlier_removal = "sor";
+	for (int it = 0; it < iterations; it++)
+	{
+		cloud_legacy->clear();
+		createAndTransformPtCloud(0, acceptedImageDataVec[0].t_mat_FeatureMatched, cloud_legacy);
+	}
+	int64 t1 = getTickCount();
+	legacy_pt_cloud = false;
+	outlier_removal = fused_outlier_removal;
+	for (int it = 0; it < iterations; it++)
+	{
+		cloud_fused->clear();
+		createAndTransformPtCloud(0, acceptedImageDataVec[0].t_mat_FeatureMatched, cloud_fused);
+	}
+	int64 t2 = getTickCount();
+	outlier_removal = outlier_setting;
+	
+	double mean_dist = 0, max_dist = 0;
+	if (cloud_legacy->size() > 0 && cloud_fused->size() > 0)
+	{
+		pcl::KdTreeFLANN<pcl::PointXYZRGB> kdtree;
+		kdtree.setInputCloud(cloud_legacy);
+		vector<int> idx(1);
+		vector<float> sq_dist(1);
+		for (int i = 0; i < cloud_fused->size(); i++)
+		{
+			kdtree.nearestKSearch(cloud_fused->points[i], 1, idx, sq_dist);
+			double dist = sqrt(sq_dist[0]);
+			mean_dist += dist;
+			max_dist = max(max_dist, dist);
+		}
+		mean_dist /= cloud_fused->size();
+	}
+	
+	double t_legacy = (t1 - t0) / getTickFrequency() / iterations * 1000;
+	double t_fused = (t2 - t1) / getTickFrequency() / iterations * 1000;
+	cout << "\nfused point cloud benchmark, image " << rawImageDataVec[0].img_num << " jump_pixels " << jump_pixels << " leaf " << voxel_size/5 << " m" << endl;
+	cout << "legacy: " << t_legacy << " ms/img, " << cloud_legacy->size() << " points (outlier removal sor)" << endl;
+	cout << "fused:  " << t_fused << " ms/img, " << cloud_fused->size() << " points (outlier removal " << fused_outlier_removal << ")" << endl;
+	cout << "speedup " << t_legacy / t_fused << "x" << endl;
+	cout << "fused to nearest legacy point distance mean " << mean_dist << " m, max " << max_dist << " m" << endl;
+}
+
+//knn descriptor matching of the first two images as done in generate_Matched_Keypoints_Point_Cloud
+//cv::BFMatcher on the cpu is the reference, every available backend is timed and checked against it
+void Pose::benchmarkMatcher()
+{
+	const int iterations = 100;
+	int dst_idx = rawImageDataVec.size() > 1 ? 1 : 0;
+	if (dst_idx != 0)
+		readImage(dst_idx);
+	if (rawImageDataVec[dst_idx].rgb_image.empty())
+		dst_idx = 0;
+	
+	finder = makePtr<OrbFeaturesFinder>();
+	ImageFeatures features_src, features_dst;
+	(*finder)(rawImageDataVec[0].rgb_image, features_src);
+	(*finder)(rawImageDataVec[dst_idx].rgb_image, features_dst);
+	Mat desc_src = features_src.descriptors.getMat(ACCESS_READ).clone();
+	Mat desc_dst = features_dst.descriptors.getMat(ACCESS_READ).clone();
+	cout << "\nmatcher benchmark, images " << rawImageDataVec[0].img_num << " and " << rawImageDataVec[dst_idx].img_num 
+		<< ", " << desc_src.rows << " x " << desc_dst.rows << " descriptors of " << desc_src.cols << " bytes" << endl;
+#if defined(__AVX2__)
+	cout << "cpu hamming kernel: AVX2" << endl;
+#elif defined(__POPCNT__)
+	cout << "cpu hamming kernel: POPCNT" << endl;
+#else
+	cout << "cpu hamming kernel: scalar" << endl;
+#endif
+	
+	vector<vector<DMatch> > matches_ref;
+	BFMatcher bf_matcher(NORM_HAMMING);
+	int64 t0 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+		bf_matcher.knnMatch(desc_src, desc_dst, matches_ref, 2);
+	double t_ref = (getTickCount() - t0) / getTickFrequency() / iterations * 1000;
+	cout << "cv::BFMatcher: " << t_ref << " ms/pair" << endl;
+	
+	vector<Ptr<FeatureMatcher> > backends;
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+	backends.push_back(makePtr<CudaFeatureMatcher>());
+#endif
+	backends.push_back(makePtr<CpuHammingMatcher>((ThreadPool*)NULL));
+	backends.push_back(makePtr<CpuHammingMatcher>(pool.get()));
+	
+	for (int b = 0; b < backends.size(); b++)
+	{
+		MatchDescriptors src, dst;
+		backends[b]->prepare(desc_src, src);
+		backends[b]->prepare(desc_dst, dst);
+		vector<vector<DMatch> > matches;
+		int64 t1 = getTickCount();
+		for (int it = 0; it < iterations; it++)
+			backends[b]->knnMatch(src, dst, matches, 2);
+		double t = (getTickCount() - t1) / getTickFrequency() / iterations * 1000;
+		
+		//same distances as the reference, train indices may differ on ties
+		int same = 0;
+		for (int i = 0; i < matches.size() && i < matches_ref.size(); i++)
+		{
+			bool equal = matches[i].size() == matches_ref[i].size();
+			for (int j = 0; equal && j < matches[i].size(); j++)
+				equal = matches[i][j].distance == matches_ref[i][j].distance;
+			same += equal;
+		}
+		bool threaded = backends[b]->name() == "cpu" && b == backends.size() - 1;
+		cout << backends[b]->name() << (threaded ? " (" + to_string(pool->size()) + " threads)" : "") << ": " << t << " ms/pair, "
+			<< desc_src.rows / t * 1000 << " queries/sec, speedup " << t_ref / t << "x, "
+			<< same << "/" << matches_ref.size() << " queries with reference distances" << endl;
+		
+		//batched ratio test matching against a range_width window, as in generate_Matched_Keypoints_Point_Cloud
+		vector<const MatchDescriptors*> window(range_width, &dst);
+		vector<vector<DMatch> > good_matches;
+		int64 t2 = getTickCount();
+		for (int it = 0; it < iterations / 10; it++)
+			backends[b]->matchMany(src, window, 0.5, 40, good_matches);
+		double t_batch = (getTickCount() - t2) / getTickFrequency() / (iterations / 10) * 1000;
+		cout << "    batched window of " << range_width << ": " << t_batch << " ms, " << t_batch / range_width << " ms/pair, " 
+			<< (good_matches.empty() ? 0 : good_matches[0].size()) << " good matches/pair" << endl;
+	}
+}
+
+//original plane fitting of createPlaneFittedDisparityImages, one pass over the image per segment label, kept as reference
+void Pose::createPlaneFittedDisparityImagesReference(int i, Mat &new_disp_img)
+{
+	//cout << "Image" << i << endl;
+	Mat segment_img = rawImageDataVec[i].segment_label;
+	Mat disp_img = rawImageDataVec[i].disparity_image;
+	new_disp_img = Mat::zeros(disp_img.rows,disp_img.cols, CV_64F);
+	
+	for (int cluster = 1; cluster < 1024; cluster++)
+	{
+		//find pixels in this segment
+		vector<int> Xc, Yc;
+		for (int l = 0; l < segment_img.rows; l++)
+		{
+			for (int k = 0; k < segment_img.cols; k++)
+			{
+				if(segment_img.at<uchar>(l,k) == cluster)
+				{
+					Xc.push_back(k);
+					Yc.push_back(l);
+				}
+			}
+		}
+		//cout << "cluster" << cluster << " size:" << Xc.size();
+		if(Xc.size() == 0)		//all labels covered!
+			break;
+		
+		vector<double> Zp, Xp, Yp;
+		for (int p = 0; p < Xc.size(); p++)
+		{
+			if (Xc[p] > cols_start_aft_cutout && Xc[p] < segment_img.cols - boundingBox && Yc[p] > boundingBox && Yc[p] < segment_img.rows - boundingBox)
+			{
+				//cout << "disp_img.at<uchar>(Yc[p],Xc[p]): " << disp_img.at<uchar>(Yc[p],Xc[p]) << endl;
+				Zp.push_back((double)disp_img.at<uchar>(Yc[p],Xc[p]));
+				Xp.push_back((double)Xc[p]);
+				Yp.push_back((double)Yc[p]);
+			}
+		}
+		//cout << "read all cluster disparities..." << endl;
+		//cout << " Accepted points: " << Xp.size() << endl;
+		if(Xp.size() == 0)		//all labels covered!
+			continue;
+		
+		//define A matrix
+		Mat A = Mat::zeros(Xp.size(),3, CV_64F);
+		Mat b = Mat::zeros(Xp.size(),1, CV_64F);
+		for (int p = 0; p < Xp.size(); p++)
+		{
+			A.at<double>(p,0) = Xp[p];
+			A.at<double>(p,1) = Yp[p];
+			A.at<double>(p,2) = 1;
+			b.at<double>(p,0) = Zp[p];
+		}
+		//cout << "A.size() " << A.size() << endl;
+		
+		// Pseudo Inverse in Solution of Over-determined Linear System of Equations
+		// https://math.stackexchange.com/questions/99299/best-fitting-plane-given-a-set-of-points
+		
+		Mat At = A.t();
+		//cout << "At.size() " << At.size() << endl;
+		Mat AtA = At * A;
+		//cout << "AtA " << AtA << endl;
+		Mat AtAinv;
+		invert(AtA, AtAinv, DECOMP_SVD);
+		//cout << "AtAinv:\n" << AtAinv << endl;
+	
+		Mat x = AtAinv * At * b;
+		//cout << "x:\n" << x << endl;
+		
+		for (int p = 0; p < Xc.size(); p++)
+		{
+			new_disp_img.at<double>(Yc[p],Xc[p]) = 1.0 * x.at<double>(0,0) * Xc[p] + 1.0 * x.at<double>(0,1) * Yc[p] + 1.0 * x.at<double>(0,2);
+		}
+	}
+}
+
+//per label rescans of createPlaneFittedDisparityImagesReference against the single pass SegmentPlanes fit
+void Pose::benchmarkPlaneFit()
+{
+	const int iterations = 5;
+	if (rawImageDataVec[0].segment_label.empty())
+		readSegmentLabelMap(0);
+	if (rawImageDataVec[0].segment_label.empty())
+		throw "Exception: plane_fit benchmark needs the segment label map of the first image!";
+	Mat segment_img = rawImageDataVec[0].segment_label;
+	Mat disp_img = rawImageDataVec[0].disparity_image;
+	
+	Mat disp_ref, disp_new;
+	int64 t0 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+		createPlaneFittedDisparityImagesReference(0, disp_ref);
+	int64 t1 = getTickCount();
+	SegmentPlanes planes;
+	for (int it = 0; it < iterations; it++)
+	{
+		planes.fit(segment_img, disp_img, cols_start_aft_cutout, segment_img.cols - boundingBox, boundingBox, segment_img.rows - boundingBox);
+		planes.render(segment_img, disp_new);
+	}
+	int64 t2 = getTickCount();
+	
+	int n_planes = 0;
+	for (int l = 0; l < SegmentPlanes::max_labels; l++)
+		if (planes.fitted[l])
+			n_planes++;
+	double max_err = 0;
+	for (int y = 0; y < disp_ref.rows; y++)
+		for (int x = 0; x < disp_ref.cols; x++)
+			max_err = max(max_err, fabs(disp_ref.at<double>(y,x) - disp_new.at<double>(y,x)));
+	
+	double t_ref = (t1 - t0) / getTickFrequency() / iterations * 1000;
+	double t_new = (t2 - t1) / getTickFrequency() / iterations * 1000;
+	cout << "\nplane fit benchmark, image " << rawImageDataVec[0].img_num << ", " << n_planes << " segment planes" << endl;
+	cout << "reference:   " << t_ref << " ms/img" << endl;
+	cout << "single pass: " << t_new << " ms/img" << endl;
+	cout << "speedup " << t_ref / t_new << "x" << endl;
+	cout << "max abs difference " << max_err << " disparity" << endl;
+}
+
+//original two pass disparity mean and variance, kept as reference for the frame gate
+double Pose::getMean(Mat disp_img, bool planeFitted)
+{
+	double sum = 0.0;
+	for (int y = boundingBox; y < rows - boundingBox; ++y)
+	{
+		for (int x = cols_start_aft_cutout; x < cols - boundingBox; ++x)
+		{
+			double disp_val = 0;
+			if(planeFitted)
+				disp_val = disp_img.at<double>(y,x);
+			else
+				disp_val = (double)disp_img.at<uchar>(y,x);
+			
+			if (disp_val > minDisparity)
+				sum += disp_val;
+		}
+	}
+	return sum/((rows - 2 * boundingBox )*(cols - boundingBox - cols_start_aft_cutout));
+}
+
+double Pose::getVariance(Mat disp_img, bool planeFitted)
+{
+	double mean = getMean(disp_img, planeFitted);
+	double temp = 0;
+	
+	for (int y = boundingBox; y < rows - boundingBox; ++y)
+	{
+		for (int x = cols_start_aft_cutout; x < cols - boundingBox; ++x)
+		{
+			double disp_val = 0;
+			if(planeFitted)
+				disp_val = disp_img.at<double>(y,x);
+			else
+				disp_val = (double)disp_img.at<uchar>(y,x);
+			
+			if (disp_val > minDisparity)
+				temp += (disp_val-mean)*(disp_val-mean);
+		}
+	}
+	double var = temp/((rows - 2 * boundingBox )*(cols - boundingBox - cols_start_aft_cutout) - 1);
+	return var;
+}
+
+void Pose::benchmarkFrameGate()
+{
+	const int iterations = 200;
+	Mat disp_img = rawImageDataVec[0].disparity_image;
+	
+	double var_ref = 0;
+	int64 t0 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+		var_ref = getVariance(disp_img, false);
+	int64 t1 = getTickCount();
+	DisparityStats stats;
+	for (int it = 0; it < iterations; it++)
+		stats = disparityStats(disp_img, cols_start_aft_cutout, cols - boundingBox, boundingBox, rows - boundingBox, minDisparity, gate_decimation);
+	int64 t2 = getTickCount();
+	
+	double t_ref = (t1 - t0) / getTickFrequency() / iterations * 1000;
+	double t_new = (t2 - t1) / getTickFrequency() / iterations * 1000;
+	cout << "\nframe gate benchmark, image " << rawImageDataVec[0].img_num << ", decimation " << gate_decimation
+		<< ", " << stats.n_valid << "/" << stats.n_sampled << " sampled pixels valid" << endl;
+#if defined(__AVX2__)
+	cout << "kernel: " << (gate_decimation == 1 ? "AVX2" : "scalar (AVX2 only without decimation)") << endl;
+#else
+	cout << "kernel: scalar" << endl;
+#endif
+	cout << "two pass:  " << t_ref << " ms/img, variance " << var_ref << endl;
+	cout << "one pass:  " << t_new << " ms/img, variance " << stats.variance << endl;
+	cout << "speedup " << t_ref / t_new << "x" << endl;
+	cout << "variance difference " << fabs(var_ref - stats.variance) << endl;
+}
+
+void Pose::benchmarkDisparityFilter()
+{
+	const int iterations = 5;
+	if (jump_pixels < 1)
+		jump_pixels = 1;
+	if (blur_kernel <= 1)
+		blur_kernel = 31;
+	Mat dispImg = getDisparityImage(&rawImageDataVec[0]);
+	if (dispImg.depth() == CV_64F)
+		throw "Exception: bilateralFilter needs uchar or float disparity images, add --plane_disparity_float!";
+	
+	Mat disp_full, disp_sparse, disp_guided;
+	string filter_setting = disp_filter;
+	int64 t0 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+		bilateralFilter ( dispImg, disp_full, blur_kernel, blur_kernel*2, blur_kernel/2 );
+	int64 t1 = getTickCount();
+	disp_filter = "sparse";
+	for (int it = 0; it < iterations; it++)
+		disp_sparse = filterDisparityImage(dispImg, NULL);
+	int64 t2 = getTickCount();
+	disp_filter = "guided";
+	for (int it = 0; it < iterations; it++)
+		disp_guided = filterDisparityImage(dispImg, NULL);
+	int64 t3 = getTickCount();
+	disp_filter = filter_setting;
+	
+	//accuracy on the pixels the point cloud reads
+	Mat full64, sparse64, guided64;
+	disp_full.convertTo(full64, CV_64F);
+	disp_sparse.convertTo(sparse64, CV_64F);
+	disp_guided.convertTo(guided64, CV_64F);
+	int n = 0, sparse_differing = 0;
+	double sparse_max_err = 0, guided_max_err = 0, guided_sum_err = 0;
+	for (int y = boundingBox; y < rows - boundingBox; y += jump_pixels)
+	{
+		for (int x = cols_start_aft_cutout; x < cols - boundingBox; x += jump_pixels)
+		{
+			double ref = full64.at<double>(y,x);
+			double sparse_err = fabs(sparse64.at<double>(y,x) - ref);
+			double guided_err = fabs(guided64.at<double>(y,x) - ref);
+			if (sparse_err > 0)
+				sparse_differing++;
+			sparse_max_err = max(sparse_max_err, sparse_err);
+			guided_max_err = max(guided_max_err, guided_err);
+			guided_sum_err += guided_err;
+			n++;
+		}
+	}
+	
+	double t_full = (t1 - t0) / getTickFrequency() / iterations * 1000;
+	double t_sparse = (t2 - t1) / getTickFrequency() / iterations * 1000;
+	double t_guided = (t3 - t2) / getTickFrequency() / iterations * 1000;
+	cout << "\ndisparity filter benchmark, image " << rawImageDataVec[0].img_num << ", blur_kernel " << blur_kernel 
+		<< ", jump_pixels " << jump_pixels << ", " << n << " sampled pixels, " << pool->size() << " threads" << endl;
+	cout << "full bilateral:   " << t_full << " ms/img" << endl;
+	cout << "sparse bilateral: " << t_sparse << " ms/img, speedup " << t_full / t_sparse << "x, " 
+		<< sparse_differing << " pixels differ, max abs difference " << sparse_max_err << endl;
+	if (dispImg.depth() == CV_32F)
+		cout << "  float image: sparse uses exact color weights, OpenCV a binned table, small differences are expected" << endl;
+	cout << "sparse guided:    " << t_guided << " ms/img, speedup " << t_full / t_guided << "x, "
+		<< "mean abs difference " << guided_sum_err / max(n, 1) << " max " << guided_max_err << endl;
+}
+
+//pcl::StatisticalOutlierRemoval (meanK 50, stddev 1.0, as in downsamplePtCloud) on the reprojected pixel grid against
+//removeGridOutliers on the same points. the k-th valid grid cell is the k-th point of the cloud
+void Pose::benchmarkOutlierRemoval()
+{
+	const int iterations = 10;
+	if (jump_pixels < 1)
+		jump_pixels = 1;
+	Mat dispImg = getDisparityImage(&rawImageDataVec[0]);
+	Mat rgb_image = rawImageDataVec[0].rgb_image;
+	
+	string outlier_setting = outlier_removal;
+	outlier_removal = "none";
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	reprojectDisparityGrid(dispImg, rgb_image, cloud);
+	OrganizedGrid unfiltered;
+	reprojectOrganizedGrid(dispImg, unfiltered);
+	outlier_removal = outlier_setting;
+	if (cloud->size() == 0)
+		throw "Exception: benchmark image has no valid disparities!";
+	
+	pcl::PointIndices sor_removed;
+	pcl::PointCloud<pcl::PointXYZRGB> cloud_sor;
+	int64 t0 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+	{
+		pcl::StatisticalOutlierRemoval<pcl::PointXYZRGB> sor0(true);
+		sor0.setInputCloud (cloud);
+		sor0.setMeanK (50);
+		sor0.setStddevMulThresh (1.0);
+		sor0.filter (cloud_sor);
+		sor0.getRemovedIndices(sor_removed);
+	}
+	int64 t1 = getTickCount();
+	OrganizedGrid grid;
+	int grid_removed = 0;
+	for (int it = 0; it < iterations; it++)
+	{
+		grid = unfiltered;
+		grid_removed = removeGridOutliers(grid, outlier_window, 1.0);
+	}
+	int64 t2 = getTickCount();
+	
+	//removed flags of the cloud points by both filters
+	vector<bool> removed_sor(cloud->size(), false), removed_grid(cloud->size(), false);
+	for (int i = 0; i < sor_removed.indices.size(); i++)
+		removed_sor[sor_removed.indices[i]] = true;
+	int k = 0;
+	for (size_t i = 0; i < grid.valid.size(); i++)
+	{
+		if (unfiltered.valid[i] == 0.0f)
+			continue;
+		if (k < cloud->size())
+			removed_grid[k] = grid.valid[i] == 0.0f;
+		k++;
+	}
+	if (k != cloud->size())
+		throw "Exception: organized grid and point cloud differ!";
+	int both = 0, agree = 0;
+	for (int i = 0; i < cloud->size(); i++)
+	{
+		if (removed_sor[i] && removed_grid[i])
+			both++;
+		if (removed_sor[i] == removed_grid[i])
+			agree++;
+	}
+	
+	double t_sor = (t1 - t0) / getTickFrequency() / iterations * 1000;
+	double t_grid = (t2 - t1) / getTickFrequency() / iterations * 1000;
+	cout << "\noutlier removal benchmark, image " << rawImageDataVec[0].img_num << " jump_pixels " << jump_pixels 
+		<< ", " << cloud->size() << " points, grid window " << 2 * outlier_window + 1 << "x" << 2 * outlier_window + 1 << endl;
+	cout << "StatisticalOutlierRemoval: " << t_sor << " ms/img, " << sor_removed.indices.size() << " removed" << endl;
+	cout << "grid outlier removal:      " << t_grid << " ms/img, " << grid_removed << " removed" << endl;
+	cout << "speedup " << t_sor / t_grid << "x" << endl;
+	cout << "removed by both " << both << ", same decision for " << 100.0 * agree / cloud->size() << "% of the points" << endl;
+}
+
+//combined point cloud downsampling of the old downsamplePtCloud, pcl::VoxelGrid with 1000 m high voxels around
+//points raised by 500 m, against VoxelDownsampler. the test cloud is the first image repeated along a flight line
+void Pose::benchmarkVoxelDownsample()
+{
+	const int iterations = 5;
+	const int copies = 50;
+	if (jump_pixels < 1)
+		jump_pixels = 1;
+	Mat dispImg = getDisparityImage(&rawImageDataVec[0]);
+	Mat rgb_image = rawImageDataVec[0].rgb_image;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_img (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	reprojectDisparityGrid(dispImg, rgb_image, cloud_img);
+	if (cloud_img->size() == 0)
+		throw "Exception: benchmark image has no valid disparities!";
+	
+	//copies shifted by 80% of the image extent in x, as consecutive images of a flight overlap
+	double min_x = cloud_img->points[0].x, max_x = min_x;
+	for (int i = 0; i < cloud_img->size(); i++)
+	{
+		min_x = min(min_x, (double)cloud_img->points[i].x);
+		max_x = max(max_x, (double)cloud_img->points[i].x);
+	}
+	double step = 0.8 * (max_x - min_x);
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	cloud->points.reserve((size_t)copies * cloud_img->size());
+	for (int c = 0; c < copies; c++)
+	{
+		for (int i = 0; i < cloud_img->size(); i++)
+		{
+			pcl::PointXYZRGB pt = cloud_img->points[i];
+			pt.x += c * step;
+			cloud->points.push_back(pt);
+		}
+	}
+	cloud->width = cloud->points.size();
+	cloud->height = 1;
+	
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_pcl (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_new (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	int64 t0 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+	{
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_raised (new pcl::PointCloud<pcl::PointXYZRGB> (*cloud));
+		for (int i = 0; i < cloud_raised->size(); i++)
+			cloud_raised->points[i].z += 500;
+		pcl::VoxelGrid<pcl::PointXYZRGB> sor;
+		sor.setInputCloud (cloud_raised);
+		sor.setMinimumPointsNumberPerVoxel(min_points_per_voxel);
+		sor.setLeafSize (voxel_size,voxel_size,1000);
+		sor.filter (*cloud_pcl);
+		for (int i = 0; i < cloud_pcl->size(); i++)
+			cloud_pcl->points[i].z -= 500;
+	}
+	int64 t1 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+	{
+		VoxelDownsampler downsampler(voxel_size, voxel_size, 0, pool.get());
+		downsampler.filter(*cloud, *cloud_new, min_points_per_voxel);
+	}
+	int64 t2 = getTickCount();
+	
+	double mean_dist = 0, max_dist = 0;
+	if (cloud_pcl->size() > 0 && cloud_new->size() > 0)
+	{
+		pcl::KdTreeFLANN<pcl::PointXYZRGB> kdtree;
+		kdtree.setInputCloud(cloud_pcl);
+		vector<int> idx(1);
+		vector<float> sq_dist(1);
+		for (int i = 0; i < cloud_new->size(); i++)
+		{
+			kdtree.nearestKSearch(cloud_new->points[i], 1, idx, sq_dist);
+			double dist = sqrt(sq_dist[0]);
+			mean_dist += dist;
+			max_dist = max(max_dist, dist);
+		}
+		mean_dist /= cloud_new->size();
+	}
+	
+	double t_pcl = (t1 - t0) / getTickFrequency() / iterations * 1000;
+	double t_new = (t2 - t1) / getTickFrequency() / iterations * 1000;
+	cout << "\nvoxel downsampling benchmark, image " << rawImageDataVec[0].img_num << " x" << copies << ", " << cloud->size() 
+		<< " points, leaf " << voxel_size << " m, " << pool->size() << " threads" << endl;
+	cout << "pcl::VoxelGrid:   " << t_pcl << " ms, " << cloud_pcl->size() << " voxels" << endl;
+	cout << "VoxelDownsampler: " << t_new << " ms, " << cloud_new->size() << " voxels" << endl;
+	cout << "speedup " << t_pcl / t_new << "x" << endl;
+	cout << "new to nearest pcl voxel distance mean " << mean_dist << " m, max " << max_dist << " m" << endl;
+}
+
+//CompactPointCloud encoding and decoding of the reprojected first image at the quantum of the accumulated point cloud,
+//against copying the pcl::PointXYZRGB cloud. accuracy is the largest coordinate difference after a round trip
+void Pose::benchmarkCompactCloud()
+{
+	const int iterations = 20;
+	if (jump_pixels < 1)
+		jump_pixels = 1;
+	double quantum = map_quantum > 0 ? map_quantum : voxel_size / 20;
+	Mat dispImg = getDisparityImage(&rawImageDataVec[0]);
+	Mat rgb_image = rawImageDataVec[0].rgb_image;
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud (new pcl::PointCloud<pcl::PointXYZRGB> ());
+	reprojectDisparityGrid(dispImg, rgb_image, cloud);
+	if (cloud->size() == 0)
+		throw "Exception: benchmark image has no valid disparities!";
+	//survey coordinates, some hundred m away from the origin
+	for (int i = 0; i < cloud->size(); i++)
+	{
+		cloud->points[i].x += 345.6;
+		cloud->points[i].y -= 123.4;
+	}
+	
+	pcl::PointCloud<pcl::PointXYZRGB> cloud_copy, cloud_decoded;
+	int64 t0 = getTickCount();
+	for (int it = 0; it < iterations; it++)
+		cloud_copy = *cloud;
+	int64 t1 = getTickCount();
+	CompactPointCloud compact(quantum);
+	for (int it = 0; it < iterations; it++)
+	{
+		compact = CompactPointCloud(quantum);
+		compact.append(*cloud);
+	}
+	int64 t2 = getTickCount();
+	cloud_decoded.points.resize(compact.size());
+	for (int it = 0; it < iterations; it++)
+		compact.decode(&cloud_decoded.points[0]);
+	int64 t3 = getTickCount();
+	
+	//tiles may reorder points, compare sorted coordinates of both clouds per axis
+	double max_err = 0;
+	bool same_colors = true;
+	for (int a = 0; a < 3; a++)
+	{
+		vector<float> ref(cloud->size()), dec(cloud_decoded.size());
+		for (int i = 0; i < ref.size(); i++)
+			ref[i] = a == 0 ? cloud->points[i].x : (a == 1 ? cloud->points[i].y : cloud->points[i].z);
+		for (int i = 0; i < dec.size(); i++)
+			dec[i] = a == 0 ? cloud_decoded.points[i].x : (a == 1 ? cloud_decoded.points[i].y : cloud_decoded.points[i].z);
+		sort(ref.begin(), ref.end());
+		sort(dec.begin(), dec.end());
+		for (int i = 0; i < ref.size() && i < dec.size(); i++)
+			max_err = max(max_err, (double)fabs(ref[i] - dec[i]));
+	}
+	if (compact.numTiles() == 1)
+		for (int i = 0; i < cloud->size(); i++)
+			same_colors = same_colors && cloud->points[i].r == cloud_decoded.points[i].r && cloud->points[i].g == cloud_decoded.points[i].g && cloud->points[i].b == cloud_decoded.points[i].b;
+	
+	double t_copy = (t1 - t0) / getTickFrequency() / iterations * 1000;
+	double t_encode = (t2 - t1) / getTickFrequency() / iterations * 1000;
+	double t_decode = (t3 - t2) / getTickFrequency() / iterations * 1000;
+	cout << "\ncompact point cloud benchmark, image " << rawImageDataVec[0].img_num << ", " << cloud->size() << " points, quantum " << quantum 
+		<< " m, " << compact.numTiles() << " tiles" << endl;
+	cout << "pcl::PointXYZRGB: " << sizeof(pcl::PointXYZRGB) << " bytes/point, copy " << t_copy << " ms" << endl;
+	cout << "CompactPoint:     " << (double)compact.sizeBytes() / compact.size() << " bytes/point, encode " << t_encode << " ms, decode " << t_decode << " ms" << endl;
+	cout << "max abs coordinate difference " << max_err << " m" << (compact.numTiles() == 1 ? (same_colors ? ", colors equal" : ", colors differ!") : "") << endl;
+}
@@ -21,6 +21,8 @@ void Pose::printUsage()
 		"\n  - disparity images will be read from " << disparityPrefix <<
 		"\n  - segmented label maps will be read from " << segmentlblPrefix <<
 		"\n\nFlags:"
+		"\n  --plane_disparity_float"
+		"\n      with --use_segment_labels, build point clouds from float instead of double plane fitted disparity images"
 		"\n  --use_segment_labels"
 		"\n      Use pre-made segmented labels for every image to improve resolution of disparity images"
 		"\n  --jump_pixels [int]"
@@ -29,7 +31,7 @@ void Pose::printUsage()
 		"\n  --seq_len [int]"
 		"\n      number of images to consider during online visualization cycles"
 		"\n  --range_width [int]"
-		"\n      Number of nearby images to do pairwise matching on for every image"
+		"\n      Max number of nearby images to do pairwise matching on for every image, nearest ones are used"
 		"\n  --dist_nearby [double]"
 		"\n      Max allowable distance of hex position image to check for pairwise matching"
 		"\n  --preview"
@@ -48,8 +50,25 @@ void Pose::printUsage()
 		"\n      Voxel size in m to find average value of points for downsampling"
 		"\n  --min_points_per_voxel [int]"
 		"\n      Set minimum number of points required during downsampling a voxel of combined point cloud, not single image point cloud"
+		"\n  --map_memory_mb [float]"
+		"\n      keep at most this many MB of voxel map tiles in memory, least recently used tiles are spilled to the output folder"
+		"\n      and the map is written to cloud.ply tile by tile. Use with --stream to bound image memory too. Default 0, no limit"
+		"\n      --preview then shows only the tiles in memory, around the recent UAV positions, not the full map"
+		"\n  --voxel_3d"
+		"\n      downsample the combined point cloud into voxel_size cubes instead of 2.5D columns of all heights"
 		"\n  --blur_kernel [int]"
 		"\n      Blur kernel size to blur disparity image to reject outliers. Current implementation is of either median blur or bilateral blur"
+		"\n  --disp_filter full/sparse/guided"
+		"\n      with --blur_kernel, bilateral filter the whole disparity image, bilateral filter only the pixels the point cloud uses,"
+		"\n      or use a guided filter approximation at those pixels, O(1) per pixel. sparse matches full exactly only for uchar"
+		"\n      disparity images, float images differ slightly from OpenCV's interpolated color weights. Default sparse"
+		"\n  --outlier_removal grid/sor/none"
+		"\n      remove outliers of single image point clouds by the mean distance to their neighbours on the sampled pixel grid,"
+		"\n      with PCL StatisticalOutlierRemoval (meanK 50, only with --legacy_pt_cloud), or not at all."
+		"\n      Default grid, sor with --legacy_pt_cloud"
+		"\n      like the PCL filter, grid removal is skipped with --dont_downsample, those clouds keep every reprojected point"
+		"\n  --outlier_window [int]"
+		"\n      half size of the grid neighbourhood of --outlier_removal grid, in sampled pixels. Default 3"
 		"\n  --downsample [Pt Cloud file name] (optional)--voxel_size [float]"
 		"\n      Downsample a point cloud along with optional voxel size in meters"
 		"\n  --smooth_surface [Pt Cloud file name] (optional)--search_radius [float]"
@@ -62,8 +81,39 @@ void Pose::printUsage()
 		"\n      dont do feature matching, create point cloud only using MAVLink pose"
 		"\n  --dont_downsample"
 		"\n      dont use the VoxelGrid Filter to create a 2.5D Digital Elevation Map"
+		"\n  --map_quantum [float]"
+		"\n      with --dont_downsample, the accumulated point cloud keeps coordinates in multiples of this many m. Default voxel_size / 20"
+		"\n  --speculate [int]"
+		"\n      number of frames to find features for and match in parallel ahead of the pose chain. 0 disables. Default 4"
+		"\n  --dont_pipeline"
+		"\n      build the point clouds of a cycle before matching the next cycle, instead of overlapping the two"
+		"\n  --legacy_pt_cloud"
+		"\n      build single image point clouds with separate reproject, transform, outlier removal and VoxelGrid steps"
+		"\n      instead of the fused voxelizing pass, with --outlier_removal sor unless given. For A/B comparisons"
 		"\n  --dont_icp"
 		"\n      dont use ICP to correct orientation of point cloud"
+		"\n  --legacy_icp"
+		"\n      correct the orientation with PCL ICP over all UAV positions instead of the closed form trajectory alignment. For A/B comparisons"
+		"\n  --align_decay [double]"
+		"\n      weight factor applied to earlier UAV positions every cycle in the trajectory alignment, 1 weighs all positions equally. Default 1"
+		"\n  --threads [int]"
+		"\n      number of worker threads in the shared task pool. Default 0 uses all hardware threads"
+		"\n  --matcher cpu/cuda"
+		"\n      descriptor matching backend. Default cuda when OpenCV was built with it, otherwise cpu"
+		"\n  --stream"
+		"\n      stream images from disk while reconstructing instead of reading all of them at startup"
+		"\n  --prefetch [int]"
+		"\n      with --stream, number of images to decode ahead of the image being processed. Default 32"
+		"\n  --interpolate_pose"
+		"\n      interpolate UAV position and orientation (SLERP) between the poses around the image time instead of taking the nearest pose"
+		"\n  --feature_cache [dir]"
+		"\n      keep features of every image in dir and reuse them in later runs with the same calibration and image size"
+		"\n  --match_cache_mb [int]"
+		"\n      memory for matches of image pairs kept for retries and re-alignment, oldest images are dropped first. Default 256"
+		"\n  --gate_decimation [int]"
+		"\n      compute the disparity variance of the frame quality gate on every n-th row and column only. Default 1"
+		"\n  --benchmark [name]"
+		"\n      run a microbenchmark on the first image instead of reconstruction. name: reprojection, fused_cloud, matcher, plane_fit, frame_gate, disp_filter, outlier_removal, voxel_grid, compact_cloud"
 		<< endl;
 }
 
@@ -76,6 +126,7 @@ int Pose::parseCmdArgs(int argc, char** argv)
 	}
 	int n_imgs = 0;
 	int first_img_num = -1, last_img_num = -1;
+	bool outlier_removal_given = false;
 	for (int i = 1; i < argc; ++i)
 	{
 		if (string(argv[i]) == "--help" || string(argv[i]) == "/?")
@@ -143,12 +194,50 @@ int Pose::parseCmdArgs(int argc, char** argv)
 			cout << "min_points_per_voxel " << min_points_per_voxel << endl;
 			i++;
 		}
+		else if (string(argv[i]) == "--map_memory_mb")
+		{
+			map_memory_mb = atof(argv[i + 1]);
+			if (map_memory_mb < 0)
+				throw "Exception: map_memory_mb must not be negative!";
+			cout << "map_memory_mb " << map_memory_mb << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--voxel_3d")
+		{
+			voxel_3d = true;
+			cout << "voxel_3d " << endl;
+		}
 		else if (string(argv[i]) == "--dist_nearby")
 		{
 			dist_nearby = atof(argv[i + 1]);
 			cout << "dist_nearby " << dist_nearby << endl;
 			i++;
 		}
+		else if (string(argv[i]) == "--disp_filter")
+		{
+			disp_filter = string(argv[i + 1]);
+			if (disp_filter != "full" && disp_filter != "sparse" && disp_filter != "guided")
+				throw "Exception: unknown disp_filter!";
+			cout << "disp_filter " << disp_filter << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--outlier_removal")
+		{
+			outlier_removal = string(argv[i + 1]);
+			if (outlier_removal != "grid" && outlier_removal != "sor" && outlier_removal != "none")
+				throw "Exception: unknown outlier_removal!";
+			outlier_removal_given = true;
+			cout << "outlier_removal " << outlier_removal << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--outlier_window")
+		{
+			outlier_window = atoi(argv[i + 1]);
+			if (outlier_window < 1)
+				throw "Exception: outlier_window must be at least 1!";
+			cout << "outlier_window " << outlier_window << endl;
+			i++;
+		}
 		else if (string(argv[i]) == "--blur_kernel")
 		{
 			blur_kernel = atoi(argv[i + 1]);
@@ -224,6 +313,11 @@ int Pose::parseCmdArgs(int argc, char** argv)
 		{
 			preview = true;
 		}
+		else if (string(argv[i]) == "--plane_disparity_float")
+		{
+			plane_disparity_float = true;
+			cout << "plane_disparity_float" << endl;
+		}
 		else if (string(argv[i]) == "--use_segment_labels")
 		{
 			cout << "use_segment_labels" << endl;
@@ -239,11 +333,108 @@ int Pose::parseCmdArgs(int argc, char** argv)
 			dont_downsample = true;
 			cout << "dont_downsample " << endl;
 		}
+		else if (string(argv[i]) == "--map_quantum")
+		{
+			map_quantum = atof(argv[i + 1]);
+			if (map_quantum <= 0)
+				throw "Exception: map_quantum must be positive!";
+			cout << "map_quantum " << map_quantum << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--speculate")
+		{
+			speculate_frames = atoi(argv[i + 1]);
+			cout << "speculate " << speculate_frames << endl;
+			if (speculate_frames < 0)
+				throw "Exception: invalid speculate value!";
+			i++;
+		}
+		else if (string(argv[i]) == "--dont_pipeline")
+		{
+			dont_pipeline = true;
+			cout << "dont_pipeline " << endl;
+		}
+		else if (string(argv[i]) == "--legacy_pt_cloud")
+		{
+			legacy_pt_cloud = true;
+			cout << "legacy_pt_cloud " << endl;
+		}
 		else if (string(argv[i]) == "--dont_icp")
 		{
 			dont_icp = true;
 			cout << "dont_icp " << endl;
 		}
+		else if (string(argv[i]) == "--legacy_icp")
+		{
+			legacy_icp = true;
+			cout << "legacy_icp " << endl;
+		}
+		else if (string(argv[i]) == "--align_decay")
+		{
+			align_decay = atof(argv[i + 1]);
+			if (align_decay <= 0 || align_decay > 1)
+				throw "Exception: align_decay has to be in (0, 1]!";
+			trajectory_aligner.setDecay(align_decay);
+			cout << "align_decay " << align_decay << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--threads")
+		{
+			num_threads = atoi(argv[i + 1]);
+			cout << "threads " << num_threads << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--benchmark")
+		{
+			benchmark_name = string(argv[i + 1]);
+			cout << "benchmark " << benchmark_name << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--matcher")
+		{
+			matcher_backend = string(argv[i + 1]);
+			cout << "matcher " << matcher_backend << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--stream")
+		{
+			stream_frames = true;
+			cout << "stream " << endl;
+		}
+		else if (string(argv[i]) == "--interpolate_pose")
+		{
+			interpolate_pose = true;
+			cout << "interpolate_pose " << endl;
+		}
+		else if (string(argv[i]) == "--feature_cache")
+		{
+			feature_cache_dir = string(argv[i + 1]);
+			cout << "feature_cache " << feature_cache_dir << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--match_cache_mb")
+		{
+			match_cache_mb = atoi(argv[i + 1]);
+			if (match_cache_mb < 0)
+				throw "Exception: match_cache_mb must not be negative!";
+			match_cache.setMaxBytes((size_t)match_cache_mb << 20);
+			cout << "match_cache_mb " << match_cache_mb << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--gate_decimation")
+		{
+			gate_decimation = max(1, atoi(argv[i + 1]));
+			cout << "gate_decimation " << gate_decimation << endl;
+			i++;
+		}
+		else if (string(argv[i]) == "--prefetch")
+		{
+			prefetch_frames = atoi(argv[i + 1]);
+			cout << "prefetch " << prefetch_frames << endl;
+			if (prefetch_frames < 1)
+				throw "Exception: invalid prefetch value!";
+			i++;
+		}
 		else
 		{
 			//img_numbers.push_back(atoi(argv[i]));
@@ -255,6 +446,14 @@ int Pose::parseCmdArgs(int argc, char** argv)
 			++n_imgs;
 		}
 	}
+	//the legacy path is the original one, with StatisticalOutlierRemoval, which only runs there
+	if (legacy_pt_cloud && !outlier_removal_given)
+	{
+		outlier_removal = "sor";
+		cout << "outlier_removal " << outlier_removal << endl;
+	}
+	if (outlier_removal == "sor" && !legacy_pt_cloud)
+		throw "Exception: outlier_removal sor needs --legacy_pt_cloud!";
 	if (run3d_reconstruction && n_imgs == 0)
 	{
 		ifstream images_file;
@@ -344,124 +543,49 @@ const string Pose::currentDateTime()
     return buf;
 }
 
-//http://www.cplusplus.com/forum/general/17771/
-//-----------------------------------------------------------------------------
-// Let's overload the stream input operator to read a list of CSV fields (which a CSV record).
-// Remember, a record is a list of doubles separated by commas ','.
-istream& operator >> ( istream& ins, record_t& record )
+//index of an image number in images_times_nums
+int Pose::findImageTimeIndex(int imageNumber)
 {
-	// make sure that the returned record contains only the stuff we read now
-	record.clear();
-
-	// read the entire line into a string (a CSV record is terminated by a newline)
-	string line;
-	getline( ins, line );
-
-	// now we'll use a stringstream to separate the fields out of the line
-	stringstream ss( line );
-	string field;
-	while (getline( ss, field, ',' ))
+	vector<double>::const_iterator it = lower_bound(images_times_nums.begin(), images_times_nums.end(), imageNumber);
+	if (it == images_times_nums.end() || (int)*it != imageNumber)
 	{
-		// for each field we wish to convert it to a double
-		// (since we require that the CSV contains nothing but floating-point values)
-		stringstream fs( field );
-		double f = 0.0;  // (default value is 0.0)
-		fs >> f;
-
-		// add the newly-converted field to the end of the record
-		record.push_back( f );
+		printf("imageNumber:%d", imageNumber);
+		throw "Exception: findImageTimeIndex: unsuccessful search!";
 	}
-
-	// Now we have read a single line, converted into a list of fields, converted the fields
-	// from strings to doubles, and stored the results in the argument record, so
-	// we just return the argument stream as required for this kind of input overload function.
-	return ins;
+	return it - images_times_nums.begin();
 }
 
-//-----------------------------------------------------------------------------
-// Let's likewise overload the stream input operator to read a list of CSV records.
-// This time it is a little easier, just because we only need to worry about reading
-// records, and not fields.
-istream& operator >> ( istream& ins, data_t& data )
+//write all stage timings to timings.csv and timings.json in the output folder and print p50/p95/p99 per stage
+void Pose::writeTimingReport()
 {
-	// make sure that the returned data only contains the CSV data we read here
-	data.clear();
-	
-	// For every record we can read from the file, append it to our resulting data
-	record_t record;
-	while (ins >> record)
-		data.push_back( record );
-	
-	// Again, return the argument stream as required for this kind of input stream overload.
-	return ins;  
-}
-
-// A recursive binary search function. It returns 
-// location of x in given array arr[l..r] is present, 
-// otherwise -1
-int Pose::binarySearchImageTime(int l, int r, int imageNumber)
-{
-	if (r >= l)
-	{
-        int mid = l + (r - l)/2;
- 
-        // If the element is present at the middle
-        if((int)images_times_data[mid][0] == imageNumber)
-			return mid;
-		
-        // If element is smaller than mid, then it can only be present in left subarray
-        if ((int)images_times_data[mid][0] > imageNumber)
-            return binarySearchImageTime(l, mid-1, imageNumber);
- 
-        // Else the element can only be present in right subarray
-        return binarySearchImageTime(mid+1, r, imageNumber);
-   }
- 
-   // We reach here when element is not present in array
-   printf("l:%d, r:%d, imageNumber:%d", l, r, imageNumber);
-   throw "Exception: binarySearchImageTime: unsuccessful search!";
-   return -1;
+	string csv_filename = folder + "timings.csv";
+	string json_filename = folder + "timings.json";
+	if (!timings.writeCSV(csv_filename) || !timings.writeJSON(json_filename))
+		cout << "could not write timing reports to " << folder << endl;
+	cout << "\nStage timings:" << endl;
+	timings.printSummary(cout);
+	logStream() << "\nStage timings:" << endl;
+	timings.printSummary(log_file);
 }
 
-// A recursive binary search function. It returns 
-// location of x in given array arr[l..r] is present, 
-// otherwise -1
-int Pose::binarySearchUsingTime(vector<double> seq, int l, int r, double time)
+void Pose::createMatcher()
 {
-	if (r >= l)
-	{
-        int mid = l + (r - l)/2;
- 
-        // If the element is present at the middle
-        if(mid > 0 && mid < seq.size()-1)
-        {
-			if (seq[mid-1] < time && seq[mid+1] > time)
-				return mid;
-		}
-		else if(mid == 0)
-		{
-			return 0;
-		}
-		else if(mid == seq.size()-1)
-		{
-			return seq.size()-1;
-		}
-		else
-		{
-			throw "Exception: binarySearchUsingTime: This should not be hit!";
-		}
-		
-        // If element is smaller than mid, then it can only be present in left subarray
-        if (seq[mid] > time)
-            return binarySearchUsingTime(seq, l, mid-1, time);
- 
-        // Else the element can only be present in right subarray
-        return binarySearchUsingTime(seq, mid+1, r, time);
-   }
- 
-   // We reach here when element is not present in array
-   throw "Exception: binarySearchUsingTime: unsuccessful search!";
-   return -1;
+#ifdef HAVE_OPENCV_CUDAFEATURES2D
+	if (matcher_backend.empty())
+		matcher_backend = "cuda";
+	if (matcher_backend == "cuda")
+		matcher = makePtr<CudaFeatureMatcher>();
+#else
+	if (matcher_backend.empty())
+		matcher_backend = "cpu";
+	if (matcher_backend == "cuda")
+		throw "Exception: OpenCV was built without cudafeatures2d, use --matcher cpu!";
+#endif
+	if (matcher_backend == "cpu")
+		matcher = makePtr<CpuHammingMatcher>(pool.get());
+	if (!matcher)
+		throw "Exception: unknown matcher backend!";
+	cout << "descriptor matcher " << matcher->name() << endl;
 }
 
 void Pose::readCalibFile()
@@ -471,6 +595,9 @@ void Pose::readCalibFile()
 	cout << "Q: " << Q << endl;
 	if(Q.empty())
 		throw "Exception: could not read Q matrix";
+	Mat Q64;
+	Q.convertTo(Q64, CV_64F);
+	reprojector = DisparityReprojector(Q64.ptr<double>(0));
 	fs.release();
 	cout << "read calib file." << endl;
 }
@@ -478,50 +605,38 @@ void Pose::readCalibFile()
 void Pose::readPoseFile()
 {
 	//pose_data
-	ifstream data_file;
-	data_file.open(dataFilesPrefix + pose_file);
-	data_file >> pose_data;
-	// Complain if something went wrong.
-	if (!data_file.eof())
-		throw "Exception: Could not open pose_data file!";
-	data_file.close();
-	
-	for (int i = 0; i < pose_data.size(); i++)
-		pose_times_seq.push_back(pose_data[i][2]);
+	if (!pose_store.load(dataFilesPrefix + pose_file, time_ind, tx_ind, ty_ind, tz_ind, qx_ind, qy_ind, qz_ind, qw_ind))
+		throw "Exception: Could not open pose_data file or it is not sorted by time!";
 	
 	//images_times_data
-	data_file.open(dataFilesPrefix + images_times_file);
-	data_file >> images_times_data;
-	// Complain if something went wrong.
-	if (!data_file.eof())
+	vector<int> image_time_columns = { 0, time_ind };
+	vector<vector<double> > image_time_data;
+	if (readCSVColumns(dataFilesPrefix + images_times_file, image_time_columns, image_time_data) < 0)
 		throw "Exception: Could not open images_times_data file!";
-	data_file.close();
-	
-	for (int i = 0; i < images_times_data.size(); i++)
-		images_times_seq.push_back(images_times_data[i][2]);
+	images_times_nums.swap(image_time_data[0]);
+	images_times_seq.swap(image_time_data[1]);
+	if (!is_sorted(images_times_nums.begin(), images_times_nums.end()))
+		throw "Exception: images_times_data file is not sorted by image number!";
 	
-	cout << "Your images_times file contains " << images_times_data.size() << " records.\n";
-	cout << "Your pose_data file contains " << pose_data.size() << " records.\n";
+	cout << "Your images_times file contains " << images_times_nums.size() << " records.\n";
+	cout << "Your pose_data file contains " << pose_store.size() << " records.\n";
 	//cout << "Your heading_data file contains " << heading_data.size() << " records.\n";
 }
 
 int Pose::data_index_finder(int image_number)
 {
-	//SEARCH PROCESS: get time NSECS from images_times_data and search for corresponding or nearby entry in pose_data and heading_data
-	int image_time_index = binarySearchImageTime(0, images_times_seq.size()-1, image_number);
+	//SEARCH PROCESS: get time NSECS from images_times_data and search for nearest entry in pose_store
+	int image_time_index = findImageTimeIndex(image_number);
 	//cout << fixed <<  "image_number: " << image_number << " image_time_index: " << image_time_index << " time: " << images_times_seq[image_time_index] << endl;
 	
-	int pose_index = binarySearchUsingTime(pose_times_seq, 0, pose_times_seq.size()-1, images_times_seq[image_time_index]);
+	int pose_index = pose_store.nearest(images_times_seq[image_time_index]);
 	//(pose_index == -1)? printf("pose_index is not found\n") : printf("pose_index: %d\n", pose_index);
-	
-	//cout << "pose: ";
-	//for (int i = 0; i < 9; i++)
-	//	cout << fixed << " " << pose_data[pose_index][i];
 	return pose_index;
 }
 
 void Pose::readImage(int i)
 {
+	ScopedStageTimer timer(timings, "decode_rgb", rawImageDataVec[i].img_num);
 	//rawImageDataVec[i].img_num = img_numbers[i];
 	rawImageDataVec[i].rgb_image = imread(imagePrefix + to_string(rawImageDataVec[i].img_num) + ".png");
 	
@@ -535,16 +650,9 @@ void Pose::readImage(int i)
 	cout << " i" << to_string(rawImageDataVec[i].img_num) << " " << std::flush;
 }
 
-void Pose::populateImages(int start_index, int end_index)
-{
-	for (int i = start_index; i <= end_index; i++)
-	{
-		readImage(i);
-	}
-}
-
 void Pose::readDisparityImage(int i)
 {
+	ScopedStageTimer timer(timings, "decode_disparity", rawImageDataVec[i].img_num);
 	Mat disp_img = imread(disparityPrefix + to_string(rawImageDataVec[i].img_num) + ".png",CV_LOAD_IMAGE_GRAYSCALE);
 	if(disp_img.empty())
 	{
@@ -565,31 +673,89 @@ void Pose::readDisparityImage(int i)
 		rawImageDataVec[i].disparity_image = disp_img;
 	//}
 	
-	//SEARCH PROCESS: get time NSECS from images_times_data and search for corresponding or nearby entry in pose_data and heading_data
-	int image_time_index = binarySearchImageTime(0, images_times_seq.size()-1, rawImageDataVec[i].img_num);
+	readImagePose(i);
+	cout << " d" << to_string(rawImageDataVec[i].img_num) << " " << std::flush;
+}
+
+//time and UAV pose of image i
+void Pose::readImagePose(int i)
+{
+	//SEARCH PROCESS: get time NSECS from images_times_data and search for nearest or bracketing entries in pose_store
+	int image_time_index = findImageTimeIndex(rawImageDataVec[i].img_num);
 	//cout << fixed <<  "image_number: " << image_number << " image_time_index: " << image_time_index << " time: " << images_times_seq[image_time_index] << endl;
-	int pose_index = binarySearchUsingTime(pose_times_seq, 0, pose_times_seq.size()-1, images_times_seq[image_time_index]);
-	
 	rawImageDataVec[i].time = images_times_seq[image_time_index];
 	
-	record_t pose = pose_data[pose_index];
-	rawImageDataVec[i].tx = pose[tx_ind];
-	rawImageDataVec[i].ty = pose[ty_ind];
-	rawImageDataVec[i].tz = pose[tz_ind];
-	rawImageDataVec[i].qx = pose[qx_ind];
-	rawImageDataVec[i].qy = pose[qy_ind];
-	rawImageDataVec[i].qz = pose[qz_ind];
-	rawImageDataVec[i].qw = pose[qw_ind];
-	
-	cout << " d" << to_string(rawImageDataVec[i].img_num) << " " << std::flush;
+	if (pose_store.size() == 0)
+		throw "Exception: pose_data file is empty!";
+	PoseSample pose = interpolate_pose ? pose_store.interpolate(rawImageDataVec[i].time) : pose_store.sample(pose_store.nearest(rawImageDataVec[i].time));
+	rawImageDataVec[i].tx = pose.tx;
+	rawImageDataVec[i].ty = pose.ty;
+	rawImageDataVec[i].tz = pose.tz;
+	rawImageDataVec[i].qx = pose.qx;
+	rawImageDataVec[i].qy = pose.qy;
+	rawImageDataVec[i].qz = pose.qz;
+	rawImageDataVec[i].qw = pose.qw;
+}
+
+//everything cached features depend on, so that a change of any of it does not reuse stale entries
+uint64_t Pose::featureCacheHash()
+{
+	Mat Q64;
+	Q.convertTo(Q64, CV_64F);
+	uint64_t h = FeatureCache::hashBytes(Q64.ptr<double>(0), 16 * sizeof(double));
+	int ints[] = { rows, cols, cols_start_aft_cutout, boundingBox, use_segment_labels ? 1 : 0, gate_decimation };
+	h = FeatureCache::hashBytes(ints, sizeof(ints), h);
+	h = FeatureCache::hashBytes(&minDisparity, sizeof(minDisparity), h);
+	h = FeatureCache::hashBytes(imagePrefix.data(), imagePrefix.size(), h);
+	h = FeatureCache::hashBytes(disparityPrefix.data(), disparityPrefix.size(), h);
+	if (use_segment_labels)
+	{
+		//keypoints3D come from the plane fitted disparity, which depends on the label images and its precision
+		int plane_ints[] = { plane_disparity_float ? 1 : 0 };
+		h = FeatureCache::hashBytes(plane_ints, sizeof(plane_ints), h);
+		h = FeatureCache::hashBytes(segmentlblPrefix.data(), segmentlblPrefix.size(), h);
+	}
+	return h;
 }
 
-void Pose::populateDisparityImages(int start_index, int end_index)
+//look up image i in the feature cache. Returns true if the cache knows the image fails the variance gate,
+//then it does not need to be decoded at all
+bool Pose::readCachedFeatures(int i)
 {
-	for (int i = start_index; i <= end_index; i++)
+	if (!feature_cache.enabled())
+		return false;
+	boost::shared_ptr<FeatureCacheEntry> entry(new FeatureCacheEntry());
 	{
-		readDisparityImage(i);
+		ScopedStageTimer timer(timings, "feature_cache_read", rawImageDataVec[i].img_num);
+		if (!feature_cache.load(rawImageDataVec[i].img_num, *entry))
+			return false;
 	}
+	rawImageDataVec[i].cached_features = entry;
+	rawImageDataVec[i].disp_img_var = entry->disp_img_var;
+	if (entry->has_features)
+		return false;
+	readImagePose(i);
+	return true;
+}
+
+//disparity variance gate input of image i, from the feature cache when possible, otherwise in one pass over the image.
+//images failing the gate are cached right away, as they never get to findFeatures
+double Pose::getDisparityVariance(int i)
+{
+	if (rawImageDataVec[i].disp_img_var >= 0)
+		return rawImageDataVec[i].disp_img_var;
+	{
+		ScopedStageTimer variance_timer(timings, "variance_check", rawImageDataVec[i].img_num);
+		DisparityStats stats = disparityStats(rawImageDataVec[i].disparity_image, cols_start_aft_cutout, cols - boundingBox, boundingBox, rows - boundingBox, minDisparity, gate_decimation);
+		rawImageDataVec[i].disp_img_var = stats.variance;
+	}
+	if (feature_cache.enabled() && rawImageDataVec[i].disp_img_var > 5)
+	{
+		FeatureCacheEntry entry;
+		entry.disp_img_var = rawImageDataVec[i].disp_img_var;
+		feature_cache.store(rawImageDataVec[i].img_num, entry);
+	}
+	return rawImageDataVec[i].disp_img_var;
 }
 
 void Pose::readSegmentLabelMap(int i)
@@ -605,18 +771,63 @@ void Pose::readSegmentLabelMap(int i)
 	cout << " s" << to_string(rawImageDataVec[i].img_num) << " " << std::flush;
 }
 
-void Pose::populateSegmentLabelMaps(int start_index, int end_index)
+//the disparity image is read and gated first, frames failing the variance gate never get their rgb image
+//and segment label map decoded
+void Pose::loadFrame(int i)
 {
-	for (int i = start_index; i <= end_index; i++)
+	if (readCachedFeatures(i))
+		return;
+	readDisparityImage(i);
+	if (rawImageDataVec[i].disparity_image.empty() || getDisparityVariance(i) > 5)
+		return;
+	readImage(i);
+	fitDisparityPlanes(i);
+}
+
+//producer side of streaming mode: keep up to prefetch_frames images queued for decoding ahead of current_idx
+void Pose::prefetchFrames(int current_idx)
+{
+	while (next_prefetch_idx < rawImageDataVec.size() && next_prefetch_idx < current_idx + prefetch_frames)
 	{
-		readSegmentLabelMap(i);
+		frame_loaded[next_prefetch_idx] = pool->submit(&Pose::loadFrame, this, next_prefetch_idx);
+		next_prefetch_idx++;
+	}
+}
+
+//consumer side of streaming mode: block until image i is decoded
+void Pose::waitForFrame(int i)
+{
+	prefetchFrames(i);
+	if (frame_loaded[i].valid())
+	{
+		pool->wait(frame_loaded[i]);
+		frame_loaded[i].get();
 	}
 }
 
-void Pose::populateDoubleDispImages(int start_index, int end_index)
+//drop decoded images of a frame. Pose and image number stay, they are needed for matching and logging
+void Pose::releaseRawImageData(int i)
+{
+	rawImageDataVec[i].rgb_image.release();
+	rawImageDataVec[i].disparity_image.release();
+	rawImageDataVec[i].segment_label.release();
+	rawImageDataVec[i].disparity_planes.reset();
+	rawImageDataVec[i].cached_features.reset();
+}
+
+//plane fitting needs both disparity and segment label map of the same image, so they are chained in one task
+void Pose::readDisparityAndPlaneFit(int i)
+{
+	readDisparityImage(i);
+	fitDisparityPlanes(i);
+}
+
+void Pose::fitDisparityPlanes(int i)
 {
-	for (int i = start_index; i <= end_index; i++)
+	if(use_segment_labels)
 	{
+		ScopedStageTimer timer(timings, "plane_fit", rawImageDataVec[i].img_num);
+		readSegmentLabelMap(i);
 		createPlaneFittedDisparityImages(i);
 	}
 }
@@ -624,7 +835,7 @@ void Pose::populateDoubleDispImages(int start_index, int end_index)
 void Pose::populateData()
 {
 	readCalibFile();
-	readPoseFile();
+	//pose file was read by parseCmdArgs already
 	//rawImageDataVec = vector<RawImageData>(img_numbers.size());
 	
 	//logging stuff
@@ -637,99 +848,31 @@ void Pose::populateData()
 	cols = test_load_img.cols;
 	cols_start_aft_cutout = (int)(cols/cutout_ratio);
 	
-	//4 cores, 2 threads per core, total 8 threads, 1 thread being used by main program, 7 addditional threads can be used here
-	const int divisions = 7;
-	const int imgs_per_division = ceil(1.0 * rawImageDataVec.size() / divisions);
-	int i = 0;
-	cout << "\nMulti-threading sequences:" << endl;
-	cout << "divisions " << divisions << " imgs_per_division " << imgs_per_division << endl;
-	cout << i+1 << " : " << i * imgs_per_division << " to " << min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1) << endl; i++;
-	cout << i+1 << " : " << i * imgs_per_division << " to " << min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1) << endl; i++;
-	cout << i+1 << " : " << i * imgs_per_division << " to " << min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1) << endl; i++;
-	cout << i+1 << " : " << i * imgs_per_division << " to " << min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1) << endl; i++;
-	cout << i+1 << " : " << i * imgs_per_division << " to " << min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1) << endl; i++;
-	cout << i+1 << " : " << i * imgs_per_division << " to " << min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1) << endl; i++;
-	cout << i+1 << " : " << i * imgs_per_division << " to " << min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1) << endl;
-	
-	cout << "\nReading images and disparity images using multithreading" << endl;
-	i = 0;
-	boost::thread img_thread1(&Pose::populateImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread img_thread2(&Pose::populateImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread img_thread3(&Pose::populateImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread img_thread4(&Pose::populateImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread img_thread5(&Pose::populateImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread img_thread6(&Pose::populateImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread img_thread7(&Pose::populateImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1));
-	
-	//cout << "\nReading disparity images using multithreading" << endl;
-	i = 0;
-	boost::thread disp_thread1(&Pose::populateDisparityImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread disp_thread2(&Pose::populateDisparityImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread disp_thread3(&Pose::populateDisparityImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread disp_thread4(&Pose::populateDisparityImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread disp_thread5(&Pose::populateDisparityImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread disp_thread6(&Pose::populateDisparityImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-	boost::thread disp_thread7(&Pose::populateDisparityImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1));
-	
-	if(use_segment_labels)
+	if (!feature_cache_dir.empty())
 	{
-		//segment_maps = vector<Mat>(rawImageDataVec.size());
-		//cout << "\nReading segment label map images using multithreading" << endl;
-		i = 0;
-		boost::thread segment_map_thread1(&Pose::populateSegmentLabelMaps, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread segment_map_thread2(&Pose::populateSegmentLabelMaps, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread segment_map_thread3(&Pose::populateSegmentLabelMaps, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread segment_map_thread4(&Pose::populateSegmentLabelMaps, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread segment_map_thread5(&Pose::populateSegmentLabelMaps, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread segment_map_thread6(&Pose::populateSegmentLabelMaps, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread segment_map_thread7(&Pose::populateSegmentLabelMaps, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1));
-		segment_map_thread1.join();
-		segment_map_thread2.join();
-		segment_map_thread3.join();
-		segment_map_thread4.join();
-		segment_map_thread5.join();
-		segment_map_thread6.join();
-		segment_map_thread7.join();
-	}
-	img_thread1.join();
-	img_thread2.join();
-	img_thread3.join();
-	img_thread4.join();
-	img_thread5.join();
-	img_thread6.join();
-	img_thread7.join();
-	disp_thread1.join();
-	disp_thread2.join();
-	disp_thread3.join();
-	disp_thread4.join();
-	disp_thread5.join();
-	disp_thread6.join();
-	disp_thread7.join();
+		feature_cache.open(feature_cache_dir, featureCacheHash());
+		cout << "feature cache " << feature_cache_dir << " key " << hex << featureCacheHash() << dec << endl;
+	}
 	
-	if(use_segment_labels)
+	if(stream_frames)
 	{
-		//double_disparity_images = vector<Mat>(rawImageDataVec.size());
-		cout << "\n\nPopulating Double Disp Images using multithreading" << endl;
-		i = 0;
-		boost::thread double_disp_thread1(&Pose::populateDoubleDispImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread double_disp_thread2(&Pose::populateDoubleDispImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread double_disp_thread3(&Pose::populateDoubleDispImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread double_disp_thread4(&Pose::populateDoubleDispImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread double_disp_thread5(&Pose::populateDoubleDispImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread double_disp_thread6(&Pose::populateDoubleDispImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1)); i++;
-		boost::thread double_disp_thread7(&Pose::populateDoubleDispImages, this, i * imgs_per_division, min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1));
-		double_disp_thread1.join();
-		double_disp_thread2.join();
-		double_disp_thread3.join();
-		double_disp_thread4.join();
-		double_disp_thread5.join();
-		double_disp_thread6.join();
-		double_disp_thread7.join();
-		cout << endl;
-		
-		//cout << "min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1) "  << min((i+1) * imgs_per_division - 1, (int)(rawImageDataVec.size()) - 1) << endl;
+		//frames are decoded on demand by prefetchFrames() while the main loop runs
+		cout << "\nStreaming images, prefetching " << prefetch_frames << " images ahead using " << pool->size() << " threads" << endl;
+		frame_loaded = vector<std::future<void> >(rawImageDataVec.size());
+		next_prefetch_idx = 0;
+		prefetchFrames(0);
+		return;
 	}
 	
+	//images are independent of each other, every image is a separate task on the shared pool.
+	//images failing the variance gate, or known by the feature cache to fail it, only get their disparity image decoded
+	cout << "\nReading images and disparity images using " << pool->size() << " threads" << endl;
+	vector<std::future<void> > load_tasks;
+	for (int i = 0; i < rawImageDataVec.size(); i++)
+		load_tasks.push_back(pool->submit(&Pose::loadFrame, this, i));
+	pool->wait(load_tasks);
+	cout << endl;
+	
 	//for (int i = 0; i < 2; i++)
 	//{
 	//	imshow( "full_images", full_images[i] );                   // Show our image inside it.
@@ -743,16 +886,42 @@ void Pose::populateData()
 	//}
 }
 
-ImageData Pose::findFeatures(int img_idx)
+//frame_finder lets parallel callers use their own finder, empty uses the shared one
+ImageData Pose::findFeatures(int img_idx, Ptr<FeaturesFinder> frame_finder)
 {
+	if (!frame_finder)
+		frame_finder = finder;
+	
 	ImageData currentImageDataObj;
 	//ImageData* currentImageDataObjPtr = &currentImageDataObj;
 	currentImageDataObj.raw_img_data_ptr = &(rawImageDataVec[img_idx]);
 	
+	//warm run: features and their 3D positions come from the feature cache
+	boost::shared_ptr<FeatureCacheEntry> cached = rawImageDataVec[img_idx].cached_features;
+	if (cached && cached->has_features)
+	{
+		currentImageDataObj.features.img_idx = img_idx;
+		currentImageDataObj.features.img_size = Size(cols, rows);
+		currentImageDataObj.features.keypoints = cached->keypoints;
+		cached->descriptors.copyTo(currentImageDataObj.features.descriptors);
+		matcher->prepare(cached->descriptors, currentImageDataObj.match_descriptors);
+		
+		boost::shared_ptr<KeypointStore> keypoints3D(new KeypointStore());
+		keypoints3D->reserve(cached->keypoints3D.size());
+		for (int i = 0; i < cached->keypoints3D.size(); i++)
+			keypoints3D->add(cached->keypoints3D[i].x, cached->keypoints3D[i].y, cached->keypoints3D[i].z, cached->in_roi[i]);
+		currentImageDataObj.keypoints3D = keypoints3D;
+		return currentImageDataObj;
+	}
+	
 	//Ptr<FeaturesFinder> finder = makePtr<OrbFeaturesFinder>();
 	ImageFeatures features;
 	Mat img = currentImageDataObj.raw_img_data_ptr->rgb_image;
-	(*finder)(img, features);
+	{
+		ScopedStageTimer timer(timings, "orb", currentImageDataObj.raw_img_data_ptr->img_num);
+		(*frame_finder)(img, features);
+	}
+	ScopedStageTimer timer(timings, "keypoint_lift", currentImageDataObj.raw_img_data_ptr->img_num);
 	//cout << "rawImageDataVec[img_idx].img_num " << rawImageDataVec[img_idx].img_num << endl;
 	//cout << "rawImageDataVec[img_idx].rgb_image.size() " << rawImageDataVec[img_idx].rgb_image.size() << endl;
 	//cout << "currentImageDataObjPtr->raw_img_data_ptr->img_num " << currentImageDataObjPtr->raw_img_data_ptr->img_num << endl;
@@ -771,25 +940,21 @@ ImageData Pose::findFeatures(int img_idx)
 	//cout << "currentImageDataObj.features.descriptors.size() " << currentImageDataObj.features.descriptors.size() << endl;
 	//cout << "currentImageDataObj.features.keypoints.size() " << currentImageDataObj.features.keypoints.size() << endl;
 	//cout << "blah blah A" << endl;
-	cuda::GpuMat descriptor(currentImageDataObj.features.descriptors);
+	matcher->prepare(currentImageDataObj.features.descriptors.getMat(ACCESS_READ), currentImageDataObj.match_descriptors);
 	//convert keypoints to 3d for easier estimation of rigid body transform later during pairwise matching
-	//cout << "descriptor.size() " << descriptor.size() << endl;
-	currentImageDataObj.gpu_descriptors = descriptor;
-	//cout << " gpu_descriptors " << currentImageDataObj.gpu_descriptors.size();
 	
 	vector<KeyPoint> keypoints = currentImageDataObj.features.keypoints;
 	
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr keypoints3dptcloud (new pcl::PointCloud<pcl::PointXYZRGB> ());
-	keypoints3dptcloud->is_dense = true;
-	currentImageDataObj.keypoints3D = keypoints3dptcloud;
-	vector<bool> pointsInROIVec;
+	boost::shared_ptr<KeypointStore> keypoints3D(new KeypointStore());
+	keypoints3D->reserve(keypoints.size());
+	currentImageDataObj.keypoints3D = keypoints3D;
 	
 	int good = 0, bad = 0;
 	for (int i = 0; i < keypoints.size(); i++)
 	{
 		double disp_value;
 		if(use_segment_labels)
-			disp_value = rawImageDataVec[img_idx].double_disparity_image.at<double>(keypoints[i].pt.y, keypoints[i].pt.x);
+			disp_value = rawImageDataVec[img_idx].disparity_planes->at(rawImageDataVec[img_idx].segment_label.at<uchar>(keypoints[i].pt.y, keypoints[i].pt.x), keypoints[i].pt.x, keypoints[i].pt.y);
 		else
 			disp_value = (double)rawImageDataVec[img_idx].disparity_image.at<char>(keypoints[i].pt.y, keypoints[i].pt.x);
 	
@@ -802,28 +967,30 @@ ImageData Pose::findFeatures(int img_idx)
 		vec_src = Q * vec_src;
 		vec_src /= vec_src(3);
 		
-		pcl::PointXYZRGB pt_3d_src;
-		
-		pt_3d_src.x = vec_src(0);
-		pt_3d_src.y = vec_src(1);
-		pt_3d_src.z = vec_src(2);
-
-		keypoints3dptcloud->points.push_back(pt_3d_src);
+		bool in_roi = disp_value > minDisparity && keypoints[i].pt.x >= cols_start_aft_cutout;
+		keypoints3D->add(vec_src(0), vec_src(1), vec_src(2), in_roi);
 		
-		if (disp_value > minDisparity && keypoints[i].pt.x >= cols_start_aft_cutout)
-		{
+		if (in_roi)
 			good++;
-			pointsInROIVec.push_back(true);
-		}
 		else
-		{
 			bad++;
-			pointsInROIVec.push_back(false);
-		}
 	}
 	//cout << " g" << good << "/b" << bad << flush;
-	log_file << " g" << good << "/b" << bad << flush;
-	currentImageDataObj.keypoints3D_ROI_Points = pointsInROIVec;
+	
+	if (feature_cache.enabled())
+	{
+		FeatureCacheEntry entry;
+		entry.disp_img_var = rawImageDataVec[img_idx].disp_img_var;
+		entry.has_features = true;
+		entry.keypoints = keypoints;
+		entry.descriptors = currentImageDataObj.features.descriptors.getMat(ACCESS_READ);
+		for (int i = 0; i < keypoints3D->size(); i++)
+		{
+			entry.keypoints3D.push_back(Point3f(keypoints3D->x[i], keypoints3D->y[i], keypoints3D->z[i]));
+			entry.in_roi.push_back(keypoints3D->inROI(i));
+		}
+		feature_cache.store(rawImageDataVec[img_idx].img_num, entry);
+	}
 	
 	return currentImageDataObj;
 }
@@ -897,82 +1064,17 @@ void Pose::orbcudaPairwiseMatching()
 	
 }
 
+//fit a plane to the disparities of every segment of the label map. Only the plane table is kept with the label map,
+//plane fitted disparities are evaluated where needed or materialized by getDisparityImage
 void Pose::createPlaneFittedDisparityImages(int i)
 {
-	//cout << "Image" << i << endl;
 	Mat segment_img = rawImageDataVec[i].segment_label;
 	Mat disp_img = rawImageDataVec[i].disparity_image;
-	Mat new_disp_img = Mat::zeros(disp_img.rows,disp_img.cols, CV_64F);
-	
-	for (int cluster = 1; cluster < 1024; cluster++)
-	{
-		//find pixels in this segment
-		vector<int> Xc, Yc;
-		for (int l = 0; l < segment_img.rows; l++)
-		{
-			for (int k = 0; k < segment_img.cols; k++)
-			{
-				if(segment_img.at<uchar>(l,k) == cluster)
-				{
-					Xc.push_back(k);
-					Yc.push_back(l);
-				}
-			}
-		}
-		//cout << "cluster" << cluster << " size:" << Xc.size();
-		if(Xc.size() == 0)		//all labels covered!
-			break;
-		
-		vector<double> Zp, Xp, Yp;
-		for (int p = 0; p < Xc.size(); p++)
-		{
-			if (Xc[p] > cols_start_aft_cutout && Xc[p] < segment_img.cols - boundingBox && Yc[p] > boundingBox && Yc[p] < segment_img.rows - boundingBox)
-			{
-				//cout << "disp_img.at<uchar>(Yc[p],Xc[p]): " << disp_img.at<uchar>(Yc[p],Xc[p]) << endl;
-				Zp.push_back((double)disp_img.at<uchar>(Yc[p],Xc[p]));
-				Xp.push_back((double)Xc[p]);
-				Yp.push_back((double)Yc[p]);
-			}
-		}
-		//cout << "read all cluster disparities..." << endl;
-		//cout << " Accepted points: " << Xp.size() << endl;
-		if(Xp.size() == 0)		//all labels covered!
-			continue;
-		
-		//define A matrix
-		Mat A = Mat::zeros(Xp.size(),3, CV_64F);
-		Mat b = Mat::zeros(Xp.size(),1, CV_64F);
-		for (int p = 0; p < Xp.size(); p++)
-		{
-			A.at<double>(p,0) = Xp[p];
-			A.at<double>(p,1) = Yp[p];
-			A.at<double>(p,2) = 1;
-			b.at<double>(p,0) = Zp[p];
-		}
-		//cout << "A.size() " << A.size() << endl;
-		
-		// Pseudo Inverse in Solution of Over-determined Linear System of Equations
-		// https://math.stackexchange.com/questions/99299/best-fitting-plane-given-a-set-of-points
-		
-		Mat At = A.t();
-		//cout << "At.size() " << At.size() << endl;
-		Mat AtA = At * A;
-		//cout << "AtA " << AtA << endl;
-		Mat AtAinv;
-		invert(AtA, AtAinv, DECOMP_SVD);
-		//cout << "AtAinv:\n" << AtAinv << endl;
-	
-		Mat x = AtAinv * At * b;
-		//cout << "x:\n" << x << endl;
-		
-		for (int p = 0; p < Xc.size(); p++)
-		{
-			new_disp_img.at<double>(Yc[p],Xc[p]) = 1.0 * x.at<double>(0,0) * Xc[p] + 1.0 * x.at<double>(0,1) * Yc[p] + 1.0 * x.at<double>(0,2);
-		}
-	}
-	rawImageDataVec[i].double_disparity_image = new_disp_img;
+	boost::shared_ptr<SegmentPlanes> planes(new SegmentPlanes());
+	planes->fit(segment_img, disp_img, cols_start_aft_cutout, segment_img.cols - boundingBox, boundingBox, segment_img.rows - boundingBox);
+	rawImageDataVec[i].disparity_planes = planes;
 	
-	double plane_fitted_disp_img_var = getVariance(new_disp_img, true);
+	double plane_fitted_disp_img_var = getPlaneFittedVariance(i);
 	//cout << rawImageDataVec[i].img_num << " plane_fitted_disp_img_var " << plane_fitted_disp_img_var << endl;
 	//log_file << rawImageDataVec[i].img_num << " plane_fitted_disp_img_var " << plane_fitted_disp_img_var << endl;
 	if (plane_fitted_disp_img_var > 3)
@@ -984,60 +1086,83 @@ void Pose::createPlaneFittedDisparityImages(int i)
 	cout << " dd" << rawImageDataVec[i].img_num << std::flush;
 }
 
-double Pose::getMean(Mat disp_img, bool planeFitted)
+//getVariance(disp_img, true) of the plane fitted disparity image of image i, evaluated from its planes
+double Pose::getPlaneFittedVariance(int i)
 {
+	const SegmentPlanes &planes = *rawImageDataVec[i].disparity_planes;
+	Mat segment_img = rawImageDataVec[i].segment_label;
 	double sum = 0.0;
 	for (int y = boundingBox; y < rows - boundingBox; ++y)
 	{
+		const uchar* lbl = segment_img.ptr<uchar>(y);
 		for (int x = cols_start_aft_cutout; x < cols - boundingBox; ++x)
 		{
-			double disp_val = 0;
-			if(planeFitted)
-				disp_val = disp_img.at<double>(y,x);
-			else
-				disp_val = (double)disp_img.at<uchar>(y,x);
-			
+			double disp_val = planes.at(lbl[x], x, y);
 			if (disp_val > minDisparity)
 				sum += disp_val;
 		}
 	}
-	return sum/((rows - 2 * boundingBox )*(cols - boundingBox - cols_start_aft_cutout));
-}
-
-double Pose::getVariance(Mat disp_img, bool planeFitted)
-{
-	double mean = getMean(disp_img, planeFitted);
-	double temp = 0;
+	double mean = sum/((rows - 2 * boundingBox )*(cols - boundingBox - cols_start_aft_cutout));
 	
+	double temp = 0;
 	for (int y = boundingBox; y < rows - boundingBox; ++y)
 	{
+		const uchar* lbl = segment_img.ptr<uchar>(y);
 		for (int x = cols_start_aft_cutout; x < cols - boundingBox; ++x)
 		{
-			double disp_val = 0;
-			if(planeFitted)
-				disp_val = disp_img.at<double>(y,x);
-			else
-				disp_val = (double)disp_img.at<uchar>(y,x);
-			
+			double disp_val = planes.at(lbl[x], x, y);
 			if (disp_val > minDisparity)
 				temp += (disp_val-mean)*(disp_val-mean);
 		}
 	}
-	double var = temp/((rows - 2 * boundingBox )*(cols - boundingBox - cols_start_aft_cutout) - 1);
-	return var;
+	return temp/((rows - 2 * boundingBox )*(cols - boundingBox - cols_start_aft_cutout) - 1);
+}
+
+//uchar disparity image, or with segment labels the plane fitted disparity image materialized as double or float
+Mat Pose::getDisparityImage(RawImageData* raw_img_data_ptr)
+{
+	if(!use_segment_labels)
+		return raw_img_data_ptr->disparity_image;
+	Mat dispImg;
+	raw_img_data_ptr->disparity_planes->render(raw_img_data_ptr->segment_label, dispImg, plane_disparity_float ? CV_32F : CV_64F);
+	return dispImg;
 }
 
 void Pose::createSingleImgPtCloud(int accepted_img_index, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb)
 {
+	ScopedStageTimer timer(timings, "reprojection", acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->img_num);
 	//cout << " Pt Cloud #" << accepted_img_index << flush;
 	cloudrgb->is_dense = true;
 	
-	Mat dispImg;
-	if(use_segment_labels)
-		dispImg = acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->double_disparity_image;
-	else
-		dispImg = acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->disparity_image;
-	if(blur_kernel > 1)
+	Mat dispImg = getBlurredDisparityImage(accepted_img_index);
+	Mat rgb_image = acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->rgb_image;
+	int img_num = acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->img_num;
+	
+	//when jump_pixels == 1, all keypoints will be already included later as we will take in all points
+	//with jump_pixels == 0, we only want to take in keypoints
+	if (jump_pixels != 1)
+	{
+		reprojectKeypoints(accepted_img_index, dispImg, rgb_image, cloudrgb);
+	}
+	if (jump_pixels > 0)
+	{
+		reprojectDisparityGrid(dispImg, rgb_image, cloudrgb);
+	}
+	cout << " " << img_num << std::flush;
+	//cout << " " << img_num << "/" << cloudrgb->points.size() << std::flush;
+	logStream() << " " << img_num << "/" << cloudrgb->points.size() << std::flush;
+}
+
+//disparity image used for point cloud creation, plane fitted if segment labels are used and blurred if asked
+Mat Pose::getBlurredDisparityImage(int accepted_img_index)
+{
+	Mat dispImg = getDisparityImage(acceptedImageDataVec[accepted_img_index].raw_img_data_ptr);
+	if(blur_kernel > 1 && disp_filter != "full")
+	{
+		//only the pixels reprojected afterwards are filtered
+		dispImg = filterDisparityImage(dispImg, &acceptedImageDataVec[accepted_img_index].features.keypoints);
+	}
+	else if(blur_kernel > 1)
 	{
 		//blur the disparity image to remove noise
 		Mat disp_img_blurred;
@@ -1045,92 +1170,271 @@ void Pose::createSingleImgPtCloud(int accepted_img_index, pcl::PointCloud<pcl::P
 		//medianBlur ( disp_img, disp_img_blurred, blur_kernel );
 		dispImg = disp_img_blurred;
 	}
+	return dispImg;
+}
+
+//copy of dispImg with the jump_pixels grid and the keypoints inside the bounding box filtered, rows in parallel.
+//other pixels keep their unfiltered values, the point cloud never reads them
+Mat Pose::filterDisparityImage(Mat &dispImg, const vector<KeyPoint> *keypoints)
+{
+	Mat disp_img_blurred = dispImg.clone();
+	const SparseDisparityFilter filter(dispImg, blur_kernel, blur_kernel*2, blur_kernel/2, 
+		disp_filter == "guided" ? SparseDisparityFilter::guided : SparseDisparityFilter::bilateral);
+	const int x_start = cols_start_aft_cutout, x_end = cols - boundingBox;
+	
+	if (jump_pixels > 0)
+	{
+		int sampled_rows = (rows - 2 * boundingBox + jump_pixels - 1) / jump_pixels;
+		int n_bands = min(max(pool->size(), 1), max(sampled_rows, 1));
+		vector<std::future<void> > band_tasks;
+		for (int b = 0; b < n_bands; b++)
+		{
+			int first = boundingBox + (sampled_rows * b / n_bands) * jump_pixels;
+			int last = boundingBox + (sampled_rows * (b + 1) / n_bands) * jump_pixels;
+			band_tasks.push_back(pool->submit([&filter, &disp_img_blurred, first, last, x_start, x_end, this]() {
+				for (int y = first; y < last && y < rows - boundingBox; y += jump_pixels)
+					filter.filterRow(disp_img_blurred, y, x_start, x_end, jump_pixels);
+			}));
+		}
+		pool->wait(band_tasks);
+	}
+	if (jump_pixels != 1 && keypoints != NULL)
+	{
+		for (int i = 0; i < keypoints->size(); i++)
+		{
+			int x = (*keypoints)[i].pt.x, y = (*keypoints)[i].pt.y;
+			if (x >= x_start && x < x_end && y >= boundingBox && y < rows - boundingBox)
+				filter.filterPixel(disp_img_blurred, x, y);
+		}
+	}
+	return disp_img_blurred;
+}
+
+//reproject the feature keypoints of an accepted image inside the bounding box into cloudrgb
+void Pose::reprojectKeypoints(int accepted_img_index, Mat &dispImg, Mat &rgb_image, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb)
+{
+	vector<KeyPoint> &keypoints = acceptedImageDataVec[accepted_img_index].features.keypoints;
+	for (int i = 0; i < keypoints.size(); i++)
+	{
+		int x = keypoints[i].pt.x, y = keypoints[i].pt.y;
+		if (x >= cols_start_aft_cutout && x < cols - boundingBox && y >= boundingBox && y < rows - boundingBox)
+		{
+			double disp_val = 0;
+			if(dispImg.depth() == CV_64F)
+				disp_val = dispImg.at<double>(y,x);
+			else if(dispImg.depth() == CV_32F)
+				disp_val = dispImg.at<float>(y,x);
+			else
+				disp_val = (double)dispImg.at<uchar>(y,x);
+			
+			float xyz[3];
+			if (disp_val > minDisparity && reprojector.reprojectPoint(x, y, disp_val, xyz))
+			{
+				//reference: https://stackoverflow.com/questions/22418846/reprojectimageto3d-in-opencv
+				pcl::PointXYZRGB pt_3drgb;
+				pt_3drgb.x = xyz[0];
+				pt_3drgb.y = xyz[1];
+				pt_3drgb.z = xyz[2];
+				Vec3b color = rgb_image.at<Vec3b>(Point(x, y));
+				
+				uint32_t rgb = ((uint32_t)color[2] << 16 | (uint32_t)color[1] << 8 | (uint32_t)color[0]);
+				pt_3drgb.rgb = *reinterpret_cast<float*>(&rgb);
+				
+				cloudrgb->points.push_back(pt_3drgb);
+			}
+		}
+	}
+}
+
+//reproject the jump_pixels grid of a disparity image row by row into cloudrgb
+//the cloud is grown once to the maximum possible size and shrunk to the valid points at the end
+void Pose::reprojectDisparityGrid(Mat &dispImg, Mat &rgb_image, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb)
+{
+	const int x_start = cols_start_aft_cutout, x_end = cols - boundingBox;
+	const int samples_per_row = (x_end - x_start + jump_pixels - 1) / jump_pixels;
+	const int sampled_rows = (rows - 2 * boundingBox + jump_pixels - 1) / jump_pixels;
+	if (samples_per_row <= 0 || sampled_rows <= 0)
+		return;
+	
+	size_t n_points = cloudrgb->points.size();
+	cloudrgb->points.resize(n_points + (size_t)samples_per_row * sampled_rows);
+	//like sor in downsamplePtCloud, grid outlier removal only applies to clouds that are downsampled
+	if (outlier_removal == "grid" && !dont_downsample)
+	{
+		OrganizedGrid grid;
+		reprojectOrganizedGrid(dispImg, grid);
+		for (int r = 0; r < grid.rows; r++)
+		{
+			const Vec3b* rgb_row = rgb_image.ptr<Vec3b>(boundingBox + r * jump_pixels);
+			for (int c = 0; c < grid.cols; c++)
+			{
+				if (!grid.isValid(r, c))
+					continue;
+				size_t i = (size_t)r * grid.cols + c;
+				pcl::PointXYZRGB &pt_3drgb = cloudrgb->points[n_points++];
+				pt_3drgb.x = grid.x[i];
+				pt_3drgb.y = grid.y[i];
+				pt_3drgb.z = grid.z[i];
+				Vec3b color = rgb_row[x_start + c * jump_pixels];
+				uint32_t rgb = ((uint32_t)color[2] << 16 | (uint32_t)color[1] << 8 | (uint32_t)color[0]);
+				pt_3drgb.rgb = *reinterpret_cast<float*>(&rgb);
+			}
+		}
+		cloudrgb->points.resize(n_points);
+		return;
+	}
+	
+	vector<float> xyz(3 * samples_per_row);
+	vector<int> px(samples_per_row);
+	
+	for (int y = boundingBox; y < rows - boundingBox; y += jump_pixels)
+	{
+		int n;
+		if(dispImg.depth() == CV_64F)
+			n = reprojector.reprojectRow(dispImg.ptr<double>(y), y, x_start, x_end, jump_pixels, minDisparity, &xyz[0], &px[0]);
+		else if(dispImg.depth() == CV_32F)
+			n = reprojector.reprojectRow(dispImg.ptr<float>(y), y, x_start, x_end, jump_pixels, minDisparity, &xyz[0], &px[0]);
+		else
+			n = reprojector.reprojectRow(dispImg.ptr<uchar>(y), y, x_start, x_end, jump_pixels, minDisparity, &xyz[0], &px[0]);
+		
+		const Vec3b* rgb_row = rgb_image.ptr<Vec3b>(y);
+		for (int k = 0; k < n; k++)
+		{
+			pcl::PointXYZRGB &pt_3drgb = cloudrgb->points[n_points++];
+			pt_3drgb.x = xyz[3*k];
+			pt_3drgb.y = xyz[3*k+1];
+			pt_3drgb.z = xyz[3*k+2];
+			Vec3b color = rgb_row[px[k]];
+			uint32_t rgb = ((uint32_t)color[2] << 16 | (uint32_t)color[1] << 8 | (uint32_t)color[0]);
+			pt_3drgb.rgb = *reinterpret_cast<float*>(&rgb);
+		}
+	}
+	cloudrgb->points.resize(n_points);
+}
+
+//reproject the jump_pixels grid of a disparity image into an organized grid, cell (r, c) is the pixel
+//(cols_start_aft_cutout + c * jump_pixels, boundingBox + r * jump_pixels). outliers are removed if outlier_removal is grid,
+//except with dont_downsample where the single image clouds are kept unfiltered
+void Pose::reprojectOrganizedGrid(Mat &dispImg, OrganizedGrid &grid)
+{
+	const int x_start = cols_start_aft_cutout, x_end = cols - boundingBox;
+	const int samples_per_row = max((x_end - x_start + jump_pixels - 1) / jump_pixels, 0);
+	const int sampled_rows = max((rows - 2 * boundingBox + jump_pixels - 1) / jump_pixels, 0);
+	grid.resize(sampled_rows, samples_per_row);
+	if (samples_per_row == 0 || sampled_rows == 0)
+		return;
 	
-	vector<KeyPoint> keypoints = acceptedImageDataVec[accepted_img_index].features.keypoints;
+	vector<float> xyz(3 * samples_per_row);
+	vector<int> px(samples_per_row);
+	for (int r = 0; r < sampled_rows; r++)
+	{
+		int y = boundingBox + r * jump_pixels;
+		int n;
+		if(dispImg.depth() == CV_64F)
+			n = reprojector.reprojectRow(dispImg.ptr<double>(y), y, x_start, x_end, jump_pixels, minDisparity, &xyz[0], &px[0]);
+		else if(dispImg.depth() == CV_32F)
+			n = reprojector.reprojectRow(dispImg.ptr<float>(y), y, x_start, x_end, jump_pixels, minDisparity, &xyz[0], &px[0]);
+		else
+			n = reprojector.reprojectRow(dispImg.ptr<uchar>(y), y, x_start, x_end, jump_pixels, minDisparity, &xyz[0], &px[0]);
+		for (int k = 0; k < n; k++)
+			grid.set(r, (px[k] - x_start) / jump_pixels, xyz[3*k], xyz[3*k+1], xyz[3*k+2]);
+	}
+	if (outlier_removal == "grid" && !dont_downsample)
+		removeGridOutliers(grid, outlier_window, 1.0);
+}
+
+//single pass replacement of createSingleImgPtCloud -> transformPtCloud -> downsamplePtCloud for one accepted image
+//every reprojected point is transformed with t_mat and accumulated straight into a voxel hash
+//with the voxel_size/5 leaf of single image clouds, so only the voxelized cloud is ever materialized.
+//outliers of the pixel grid are removed with removeGridOutliers unless --outlier_removal is not grid,
+//use --legacy_pt_cloud for the old path with StatisticalOutlierRemoval.
+void Pose::createFusedVoxelizedPtCloud(int accepted_img_index, const pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 &t_mat, 
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb_return)
+{
+	ScopedStageTimer timer(timings, "reproject_voxelize", acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->img_num);
+	Mat dispImg = getBlurredDisparityImage(accepted_img_index);
 	Mat rgb_image = acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->rgb_image;
 	int img_num = acceptedImageDataVec[accepted_img_index].raw_img_data_ptr->img_num;
 	
-	cv::Mat_<double> vec_tmp(4,1);
+	double T[12];
+	for (int i = 0; i < 3; i++)
+		for (int j = 0; j < 4; j++)
+			T[4*i+j] = t_mat(i,j);
 	
-	//when jump_pixels == 1, all keypoints will be already included later as we will take in all points
-	//with jump_pixels == 0, we only want to take in keypoints
+	VoxelHashGrid grid(voxel_size/5, voxel_size/5, voxel_size/5);
+	
+	//keypoints are few, reproject them with the regular path
 	if (jump_pixels != 1)
 	{
-		for (int i = 0; i < keypoints.size(); i++)
+		pcl::PointCloud<pcl::PointXYZRGB>::Ptr keypoints_cloud (new pcl::PointCloud<pcl::PointXYZRGB> ());
+		reprojectKeypoints(accepted_img_index, dispImg, rgb_image, keypoints_cloud);
+		for (int i = 0; i < keypoints_cloud->size(); i++)
+		{
+			const pcl::PointXYZRGB &pt = keypoints_cloud->points[i];
+			grid.add(T[0]*pt.x + T[1]*pt.y + T[2]*pt.z + T[3],
+					T[4]*pt.x + T[5]*pt.y + T[6]*pt.z + T[7],
+					T[8]*pt.x + T[9]*pt.y + T[10]*pt.z + T[11],
+					pt.r, pt.g, pt.b);
+		}
+	}
+	
+	if (jump_pixels > 0 && outlier_removal == "grid")
+	{
+		OrganizedGrid pixel_grid;
+		reprojectOrganizedGrid(dispImg, pixel_grid);
+		for (int r = 0; r < pixel_grid.rows; r++)
 		{
-			int x = keypoints[i].pt.x, y = keypoints[i].pt.y;
-			if (x >= cols_start_aft_cutout && x < cols - boundingBox && y >= boundingBox && y < rows - boundingBox)
+			const Vec3b* rgb_row = rgb_image.ptr<Vec3b>(boundingBox + r * jump_pixels);
+			for (int c = 0; c < pixel_grid.cols; c++)
 			{
-				double disp_val = 0;
-				if(use_segment_labels)
-					disp_val = dispImg.at<double>(y,x);
-				else
-					disp_val = (double)dispImg.at<uchar>(y,x);
-				
-				if (disp_val > minDisparity)
-				{
-					//reference: https://stackoverflow.com/questions/22418846/reprojectimageto3d-in-opencv
-					vec_tmp(0)=x; vec_tmp(1)=y; vec_tmp(2)=disp_val; vec_tmp(3)=1;
-					vec_tmp = Q*vec_tmp;
-					vec_tmp /= vec_tmp(3);
-					
-					pcl::PointXYZRGB pt_3drgb;
-					pt_3drgb.x = (float)vec_tmp(0);
-					pt_3drgb.y = (float)vec_tmp(1);
-					pt_3drgb.z = (float)vec_tmp(2);
-					Vec3b color = rgb_image.at<Vec3b>(Point(x, y));
-					
-					uint32_t rgb = ((uint32_t)color[2] << 16 | (uint32_t)color[1] << 8 | (uint32_t)color[0]);
-					pt_3drgb.rgb = *reinterpret_cast<float*>(&rgb);
-					
-					cloudrgb->points.push_back(pt_3drgb);
-					//cout << pt_3d << endl;
-				}
+				if (!pixel_grid.isValid(r, c))
+					continue;
+				size_t i = (size_t)r * pixel_grid.cols + c;
+				const double x0 = pixel_grid.x[i], y0 = pixel_grid.y[i], z0 = pixel_grid.z[i];
+				Vec3b color = rgb_row[cols_start_aft_cutout + c * jump_pixels];
+				grid.add(T[0]*x0 + T[1]*y0 + T[2]*z0 + T[3],
+						T[4]*x0 + T[5]*y0 + T[6]*z0 + T[7],
+						T[8]*x0 + T[9]*y0 + T[10]*z0 + T[11],
+						color[2], color[1], color[0]);
 			}
 		}
 	}
-	if (jump_pixels > 0)
+	else if (jump_pixels > 0)
 	{
-		for (int y = boundingBox; y < rows - boundingBox;)
+		const int x_start = cols_start_aft_cutout, x_end = cols - boundingBox;
+		const int samples_per_row = (x_end - x_start + jump_pixels - 1) / jump_pixels;
+		if (samples_per_row > 0)
 		{
-			for (int x = cols_start_aft_cutout; x < cols - boundingBox;)
+			vector<float> xyz(3 * samples_per_row);
+			vector<int> px(samples_per_row);
+			for (int y = boundingBox; y < rows - boundingBox; y += jump_pixels)
 			{
-				double disp_val = 0;
-				//cout << "y " << y << " x " << x << " disp_img.at<uint16_t>(y,x) " << disp_img.at<uint16_t>(y,x) << endl;
-				//cout << " disp_img.at<double>(y,x) " << disp_img.at<double>(y,x) << endl;
-				if(use_segment_labels)
-					disp_val = dispImg.at<double>(y,x);		//disp_val = (double)disp_img.at<uint16_t>(y,x) / 200.0;
+				int n;
+				if(dispImg.depth() == CV_64F)
+					n = reprojector.reprojectRow(dispImg.ptr<double>(y), y, x_start, x_end, jump_pixels, minDisparity, &xyz[0], &px[0]);
+				else if(dispImg.depth() == CV_32F)
+					n = reprojector.reprojectRow(dispImg.ptr<float>(y), y, x_start, x_end, jump_pixels, minDisparity, &xyz[0], &px[0]);
 				else
-					disp_val = (double)dispImg.at<uchar>(y,x);
-				//cout << "disp_val " << disp_val << endl;
+					n = reprojector.reprojectRow(dispImg.ptr<uchar>(y), y, x_start, x_end, jump_pixels, minDisparity, &xyz[0], &px[0]);
 				
-				if (disp_val > minDisparity)
+				const Vec3b* rgb_row = rgb_image.ptr<Vec3b>(y);
+				for (int k = 0; k < n; k++)
 				{
-					//reference: https://stackoverflow.com/questions/22418846/reprojectimageto3d-in-opencv
-					vec_tmp(0)=x; vec_tmp(1)=y; vec_tmp(2)=disp_val; vec_tmp(3)=1;
-					vec_tmp = Q*vec_tmp;
-					vec_tmp /= vec_tmp(3);
-					
-					pcl::PointXYZRGB pt_3drgb;
-					pt_3drgb.x = (float)vec_tmp(0);
-					pt_3drgb.y = (float)vec_tmp(1);
-					pt_3drgb.z = (float)vec_tmp(2);
-					Vec3b color = rgb_image.at<Vec3b>(Point(x, y));
-					
-					uint32_t rgb = ((uint32_t)color[2] << 16 | (uint32_t)color[1] << 8 | (uint32_t)color[0]);
-					pt_3drgb.rgb = *reinterpret_cast<float*>(&rgb);
-					
-					cloudrgb->points.push_back(pt_3drgb);
-					//cout << pt_3d << endl;
+					const double x0 = xyz[3*k], y0 = xyz[3*k+1], z0 = xyz[3*k+2];
+					Vec3b color = rgb_row[px[k]];
+					grid.add(T[0]*x0 + T[1]*y0 + T[2]*z0 + T[3],
+							T[4]*x0 + T[5]*y0 + T[6]*z0 + T[7],
+							T[8]*x0 + T[9]*y0 + T[10]*z0 + T[11],
+							color[2], color[1], color[0]);
 				}
-				x += jump_pixels;
 			}
-			y += jump_pixels;
 		}
 	}
+	
+	grid.exportTo(*cloudrgb_return);
+	cloudrgb_return->is_dense = true;
 	cout << " " << img_num << std::flush;
-	//cout << " " << img_num << "/" << cloudrgb->points.size() << std::flush;
-	log_file << " " << img_num << "/" << cloudrgb->points.size() << std::flush;
+	logStream() << " " << img_num << "/" << cloudrgb_return->points.size() << std::flush;
 }
 
 //kernel to create point cloud
@@ -1627,6 +1931,7 @@ pcl::PointCloud<pcl::PointXYZRGB>::Ptr Pose::read_PLY_File(string point_cloud_fi
 
 void Pose::save_pt_cloud_to_PLY_File(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb, string &writePath)
 {
+	ScopedStageTimer timer(timings, "ply_write");
 	pcl::io::savePLYFileBinary(writePath, *cloudrgb);
 	std::cerr << "Saved Point Cloud with " << cloudrgb->points.size () << " data points to " << writePath << endl;
 }
@@ -1651,26 +1956,103 @@ pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>:
 	return tf_icp_main;
 }
 
-pcl::PointCloud<pcl::PointXYZRGB>::Ptr Pose::downsamplePtCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb, bool combinedPtCloud)
+//fit the feature matched UAV positions to the MAVLink ones in closed form, then make the first positions coincide and
+//remove the mean height difference. Position i of both clouds is the same image, so no correspondences are searched.
+//Only positions accepted since the last call are read, cloud_hexPos_FM is transformed in place once with the result
+pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 Pose::correctTrajectory(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_FM, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_MAVLink)
 {
-	//cout << "PointCloud before filtering: " << cloudrgb->size() << endl;
+	trajectory_aligner.decay();
+	for (int i = trajectory_aligner.size(); i < cloud_hexPos_FM->points.size(); i++)
+		trajectory_aligner.add(Eigen::Vector3d(cloud_hexPos_FM->points[i].x, cloud_hexPos_FM->points[i].y, cloud_hexPos_FM->points[i].z), 
+			Eigen::Vector3d(cloud_hexPos_MAVLink->points[i].x, cloud_hexPos_MAVLink->points[i].y, cloud_hexPos_MAVLink->points[i].z));
+	
+	Eigen::Matrix4d tf = trajectory_aligner.estimate();
+	trajectory_aligner.transformSource(tf);
+	cout << "trajectory alignment of " << trajectory_aligner.size() << " positions:\n" << tf << endl;
+	
+	//correct translation, first positions coincide
+	Eigen::Matrix4d t_translation_bw_clouds = Eigen::Matrix4d::Identity();
+	t_translation_bw_clouds.block<3,1>(0,3) = trajectory_aligner.firstTarget() - trajectory_aligner.firstSource();
+	trajectory_aligner.transformSource(t_translation_bw_clouds);
+	tf = t_translation_bw_clouds * tf;
+	
+	//correct z height by averaging out the error in z
+	double z_diff = trajectory_aligner.targetMean()(2) - trajectory_aligner.sourceMean()(2);
+	cout << "z Height diff b/w cloud_hexPos_MAVLink and cloud_hexPos_FM: " << z_diff << endl;
+	t_translation_bw_clouds = Eigen::Matrix4d::Identity();
+	t_translation_bw_clouds(2,3) = z_diff;
+	trajectory_aligner.transformSource(t_translation_bw_clouds);
+	tf = t_translation_bw_clouds * tf;
+	
+	pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 tf_icp = tf.cast<float>();
+	transformPtCloud(cloud_hexPos_FM, cloud_hexPos_FM, tf_icp);
+	return tf_icp;
+}
+
+//original trajectory correction: ICP over all UAV positions, followed by the same translation and height fix-ups
+pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 Pose::correctTrajectoryICP(pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_FM, pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_hexPos_MAVLink)
+{
+	//transforming the camera positions using ICP
+	pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 tf_icp = runICPalignment(cloud_hexPos_FM, cloud_hexPos_MAVLink);
+	//pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 tf_icp = runICPalignment(row12_FM_UAV_pos, row12_MAV_UAV_pos);
 	
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb_outlier_removed (new pcl::PointCloud<pcl::PointXYZRGB> ());
-	int j = 0;
-	for (int i = 0; i < cloudrgb->size(); i++)
+	////correcting old tf_mats
+	//for (int i = 0; i < acceptedImageDataVec.size(); i++)
+	//	acceptedImageDataVec[i].t_mat_FeatureMatched = tf_icp * acceptedImageDataVec[i].t_mat_FeatureMatched;
+	
+	//fit FM camera positions to MAVLink camera positions using ICP and use the tf to correct point cloud
+	transformPtCloud(cloud_hexPos_FM, cloud_hexPos_FM, tf_icp);
+	
+	//new code to correct translation
+	pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 t_translation_bw_clouds;
+	for (int i = 0; i <= 3; i++)
 	{
-		//if(cloudrgb->points[i].z > -max_depth && cloudrgb->points[i].z < max_height)
+		for (int j = 0; j < 3; j++)
 		{
-			cloudrgb_outlier_removed->points.push_back(cloudrgb->points[i]);
-			if(combinedPtCloud)
-				cloudrgb_outlier_removed->points[j].z += 500;	//increasing height to place all points at center of voxel of size 1000 m
-			j++;
+			if (i == j)
+				t_translation_bw_clouds(i,j) = 1;
+			else
+				t_translation_bw_clouds(i,j) = 0;
 		}
 	}
+	t_translation_bw_clouds(0,3) = cloud_hexPos_MAVLink->points[0].x - cloud_hexPos_FM->points[0].x;
+	t_translation_bw_clouds(1,3) = cloud_hexPos_MAVLink->points[0].y - cloud_hexPos_FM->points[0].y;
+	t_translation_bw_clouds(2,3) = cloud_hexPos_MAVLink->points[0].z - cloud_hexPos_FM->points[0].z;
+	cout << "t_translation_bw_clouds:\n" << t_translation_bw_clouds << endl;
+	transformPtCloud(cloud_hexPos_FM, cloud_hexPos_FM, t_translation_bw_clouds);
+	tf_icp = t_translation_bw_clouds * tf_icp;
+	
+	//correct z height by averaging out the error in z
+	double avg_z_FM = 0, avg_z_MAVLink = 0;
+	for (int i = 0; i < cloud_hexPos_MAVLink->points.size(); i++)
+	{
+		avg_z_FM += cloud_hexPos_FM->points[i].z;
+		avg_z_MAVLink += cloud_hexPos_MAVLink->points[i].z;
+	}
+	avg_z_FM /= cloud_hexPos_MAVLink->points.size();
+	avg_z_MAVLink /= cloud_hexPos_MAVLink->points.size();
+	cout << "z Height diff b/w cloud_hexPos_MAVLink and cloud_hexPos_FM: " << avg_z_MAVLink - avg_z_FM << endl;
+	t_translation_bw_clouds(0,3) = 0;
+	t_translation_bw_clouds(1,3) = 0;
+	t_translation_bw_clouds(2,3) = avg_z_MAVLink - avg_z_FM;
+	cout << "t_translation_bw_clouds:\n" << t_translation_bw_clouds << endl;
+	transformPtCloud(cloud_hexPos_FM, cloud_hexPos_FM, t_translation_bw_clouds);
+	tf_icp = t_translation_bw_clouds * tf_icp;
+	
+	
+	return tf_icp;
+}
+
+//voxel grid downsampling with VoxelDownsampler on the pool. the combined point cloud gets voxel_size 2.5D columns
+//(cubes with voxel_3d) and min_points_per_voxel, single image point clouds voxel_size/5 cubes
+pcl::PointCloud<pcl::PointXYZRGB>::Ptr Pose::downsamplePtCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb, bool combinedPtCloud)
+{
+	//cout << "PointCloud before filtering: " << cloudrgb->size() << endl;
 	
+	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb_outlier_removed = cloudrgb;
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb_filtered (new pcl::PointCloud<pcl::PointXYZRGB> ());
 	
-	if (!combinedPtCloud && jump_pixels > 0)
+	if (!combinedPtCloud && jump_pixels > 0 && outlier_removal == "sor")
 	{
 		//cout << " before:" << cloudrgb_outlier_removed->size();
 		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgb_filtered_stat (new pcl::PointCloud<pcl::PointXYZRGB> ());
@@ -1685,23 +2067,16 @@ pcl::PointCloud<pcl::PointXYZRGB>::Ptr Pose::downsamplePtCloud(pcl::PointCloud<p
 		//cout << " after:" << cloudrgb_outlier_removed->size() << " ";
 	}
 	
-	// Create the filtering object
-	pcl::VoxelGrid<pcl::PointXYZRGB> sor;
-	sor.setInputCloud (cloudrgb_outlier_removed);
 	if (combinedPtCloud)
 	{
-		sor.setMinimumPointsNumberPerVoxel(min_points_per_voxel);
-		sor.setLeafSize (voxel_size,voxel_size,1000);
+		VoxelDownsampler downsampler(voxel_size, voxel_size, voxel_3d ? voxel_size : 0, pool.get());
+		downsampler.filter(*cloudrgb_outlier_removed, *cloudrgb_filtered, min_points_per_voxel);
 	}
 	else
 	{	//single image point cloud -> go for higher resolution to better create combinedPtCloud later
-		sor.setLeafSize (voxel_size/5,voxel_size/5,voxel_size/5);
+		VoxelDownsampler downsampler(voxel_size/5, voxel_size/5, voxel_size/5, pool.get());
+		downsampler.filter(*cloudrgb_outlier_removed, *cloudrgb_filtered);
 	}
-	sor.filter (*cloudrgb_filtered);
-	
-	if(combinedPtCloud)
-		for (int i = 0; i < cloudrgb_filtered->size(); i++)
-			cloudrgb_filtered->points[i].z -= 500;	//changing back height to original place
 	
 	//cout << "\nPointCloud after filtering: " << cloudrgb_filtered->size() << endl;
 	//cout << " d" << std::flush;
@@ -1837,7 +2212,7 @@ pcl::PointXYZRGB Pose::transformPoint(pcl::PointXYZRGB hexPosMAVLink, pcl::regis
 }
 
 pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 Pose::generate_tf_of_Matched_Keypoints
-(ImageData &currentImageDataObj, bool &acceptDecision)
+(ImageData &currentImageDataObj, bool &acceptDecision, const SpeculativeFrame *speculative)
 {
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr current_img_matched_keypoints (new pcl::PointCloud<pcl::PointXYZRGB> ());
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr fitted_cloud_matched_keypoints (new pcl::PointCloud<pcl::PointXYZRGB> ());
@@ -1845,17 +2220,17 @@ pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>:
 	fitted_cloud_matched_keypoints->is_dense = true;
 	
 	//find matches and create matched point clouds
-	int good_matches_count = generate_Matched_Keypoints_Point_Cloud(currentImageDataObj, current_img_matched_keypoints, fitted_cloud_matched_keypoints);
+	int good_matches_count = generate_Matched_Keypoints_Point_Cloud(currentImageDataObj, current_img_matched_keypoints, fitted_cloud_matched_keypoints, speculative);
 	if (good_matches_count < 5 * featureMatchingThreshold)
 	{
 		dist_nearby *= 2;
 		cout << "  retrying in larger radius.." << endl;
 		cout << currentImageDataObj.raw_img_data_ptr->img_num;
-		log_file << "  retrying in larger radius.." << endl;
-		log_file << currentImageDataObj.raw_img_data_ptr->img_num;
+		logStream() << "  retrying in larger radius.." << endl;
+		logStream() << currentImageDataObj.raw_img_data_ptr->img_num;
 		current_img_matched_keypoints->clear();
 		fitted_cloud_matched_keypoints->clear();
-		good_matches_count = generate_Matched_Keypoints_Point_Cloud(currentImageDataObj, current_img_matched_keypoints, fitted_cloud_matched_keypoints);
+		good_matches_count = generate_Matched_Keypoints_Point_Cloud(currentImageDataObj, current_img_matched_keypoints, fitted_cloud_matched_keypoints, speculative);
 		dist_nearby /= 2;
 	}
 	
@@ -1868,7 +2243,10 @@ pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>:
 	pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 T_SVD_matched_pts;
 	
 	//cout << " current_img_matched_keypoints->size():" << current_img_matched_keypoints->size() << " fitted_cloud_matched_keypoints->size():" << fitted_cloud_matched_keypoints->size() << endl;
-	te2.estimateRigidTransformation(*current_img_matched_keypoints, *fitted_cloud_matched_keypoints, T_SVD_matched_pts);
+	{
+		ScopedStageTimer timer(timings, "svd", currentImageDataObj.raw_img_data_ptr->img_num);
+		te2.estimateRigidTransformation(*current_img_matched_keypoints, *fitted_cloud_matched_keypoints, T_SVD_matched_pts);
+	}
 	//cout << "computed transformation between MATCHED KEYPOINTS T_SVD2 is\n" << T_SVD_matched_pts << endl;
 	//log_file << "computed transformation between MATCHED KEYPOINTS T_SVD2 is\n" << T_SVD_matched_pts << endl;
 	
@@ -1983,52 +2361,75 @@ pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>:
 int Pose::generate_Matched_Keypoints_Point_Cloud
 (ImageData &currentImageDataObj, 
 pcl::PointCloud<pcl::PointXYZRGB>::Ptr &current_img_matched_keypoints, 
-pcl::PointCloud<pcl::PointXYZRGB>::Ptr &fitted_cloud_matched_keypoints)
+pcl::PointCloud<pcl::PointXYZRGB>::Ptr &fitted_cloud_matched_keypoints,
+const SpeculativeFrame *speculative)
 {
 	cout << " matched with_imgs/matches";
-	log_file << " matched with_imgs/matches";
+	logStream() << " matched with_imgs/matches";
 	
 	int good_matched_imgs_this_src = 0;
 	int good_matches_count = 0;
 	
-	pcl::PointCloud<pcl::PointXYZRGB>::Ptr keypoints3D_src = currentImageDataObj.keypoints3D;
-	vector<bool> pointsInROIVec_src = currentImageDataObj.keypoints3D_ROI_Points;
-	//cout << "\nkeypoints3D_src->points.size() " << keypoints3D_src->points.size() << " pointsInROIVec_src.size() " << pointsInROIVec_src.size() << endl;
+	const KeypointStore &keypoints3D_src = *currentImageDataObj.keypoints3D;
 	
-	//for (int dst_index = current_img_index-1; dst_index >= max(current_img_index - range_width,0); dst_index--)
-	for (int dst_index = acceptedImageDataVec.size() - 1; dst_index >= max((int)acceptedImageDataVec.size() - range_width, 0); dst_index--)
+	//nearby images, from any time of the flight
+	vector<int> dst_indices;
+	findNearbyImages(currentImageDataObj.raw_img_data_ptr, dst_indices);
+	
+	//matches found ahead of time go to the match cache. Only pairs not in the cache are matched now: images accepted
+	//since the speculative job, or outside the radius used by it or by the first try of this image
+	int src_idx = currentImageDataObj.features.img_idx;
+	if (speculative != NULL)
 	{
-		//cout << "dst_img_num " << acceptedImageDataVec[dst_index].raw_img_data_ptr->img_num << flush;
-		//check for only with nearby images
-		double dist = distanceCalculator(currentImageDataObj.raw_img_data_ptr, acceptedImageDataVec[dst_index].raw_img_data_ptr);
-		if(dist > dist_nearby)
-			continue;
-		
-		//reference https://stackoverflow.com/questions/44988087/opencv-feature-matching-match-descriptors-to-knn-filtered-keypoints
-		//reference https://github.com/opencv/opencv/issues/6130
-		//reference http://study.marearts.com/2014/07/opencv-study-orb-gpu-feature-extraction.html
-		//reference https://docs.opencv.org/3.1.0/d6/d1d/group__cudafeatures2d.html
-		
-		//cout << "\nimg_num " << currentImageDataObj.raw_img_data_ptr->img_num << " to " << acceptedImageDataVec[dst_index].raw_img_data_ptr->img_num << flush;
-		
-		vector<vector<DMatch>> matches;
-		//matcher->knnMatch(descriptorsVec[current_img_index], descriptorsVec[dst_index], matches, 2);
-		//cout << "\ncurrentImageDataObj.gpu_descriptors.size() " << currentImageDataObj.gpu_descriptors.size() << " acceptedImageDataVec[dst_index].gpu_descriptors.size() " << acceptedImageDataVec[dst_index].gpu_descriptors.size() << " dst_index " << dst_index << endl;
-		matcher->knnMatch(currentImageDataObj.gpu_descriptors, acceptedImageDataVec[dst_index].gpu_descriptors, matches, 2);
-		//cout << " matches.size() " << matches.size() << flush;
-		
-		vector<DMatch> good_matches;
-		for(int k = 0; k < matches.size(); k++)
+		for (int c = 0; c < speculative->dst_indices.size(); c++)
 		{
-			if(matches[k][0].distance < 0.5 * matches[k][1].distance && matches[k][0].distance < 40)
-			{
-				//cout << matches[k][0].distance << "/" << matches[k][1].distance << " " << 
-				//	matches[k][0].imgIdx << "/" << matches[k][1].imgIdx << " " << 
-				//	matches[k][0].queryIdx << "/" << matches[k][1].queryIdx << " " << 
-				//	matches[k][0].trainIdx << "/" << matches[k][1].trainIdx << endl;
-				good_matches.push_back(matches[k][0]);
-			}
+			vector<DMatch> matches = speculative->good_matches_vec[c];
+			match_cache.insert(src_idx, acceptedImageDataVec[speculative->dst_indices[c]].features.img_idx, matches, matches.size() >= featureMatchingThreshold/2);
+		}
+	}
+	vector<const vector<DMatch>*> good_matches_vec(dst_indices.size());
+	vector<int> unmatched;
+	vector<const MatchDescriptors*> dst_descriptors;
+	for (int c = 0; c < dst_indices.size(); c++)
+	{
+		good_matches_vec[c] = match_cache.find(src_idx, acceptedImageDataVec[dst_indices[c]].features.img_idx);
+		if (good_matches_vec[c] == NULL)
+		{
+			unmatched.push_back(c);
+			dst_descriptors.push_back(&acceptedImageDataVec[dst_indices[c]].match_descriptors);
+		}
+	}
+	
+	//reference https://stackoverflow.com/questions/44988087/opencv-feature-matching-match-descriptors-to-knn-filtered-keypoints
+	//reference https://github.com/opencv/opencv/issues/6130
+	//reference http://study.marearts.com/2014/07/opencv-study-orb-gpu-feature-extraction.html
+	//reference https://docs.opencv.org/3.1.0/d6/d1d/group__cudafeatures2d.html
+	//match against all of them in one batch, with ratio test
+	if (!dst_descriptors.empty())
+	{
+		vector<vector<DMatch> > new_matches_vec;
+		ScopedStageTimer match_timer(timings, "matching", currentImageDataObj.raw_img_data_ptr->img_num);
+		matcher->matchMany(currentImageDataObj.match_descriptors, dst_descriptors, 0.5, 40, new_matches_vec);
+		match_timer.stop();
+		for (int k = 0; k < unmatched.size(); k++)
+		{
+			int dst_idx = acceptedImageDataVec[dst_indices[unmatched[k]]].features.img_idx;
+			good_matches_vec[unmatched[k]] = match_cache.insert(src_idx, dst_idx, new_matches_vec[k], new_matches_vec[k].size() >= featureMatchingThreshold/2);
 		}
+	}
+	
+	//room for every correspondence up front, gathering then only writes into the output clouds
+	size_t max_correspondences = current_img_matched_keypoints->points.size();
+	for (int c = 0; c < dst_indices.size(); c++)
+		if(good_matches_vec[c]->size() >= featureMatchingThreshold/2)
+			max_correspondences += good_matches_vec[c]->size();
+	current_img_matched_keypoints->points.reserve(max_correspondences);
+	fitted_cloud_matched_keypoints->points.reserve(max_correspondences);
+	
+	for (int c = 0; c < dst_indices.size(); c++)
+	{
+		int dst_index = dst_indices[c];
+		const vector<DMatch> &good_matches = *good_matches_vec[c];
 		
 		//cout << " good_matches.size() " << good_matches.size() << flush;
 		
@@ -2038,52 +2439,99 @@ pcl::PointCloud<pcl::PointXYZRGB>::Ptr &fitted_cloud_matched_keypoints)
 		good_matched_imgs_this_src++;
 		good_matches_count += good_matches.size();
 		
-		pcl::PointCloud<pcl::PointXYZRGB>::Ptr keypoints3D_dst = acceptedImageDataVec[dst_index].keypoints3D;
-		
-		vector<bool> pointsInROIVec_dst = acceptedImageDataVec[dst_index].keypoints3D_ROI_Points;
-		//cout << "\nkeypoints3D_dst->points.size() " << keypoints3D_dst->points.size() << " pointsInROIVec_dst.size() " << pointsInROIVec_dst.size() << endl;
-		
-		//using sequential matched points to estimate the rigid body transformation between matched 3D points
-		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_current_temp (new pcl::PointCloud<pcl::PointXYZRGB> ());
-		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_prior_temp (new pcl::PointCloud<pcl::PointXYZRGB> ());
-		cloud_current_temp->is_dense = true;
-		cloud_prior_temp->is_dense = true;
-		
-		for (int match_index = 0; match_index < good_matches.size(); match_index++)
-		{
-			DMatch match = good_matches[match_index];
-			
-			int dst_Idx = match.trainIdx;	//dst img
-			int src_Idx = match.queryIdx;	//src img
-			
-			if(pointsInROIVec_src[src_Idx] == true && pointsInROIVec_dst[dst_Idx] == true)
-			{
-				cloud_current_temp->points.push_back(keypoints3D_src->points[src_Idx]);
-				cloud_prior_temp->points.push_back(keypoints3D_dst->points[dst_Idx]);
-			}
-		}
-		
-		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_current_t_temp (new pcl::PointCloud<pcl::PointXYZRGB> ());
-		pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_prior_t_temp (new pcl::PointCloud<pcl::PointXYZRGB> ());
-		
-		pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 t_mat_MAVLink = currentImageDataObj.t_mat_MAVLink;
-		pcl::registration::TransformationEstimation<pcl::PointXYZRGB, pcl::PointXYZRGB>::Matrix4 t_mat_FeatureMatched = acceptedImageDataVec[dst_index].t_mat_FeatureMatched;
-		//cout << "\ncloud_current_temp->size(): " << cloud_current_temp->size() << flush;
-		//cout << "\nt_mat_MAVLink:\n" << t_mat_MAVLink << endl;
-		pcl::transformPointCloud(*cloud_current_temp, *cloud_current_t_temp, t_mat_MAVLink);
-		//cout << "cloud_prior_temp->size():" << cloud_prior_temp->size() << flush;
-		//cout << "\nt_mat_FeatureMatched:\n" << t_mat_FeatureMatched << endl;
-		pcl::transformPointCloud(*cloud_prior_temp, *cloud_prior_t_temp, t_mat_FeatureMatched);
-		
-		current_img_matched_keypoints->insert(current_img_matched_keypoints->end(),cloud_current_t_temp->begin(),cloud_current_t_temp->end());
-		fitted_cloud_matched_keypoints->insert(fitted_cloud_matched_keypoints->end(),cloud_prior_t_temp->begin(),cloud_prior_t_temp->end());
+		//using sequential matched points to estimate the rigid body transformation between matched 3D points.
+		//matched keypoints inside the ROI of both images, current ones with the MAVLink pose and prior ones with their feature matched pose
+		KeypointStore::gatherMatches(keypoints3D_src, *acceptedImageDataVec[dst_index].keypoints3D, good_matches,
+			currentImageDataObj.t_mat_MAVLink, acceptedImageDataVec[dst_index].t_mat_FeatureMatched,
+			*current_img_matched_keypoints, *fitted_cloud_matched_keypoints);
 	}
 	cout << " " << good_matched_imgs_this_src << "/" << good_matches_count;
-	log_file << " " << good_matched_imgs_this_src << "/" << good_matches_count;
+	logStream() << " " << good_matched_imgs_this_src << "/" << good_matches_count;
 	
 	return good_matches_count;
 }
 
+//accepted images within dist_nearby of the UAV position of an image, nearest first and at most range_width of them
+//uses the grid index, so images of earlier flight lines over the same ground are found as well
+void Pose::findNearbyImages(RawImageData* img_obj_ptr, vector<int> &dst_indices)
+{
+	vector<double> dists;
+	accepted_positions_index.radiusSearch(img_obj_ptr->tx, img_obj_ptr->ty, dist_nearby, dst_indices, dists);
+	if (dst_indices.size() > range_width)
+		dst_indices.resize(range_width);
+}
+
+//submit frames current_idx+1 .. current_idx+speculate_frames for matching ahead of the pose chain.
+//runs on the main thread, so the nearby images are looked up here and the task only reads accepted images
+void Pose::speculateFrames(int current_idx)
+{
+	if (speculate_frames <= 0)
+		return;
+	if (next_speculate_idx <= current_idx)
+		next_speculate_idx = current_idx + 1;
+	while (next_speculate_idx < rawImageDataVec.size() && next_speculate_idx <= current_idx + speculate_frames)
+	{
+		int i = next_speculate_idx;
+		if(stream_frames)
+		{//only frames that are decoded already, waiting for one here would stall the pose chain
+			if (i >= next_prefetch_idx || (frame_loaded[i].valid() && frame_loaded[i].wait_for(std::chrono::seconds(0)) != std::future_status::ready))
+				break;
+			waitForFrame(i);
+		}
+		
+		boost::shared_ptr<SpeculativeFrame> frame(new SpeculativeFrame());
+		frame->raw_idx = i;
+		if (!only_MAVLink)
+			findNearbyImages(&rawImageDataVec[i], frame->dst_indices);
+		//the speculate_frames + 1 frames of the window use different finders, frame i is taken before frame
+		//i + speculate_frames + 1 with the same finder is submitted
+		frame->done = pool->submit(&Pose::matchFrameAhead, this, frame.get(), speculative_finders[i % speculative_finders.size()]);
+		speculative_frames[i] = frame;
+		next_speculate_idx++;
+	}
+}
+
+//task of speculative matching: the same checks, features and matching the pose chain would do, except for poses
+void Pose::matchFrameAhead(SpeculativeFrame *frame, Ptr<FeaturesFinder> frame_finder)
+{
+	int i = frame->raw_idx;
+	bool cached_noisy = rawImageDataVec[i].cached_features && !rawImageDataVec[i].cached_features->has_features;
+	if (!cached_noisy && rawImageDataVec[i].disparity_image.empty())
+		return;
+	
+	frame->disp_img_var = getDisparityVariance(i);
+	frame->has_variance = true;
+	if (frame->disp_img_var > 5)
+		return;
+	if (rawImageDataVec[i].rgb_image.empty() || (use_segment_labels && rawImageDataVec[i].segment_label.empty()))
+		return;
+	
+	frame->imageData = findFeatures(i, frame_finder);
+	frame->has_features = true;
+	
+	if (frame->dst_indices.empty())
+		return;
+	vector<const MatchDescriptors*> dst_descriptors;
+	for (int c = 0; c < frame->dst_indices.size(); c++)
+		dst_descriptors.push_back(&acceptedImageDataVec[frame->dst_indices[c]].match_descriptors);
+	ScopedStageTimer match_timer(timings, "matching", rawImageDataVec[i].img_num);
+	matcher->matchMany(frame->imageData.match_descriptors, dst_descriptors, 0.5, 40, frame->good_matches_vec);
+}
+
+//wait for and remove the speculative result of a frame, NULL if it was not speculated.
+//a rejected frame needs no further invalidation: later frames never matched against it
+boost::shared_ptr<SpeculativeFrame> Pose::takeSpeculativeFrame(int raw_idx)
+{
+	map<int, boost::shared_ptr<SpeculativeFrame> >::iterator it = speculative_frames.find(raw_idx);
+	if (it == speculative_frames.end())
+		return boost::shared_ptr<SpeculativeFrame>();
+	boost::shared_ptr<SpeculativeFrame> frame = it->second;
+	speculative_frames.erase(it);
+	pool->wait(frame->done);
+	frame->done.get();
+	return frame;
+}
+
 double Pose::distanceCalculator(RawImageData* img_obj_ptr_src, RawImageData* img_obj_ptr_dst)
 {
 	double dist = sqrt((img_obj_ptr_src->tx - img_obj_ptr_dst->tx) * (img_obj_ptr_src->tx - img_obj_ptr_dst->tx)
@@ -2094,7 +2542,7 @@ double Pose::distanceCalculator(RawImageData* img_obj_ptr_src, RawImageData* img
 void Pose::segmentCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb)
 {
 	cout << "\nFinding UGV traversible area on map..." << endl;
-	log_file << "\nFinding UGV traversible area on map..." << endl;
+	logStream() << "\nFinding UGV traversible area on map..." << endl;
 	
 	Eigen::Vector4f min_pt, max_pt;
 	pcl::getMinMax3D (*cloudrgb, min_pt, max_pt);
@@ -2109,14 +2557,14 @@ void Pose::segmentCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb)
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_seg (new pcl::PointCloud<pcl::PointXYZRGB> ());
 	pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloud_obstacles (new pcl::PointCloud<pcl::PointXYZRGB> ());
 	cout << "point cloud size " << cloudrgb->size() << endl;
-	log_file << "point cloud size " << cloudrgb->size() << endl;
+	logStream() << "point cloud size " << cloudrgb->size() << endl;
 	
 	cout << "segment_dist_threashold " << segment_dist_threashold << endl;
 	cout << "convexhull_dist_threshold " << convexhull_dist_threshold << endl;
 	cout << "convexhull_alpha " << convexhull_alpha << endl;
-	log_file << "segment_dist_threashold " << segment_dist_threashold << endl;
-	log_file << "convexhull_dist_threshold " << convexhull_dist_threshold << endl;
-	log_file << "convexhull_alpha " << convexhull_alpha << endl;
+	logStream() << "segment_dist_threashold " << segment_dist_threashold << endl;
+	logStream() << "convexhull_dist_threshold " << convexhull_dist_threshold << endl;
+	logStream() << "convexhull_alpha " << convexhull_alpha << endl;
 	
 	for (int i = 0; i < size_cloud_divider_calc; i++)
 	{
@@ -2134,7 +2582,7 @@ void Pose::segmentCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb)
 			pcl::getPointsInBox (*cloudrgb, min_pt_box, max_pt_box, indices_ptsInBox);
 			
 			cout << "indices_ptsInBox.size() " << indices_ptsInBox.size() << endl;
-			log_file << "indices_ptsInBox.size() " << indices_ptsInBox.size() << endl;
+			logStream() << "indices_ptsInBox.size() " << indices_ptsInBox.size() << endl;
 			if (indices_ptsInBox.size() < 10)
 				continue;
 			
@@ -2161,10 +2609,10 @@ void Pose::segmentCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb)
 			}
 
 			cout << "Model coefficients: " << coefficients->values[0] << " " << coefficients->values[1] << " " << coefficients->values[2] << " "  << coefficients->values[3] << endl;
-			log_file << "Model coefficients: " << coefficients->values[0] << " " << coefficients->values[1] << " " << coefficients->values[2] << " "  << coefficients->values[3] << endl;
+			logStream() << "Model coefficients: " << coefficients->values[0] << " " << coefficients->values[1] << " " << coefficients->values[2] << " "  << coefficients->values[3] << endl;
 
 			cout << "Model inliers: " << inliers->indices.size () << endl;
-			log_file << "Model inliers: " << inliers->indices.size () << endl;
+			logStream() << "Model inliers: " << inliers->indices.size () << endl;
 			
 			pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgbseg (new pcl::PointCloud<pcl::PointXYZRGB> ());
 			pcl::PointCloud<pcl::PointXYZRGB>::Ptr cloudrgboutlier (new pcl::PointCloud<pcl::PointXYZRGB> ());
@@ -2230,7 +2678,7 @@ void Pose::segmentCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb)
 	chull.reconstruct (*cloud_hull);
 
 	cout << "Concave hull has: " << cloud_hull->points.size ()	<< " data points." << endl;
-	log_file << "Concave hull has: " << cloud_hull->points.size ()	<< " data points." << endl;
+	logStream() << "Concave hull has: " << cloud_hull->points.size ()	<< " data points." << endl;
 	
 	for (int i = 0; i < cloud_hull->size(); i++)
 	{
@@ -2238,12 +2686,26 @@ void Pose::segmentCloud(pcl::PointCloud<pcl::PointXYZRGB>::Ptr &cloudrgb)
 		cloud_hull->points[i].rgb = *reinterpret_cast<float*>(&rgbFM);
 	}
 	
-	log_file << "\nConvex Hull Boundary Points: x y z" << endl;
+	logStream() << "\nConvex Hull Boundary Points: x y z" << endl;
 	for (int i = 0; i < cloud_hull->size(); i++)
 	{
-		log_file << cloud_hull->points[i].x << " " << cloud_hull->points[i].y << " " << cloud_hull->points[i].z << endl;
+		logStream() << cloud_hull->points[i].x << " " << cloud_hull->points[i].y << " " << cloud_hull->points[i].z << endl;
 	}
 	
 	visualize_pt_cloud(cloud_hull, "cloud_hull");
 	
 }
+
+//count a rejected frame and drop its images in streaming mode
+void Pose::rejectFrame(int raw_idx, int reason)
+{
+	rejection_counts[reason]++;
+	match_cache.eraseSource(raw_idx);
+	if(stream_frames) releaseRawImageData(raw_idx);
+}
+
+//log_file locked for one statement, it is written from several threads
+LockedStream Pose::logStream()
+{
+	return LockedStream(log_file, log_mu);
+}
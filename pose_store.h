@@ -0,0 +1,207 @@
+#ifndef POSE_STORE_H
+#define POSE_STORE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Reads the given columns of a numeric CSV file into one vector per column. The file is mapped and parsed in place
+//with strtod, no line or field strings are built. Missing or unparsable fields read as 0, like the old stream parser.
+//Empty lines are skipped. Returns the number of rows read, -1 if the file could not be opened.
+inline int readCSVColumns(const std::string &path, const std::vector<int> &columns, std::vector<std::vector<double> > &out)
+{
+	out.assign(columns.size(), std::vector<double>());
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0)
+	{
+		close(fd);
+		return 0;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	const char *data = (const char*)map;
+	const char *end = data + st.st_size;
+
+	int max_col = 0;
+	for (int c = 0; c < columns.size(); c++)
+		max_col = std::max(max_col, columns[c]);
+	std::vector<int> slot(max_col + 1, -1);		//column number -> index in out
+	for (int c = 0; c < columns.size(); c++)
+		slot[columns[c]] = c;
+
+	int rows = 0;
+	std::vector<double> row(columns.size());
+	const char *p = data;
+	while (p < end)
+	{
+		const char *line_end = (const char*)memchr(p, '\n', end - p);
+		if (line_end == NULL)
+			line_end = end;
+		if (line_end > p && !(line_end - p == 1 && *p == '\r'))
+		{
+			std::fill(row.begin(), row.end(), 0.0);
+			int col = 0;
+			const char *field = p;
+			while (field <= line_end && col <= max_col)
+			{
+				const char *field_end = (const char*)memchr(field, ',', line_end - field);
+				if (field_end == NULL)
+					field_end = line_end;
+				if (slot[col] >= 0 && field_end > field)
+				{
+					if (field_end < end)
+						row[slot[col]] = strtod(field, NULL);	//stops at the ',' or '\n' after the field
+					else
+					{//last field of a file without final newline, the mapping has no terminator after it
+						char buf[64];
+						size_t len = std::min((size_t)(field_end - field), sizeof(buf) - 1);
+						memcpy(buf, field, len);
+						buf[len] = 0;
+						row[slot[col]] = strtod(buf, NULL);
+					}
+				}
+				field = field_end + 1;
+				col++;
+			}
+			for (int c = 0; c < columns.size(); c++)
+				out[c].push_back(row[c]);
+			rows++;
+		}
+		p = line_end + 1;
+	}
+	munmap(map, st.st_size);
+	return rows;
+}
+
+//one pose of the UAV, orientation as quaternion
+struct PoseSample {
+	double time;
+	double tx, ty, tz;
+	double qx, qy, qz, qw;
+};
+
+//Time series of UAV poses, stored column wise and sorted by time.
+//Lookups are binary searches on the time column, O(log n) and without copying anything.
+class PoseStore {
+public:
+	std::vector<double> time, tx, ty, tz, qx, qy, qz, qw;
+
+	//columns of time, position and quaternion in the CSV file. Returns false if it can not be read or is not sorted by time
+	bool load(const std::string &path, int time_col, int tx_col, int ty_col, int tz_col, int qx_col, int qy_col, int qz_col, int qw_col)
+	{
+		std::vector<int> columns = { time_col, tx_col, ty_col, tz_col, qx_col, qy_col, qz_col, qw_col };
+		std::vector<std::vector<double> > cols;
+		if (readCSVColumns(path, columns, cols) < 0)
+			return false;
+		time.swap(cols[0]); tx.swap(cols[1]); ty.swap(cols[2]); tz.swap(cols[3]);
+		qx.swap(cols[4]); qy.swap(cols[5]); qz.swap(cols[6]); qw.swap(cols[7]);
+		for (int i = 1; i < time.size(); i++)
+			if (time[i] < time[i - 1])
+				return false;
+		return true;
+	}
+
+	int size() const { return time.size(); }
+
+	PoseSample sample(int i) const
+	{
+		PoseSample s = { time[i], tx[i], ty[i], tz[i], qx[i], qy[i], qz[i], qw[i] };
+		return s;
+	}
+
+	//samples i0 <= i1 around t with alpha = (t - time[i0]) / (time[i1] - time[i0]), clamped to the first and last sample
+	void bracket(double t, int &i0, int &i1, double &alpha) const
+	{
+		int n = time.size();
+		int hi = std::lower_bound(time.begin(), time.end(), t) - time.begin();
+		if (hi <= 0)
+		{
+			i0 = i1 = 0;
+			alpha = 0;
+			return;
+		}
+		if (hi >= n)
+		{
+			i0 = i1 = n - 1;
+			alpha = 0;
+			return;
+		}
+		i0 = hi - 1;
+		i1 = hi;
+		double dt = time[i1] - time[i0];
+		alpha = dt > 0 ? (t - time[i0]) / dt : 0;
+	}
+
+	//index of the sample closest in time to t, -1 if the store is empty
+	int nearest(double t) const
+	{
+		if (time.empty())
+			return -1;
+		int i0, i1;
+		double alpha;
+		bracket(t, i0, i1, alpha);
+		return alpha > 0.5 ? i1 : i0;
+	}
+
+	//position interpolated linearly and orientation by SLERP between the samples around t
+	PoseSample interpolate(double t) const
+	{
+		int i0, i1;
+		double alpha;
+		bracket(t, i0, i1, alpha);
+		PoseSample s = sample(i0);
+		s.time = t;
+		if (i0 == i1 || alpha <= 0)
+			return s;
+		s.tx += alpha * (tx[i1] - tx[i0]);
+		s.ty += alpha * (ty[i1] - ty[i0]);
+		s.tz += alpha * (tz[i1] - tz[i0]);
+
+		double bx = qx[i1], by = qy[i1], bz = qz[i1], bw = qw[i1];
+		double dot = s.qx * bx + s.qy * by + s.qz * bz + s.qw * bw;
+		if (dot < 0)
+		{//shorter way round
+			bx = -bx; by = -by; bz = -bz; bw = -bw;
+			dot = -dot;
+		}
+		double w0, w1;
+		if (dot > 0.9995)
+		{//nearly parallel, linear interpolation is accurate and avoids dividing by sin(~0)
+			w0 = 1 - alpha;
+			w1 = alpha;
+		}
+		else
+		{
+			double theta = std::acos(dot);
+			double sin_theta = std::sin(theta);
+			w0 = std::sin((1 - alpha) * theta) / sin_theta;
+			w1 = std::sin(alpha * theta) / sin_theta;
+		}
+		s.qx = w0 * s.qx + w1 * bx;
+		s.qy = w0 * s.qy + w1 * by;
+		s.qz = w0 * s.qz + w1 * bz;
+		s.qw = w0 * s.qw + w1 * bw;
+		double norm = std::sqrt(s.qx * s.qx + s.qy * s.qy + s.qz * s.qz + s.qw * s.qw);
+		s.qx /= norm; s.qy /= norm; s.qz /= norm; s.qw /= norm;
+		return s;
+	}
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef POSITION_INDEX_H
+#define POSITION_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+//Incrementally built 2D uniform grid over positions (UAV x,y of accepted images).
+//Each cell holds the ids of positions inside it. A radius query only visits the cells overlapping the circle,
+//so its cost depends on how many positions are nearby and not on how many were added before.
+//The cell size is best set close to the usual query radius.
+class PositionGridIndex {
+public:
+	explicit PositionGridIndex(double cell_size = 1.0) { reset(cell_size); }
+
+	//remove all positions and set a new cell size
+	void reset(double cell_size)
+	{
+		if (cell_size <= 0)
+			cell_size = 1.0;
+		inv_cell = 1.0 / cell_size;
+		cells.clear();
+		xs.clear();
+		ys.clear();
+	}
+
+	//positions are identified by their insertion order: ids are 0, 1, 2...
+	int add(double x, double y)
+	{
+		int id = xs.size();
+		xs.push_back(x);
+		ys.push_back(y);
+		cells[key(cellCoord(x), cellCoord(y))].push_back(id);
+		return id;
+	}
+
+	int size() const { return xs.size(); }
+
+	//ids of all positions within radius of (x,y), nearest first. On equal distance, newer ids come first.
+	void radiusSearch(double x, double y, double radius, std::vector<int> &ids, std::vector<double> &dists) const
+	{
+		std::vector<std::pair<double, int> > found;
+		const int64_t cx0 = cellCoord(x - radius), cx1 = cellCoord(x + radius);
+		const int64_t cy0 = cellCoord(y - radius), cy1 = cellCoord(y + radius);
+		const double radius_sq = radius * radius;
+		for (int64_t cx = cx0; cx <= cx1; cx++)
+		{
+			for (int64_t cy = cy0; cy <= cy1; cy++)
+			{
+				std::unordered_map<uint64_t, std::vector<int> >::const_iterator it = cells.find(key(cx, cy));
+				if (it == cells.end())
+					continue;
+				const std::vector<int> &cell = it->second;
+				for (int i = 0; i < cell.size(); i++)
+				{
+					double dx = xs[cell[i]] - x, dy = ys[cell[i]] - y;
+					double d_sq = dx * dx + dy * dy;
+					if (d_sq <= radius_sq)
+						found.push_back(std::make_pair(d_sq, -cell[i]));
+				}
+			}
+		}
+		std::sort(found.begin(), found.end());
+		ids.resize(found.size());
+		dists.resize(found.size());
+		for (int i = 0; i < found.size(); i++)
+		{
+			ids[i] = -found[i].second;
+			dists[i] = std::sqrt(found[i].first);
+		}
+	}
+
+private:
+	double inv_cell;
+	std::unordered_map<uint64_t, std::vector<int> > cells;
+	std::vector<double> xs, ys;
+
+	int64_t cellCoord(double v) const { return (int64_t)std::floor(v * inv_cell); }
+	static uint64_t key(int64_t cx, int64_t cy) { return ((uint64_t)(uint32_t)cx << 32) | (uint64_t)(uint32_t)cy; }
+};
+
+#endif
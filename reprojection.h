@@ -0,0 +1,164 @@
+#ifndef REPROJECTION_H
+#define REPROJECTION_H
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//Disparity to 3D reprojection kernel. Same math as [X Y Z W]' = Q * [x y d 1]' followed by division by W,
+//but Q is unrolled into plain coefficients once and whole rows of sampled disparities are reprojected at a time.
+//Terms depending only on the row (y) are hoisted out of the inner loop. The inner loop runs 4 samples per
+//instruction with AVX, 2 with SSE2 and falls back to scalar code otherwise.
+//Valid samples (disparity > min_disparity) are written compacted into caller owned, pre-sized buffers.
+class DisparityReprojector {
+public:
+	static const int batch_size = 256;
+
+	DisparityReprojector()
+	{
+		for (int i = 0; i < 16; i++)
+			q[i] = (i % 5 == 0) ? 1.0 : 0.0;
+	}
+
+	//Q: 4x4 reprojection matrix in row major order
+	explicit DisparityReprojector(const double* Q)
+	{
+		for (int i = 0; i < 16; i++)
+			q[i] = Q[i];
+	}
+
+	//reproject one point. Returns false if W is zero.
+	bool reprojectPoint(double x, double y, double d, float* xyz) const
+	{
+		double X = q[0] * x + q[1] * y + q[2] * d + q[3];
+		double Y = q[4] * x + q[5] * y + q[6] * d + q[7];
+		double Z = q[8] * x + q[9] * y + q[10] * d + q[11];
+		double W = q[12] * x + q[13] * y + q[14] * d + q[15];
+		if (W == 0)
+			return false;
+		xyz[0] = (float)(X / W);
+		xyz[1] = (float)(Y / W);
+		xyz[2] = (float)(Z / W);
+		return true;
+	}
+
+	//reproject disparity samples x = x_start, x_start + step, ... < x_end of row y.
+	//xyz needs room for 3 floats and px for 1 int per sample. Returns number of valid points written.
+	//disparities of any type (uchar, float, double images) are widened to double while gathering a batch
+	template<typename T>
+	int reprojectRow(const T* disp_row, int y, int x_start, int x_end, int step, double min_disparity, float* xyz, int* px) const
+	{
+		double xs[batch_size], ds[batch_size];
+		int out = 0;
+		int x = x_start;
+		while (x < x_end)
+		{
+			int n = 0;
+			for (; n < batch_size && x < x_end; n++, x += step)
+			{
+				xs[n] = x;
+				ds[n] = disp_row[x];
+			}
+			out += reprojectSamples(xs, ds, n, y, min_disparity, xyz + 3*out, px + out);
+		}
+		return out;
+	}
+
+	//reproject n samples at columns xs of row y with disparities ds
+	int reprojectSamples(const double* xs, const double* ds, int n, double y, double min_disparity, float* xyz, int* px) const
+	{
+		//row constant terms
+		const double bx = q[1] * y + q[3];
+		const double by = q[5] * y + q[7];
+		const double bz = q[9] * y + q[11];
+		const double bw = q[13] * y + q[15];
+
+		int out = 0;
+		int i = 0;
+#if defined(__AVX__)
+		const __m256d q0 = _mm256_set1_pd(q[0]), q2 = _mm256_set1_pd(q[2]);
+		const __m256d q4 = _mm256_set1_pd(q[4]), q6 = _mm256_set1_pd(q[6]);
+		const __m256d q8 = _mm256_set1_pd(q[8]), q10 = _mm256_set1_pd(q[10]);
+		const __m256d q12 = _mm256_set1_pd(q[12]), q14 = _mm256_set1_pd(q[14]);
+		const __m256d vbx = _mm256_set1_pd(bx), vby = _mm256_set1_pd(by), vbz = _mm256_set1_pd(bz), vbw = _mm256_set1_pd(bw);
+		const __m256d vmin = _mm256_set1_pd(min_disparity);
+		const __m256d vzero = _mm256_setzero_pd();
+		for (; i + 4 <= n; i += 4)
+		{
+			__m256d vx = _mm256_loadu_pd(xs + i);
+			__m256d vd = _mm256_loadu_pd(ds + i);
+			int mask = _mm256_movemask_pd(_mm256_cmp_pd(vd, vmin, _CMP_GT_OQ));
+			if (mask == 0)
+				continue;
+			__m256d W = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(q12, vx), _mm256_mul_pd(q14, vd)), vbw);
+			mask &= ~_mm256_movemask_pd(_mm256_cmp_pd(W, vzero, _CMP_EQ_OQ));
+			double X[4], Y[4], Z[4];
+			_mm256_storeu_pd(X, _mm256_div_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(q0, vx), _mm256_mul_pd(q2, vd)), vbx), W));
+			_mm256_storeu_pd(Y, _mm256_div_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(q4, vx), _mm256_mul_pd(q6, vd)), vby), W));
+			_mm256_storeu_pd(Z, _mm256_div_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(q8, vx), _mm256_mul_pd(q10, vd)), vbz), W));
+			for (int k = 0; k < 4; k++)
+			{
+				if (mask & (1 << k))
+				{
+					xyz[3*out] = (float)X[k]; xyz[3*out+1] = (float)Y[k]; xyz[3*out+2] = (float)Z[k];
+					px[out] = (int)xs[i + k];
+					out++;
+				}
+			}
+		}
+#elif defined(__SSE2__)
+		const __m128d q0 = _mm_set1_pd(q[0]), q2 = _mm_set1_pd(q[2]);
+		const __m128d q4 = _mm_set1_pd(q[4]), q6 = _mm_set1_pd(q[6]);
+		const __m128d q8 = _mm_set1_pd(q[8]), q10 = _mm_set1_pd(q[10]);
+		const __m128d q12 = _mm_set1_pd(q[12]), q14 = _mm_set1_pd(q[14]);
+		const __m128d vbx = _mm_set1_pd(bx), vby = _mm_set1_pd(by), vbz = _mm_set1_pd(bz), vbw = _mm_set1_pd(bw);
+		const __m128d vmin = _mm_set1_pd(min_disparity);
+		const __m128d vzero = _mm_setzero_pd();
+		for (; i + 2 <= n; i += 2)
+		{
+			__m128d vx = _mm_loadu_pd(xs + i);
+			__m128d vd = _mm_loadu_pd(ds + i);
+			int mask = _mm_movemask_pd(_mm_cmpgt_pd(vd, vmin));
+			if (mask == 0)
+				continue;
+			__m128d W = _mm_add_pd(_mm_add_pd(_mm_mul_pd(q12, vx), _mm_mul_pd(q14, vd)), vbw);
+			mask &= ~_mm_movemask_pd(_mm_cmpeq_pd(W, vzero));
+			double X[2], Y[2], Z[2];
+			_mm_storeu_pd(X, _mm_div_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(q0, vx), _mm_mul_pd(q2, vd)), vbx), W));
+			_mm_storeu_pd(Y, _mm_div_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(q4, vx), _mm_mul_pd(q6, vd)), vby), W));
+			_mm_storeu_pd(Z, _mm_div_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(q8, vx), _mm_mul_pd(q10, vd)), vbz), W));
+			for (int k = 0; k < 2; k++)
+			{
+				if (mask & (1 << k))
+				{
+					xyz[3*out] = (float)X[k]; xyz[3*out+1] = (float)Y[k]; xyz[3*out+2] = (float)Z[k];
+					px[out] = (int)xs[i + k];
+					out++;
+				}
+			}
+		}
+#endif
+		//scalar tail and fallback
+		for (; i < n; i++)
+		{
+			if (!(ds[i] > min_disparity))
+				continue;
+			double W = q[12] * xs[i] + q[14] * ds[i] + bw;
+			if (W == 0)
+				continue;
+			xyz[3*out] = (float)((q[0] * xs[i] + q[2] * ds[i] + bx) / W);
+			xyz[3*out+1] = (float)((q[4] * xs[i] + q[6] * ds[i] + by) / W);
+			xyz[3*out+2] = (float)((q[8] * xs[i] + q[10] * ds[i] + bz) / W);
+			px[out] = (int)xs[i];
+			out++;
+		}
+		return out;
+	}
+
+private:
+	double q[16];
+};
+
+#endif
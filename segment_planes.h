@@ -0,0 +1,157 @@
+#ifndef SEGMENT_PLANES_H
+#define SEGMENT_PLANES_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <opencv2/core.hpp>
+
+//Least squares plane disparity = a*x + b*y + c for every label of a uchar segment label map.
+//fit() accumulates the normal equations of all labels in one sweep over the image, per row in exact integer sums,
+//and solves each 3x3 system in closed form. Nearly singular systems (segments on a line) fall back to the
+//SVD pseudo inverse, like the original per label fit did for all of them.
+class SegmentPlanes {
+public:
+	static const int max_labels = 256;
+
+	double a[max_labels], b[max_labels], c[max_labels];
+	bool fitted[max_labels];		//false -> label gets disparity 0
+
+	SegmentPlanes() { clear(); }
+
+	void clear()
+	{
+		memset(a, 0, sizeof(a));
+		memset(b, 0, sizeof(b));
+		memset(c, 0, sizeof(c));
+		memset(fitted, 0, sizeof(fitted));
+	}
+
+	//only pixels with x_min < x < x_max and y_min < y < y_max contribute to the fit, planes cover whole segments.
+	//label 0 is background. Labels after the first label that does not occur in the image are not fitted,
+	//as the original implementation stopped at the first missing label
+	void fit(const cv::Mat &labels, const cv::Mat &disp, int x_min, int x_max, int y_min, int y_max)
+	{
+		clear();
+		//per label: n, sum x, sum y, sum xx, sum xy, sum yy, sum z, sum xz, sum yz
+		int64_t sums[max_labels][9];
+		memset(sums, 0, sizeof(sums));
+		bool present[max_labels];
+		memset(present, 0, sizeof(present));
+
+		//per row sums of n, x, xx, z, xz. y terms are added once per row and label
+		int64_t row_sums[max_labels][5];
+		for (int y = 0; y < labels.rows; y++)
+		{
+			const unsigned char *lbl = labels.ptr<unsigned char>(y);
+			for (int x = 0; x < labels.cols; x++)
+				present[lbl[x]] = true;
+			if (y <= y_min || y >= y_max)
+				continue;
+
+			const unsigned char *z = disp.ptr<unsigned char>(y);
+			memset(row_sums, 0, sizeof(row_sums));
+			unsigned char row_labels[max_labels];
+			int n_row_labels = 0;
+			for (int x = std::max(x_min + 1, 0); x < std::min(x_max, labels.cols); x++)
+			{
+				int64_t *r = row_sums[lbl[x]];
+				if (r[0] == 0)
+					row_labels[n_row_labels++] = lbl[x];
+				r[0]++;
+				r[1] += x;
+				r[2] += x * x;
+				r[3] += z[x];
+				r[4] += x * z[x];
+			}
+			for (int k = 0; k < n_row_labels; k++)
+			{
+				const int64_t *r = row_sums[row_labels[k]];
+				int64_t *s = sums[row_labels[k]];
+				s[0] += r[0];
+				s[1] += r[1];
+				s[2] += y * r[0];
+				s[3] += r[2];
+				s[4] += y * r[1];
+				s[5] += (int64_t)y * y * r[0];
+				s[6] += r[3];
+				s[7] += r[4];
+				s[8] += y * r[3];
+			}
+		}
+
+		for (int l = 1; l < max_labels; l++)
+		{
+			if (!present[l])
+				break;
+			const int64_t *s = sums[l];
+			if (s[0] == 0)
+				continue;
+			solve(s, a[l], b[l], c[l]);
+			fitted[l] = true;
+		}
+	}
+
+	//fitted disparity of a pixel
+	inline double at(int label, int x, int y) const
+	{
+		return fitted[label] ? 1.0 * a[label] * x + 1.0 * b[label] * y + 1.0 * c[label] : 0.0;
+	}
+
+	//full resolution fitted disparity image, CV_64F or CV_32F
+	void render(const cv::Mat &labels, cv::Mat &out, int depth = CV_64F) const
+	{
+		out.create(labels.rows, labels.cols, depth == CV_32F ? CV_32F : CV_64F);
+		for (int y = 0; y < labels.rows; y++)
+		{
+			const unsigned char *lbl = labels.ptr<unsigned char>(y);
+			if (depth == CV_32F)
+			{
+				float *o = out.ptr<float>(y);
+				for (int x = 0; x < labels.cols; x++)
+					o[x] = (float)at(lbl[x], x, y);
+			}
+			else
+			{
+				double *o = out.ptr<double>(y);
+				for (int x = 0; x < labels.cols; x++)
+					o[x] = at(lbl[x], x, y);
+			}
+		}
+	}
+
+private:
+	//normal equations [xx xy x; xy yy y; x y n] * [a b c]' = [xz yz z]'
+	static void solve(const int64_t *s, double &pa, double &pb, double &pc)
+	{
+		double n = s[0], sx = s[1], sy = s[2], sxx = s[3], sxy = s[4], syy = s[5], sz = s[6], sxz = s[7], syz = s[8];
+		//cofactors of the symmetric matrix
+		double c00 = syy * n - sy * sy;
+		double c01 = sy * sx - sxy * n;
+		double c02 = sxy * sy - syy * sx;
+		double c11 = sxx * n - sx * sx;
+		double c12 = sxy * sx - sxx * sy;
+		double c22 = sxx * syy - sxy * sxy;
+		double det = sxx * c00 + sxy * c01 + sx * c02;
+		//scale invariant test: det relative to the product of the diagonal
+		if (std::fabs(det) > 1e-9 * sxx * syy * n)
+		{
+			pa = (c00 * sxz + c01 * syz + c02 * sz) / det;
+			pb = (c01 * sxz + c11 * syz + c12 * sz) / det;
+			pc = (c02 * sxz + c12 * syz + c22 * sz) / det;
+			return;
+		}
+		double AtA_data[9] = { sxx, sxy, sx, sxy, syy, sy, sx, sy, n };
+		double Atb_data[3] = { sxz, syz, sz };
+		cv::Mat AtA(3, 3, CV_64F, AtA_data), Atb(3, 1, CV_64F, Atb_data);
+		cv::Mat AtAinv;
+		cv::invert(AtA, AtAinv, cv::DECOMP_SVD);
+		cv::Mat x = AtAinv * Atb;
+		pa = x.at<double>(0, 0);
+		pb = x.at<double>(1, 0);
+		pc = x.at<double>(2, 0);
+	}
+};
+
+#endif
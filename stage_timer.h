@@ -0,0 +1,192 @@
+#ifndef STAGE_TIMER_H
+#define STAGE_TIMER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+//Per stage latency recorder. Every thread appends to its own buffer, so recording takes no lock;
+//the mutex is only taken the first time a thread records and when reports are written.
+//Reports must be written while no other thread is recording.
+class StageTimings {
+public:
+	struct Record {
+		const char* stage;		//string literal
+		int frame;				//image number, -1 for stages not tied to one image
+		int thread;
+		double start_ms;		//since the StageTimings object was created
+		double duration_ms;
+	};
+
+	StageTimings() : epoch(std::chrono::steady_clock::now()), id(nextId()++) {}
+
+	void record(const char* stage, int frame, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+	{
+		Buffer &buf = threadBuffer();
+		Record r;
+		r.stage = stage;
+		r.frame = frame;
+		r.thread = buf.thread;
+		r.start_ms = std::chrono::duration<double, std::milli>(start - epoch).count();
+		r.duration_ms = std::chrono::duration<double, std::milli>(end - start).count();
+		buf.records.push_back(r);
+	}
+
+	//all records of all threads, ordered by start time
+	std::vector<Record> collect()
+	{
+		std::lock_guard<std::mutex> lock(mu);
+		std::vector<Record> all;
+		for (int i = 0; i < buffers.size(); i++)
+			all.insert(all.end(), buffers[i]->records.begin(), buffers[i]->records.end());
+		std::sort(all.begin(), all.end(), [](const Record &a, const Record &b) { return a.start_ms < b.start_ms; });
+		return all;
+	}
+
+	bool writeCSV(const std::string &path)
+	{
+		std::vector<Record> all = collect();
+		std::ofstream out(path.c_str());
+		if (!out.is_open())
+			return false;
+		out << "stage,frame,thread,start_ms,duration_ms\n";
+		for (int i = 0; i < all.size(); i++)
+			out << all[i].stage << "," << all[i].frame << "," << all[i].thread << "," << all[i].start_ms << "," << all[i].duration_ms << "\n";
+		return true;
+	}
+
+	//{"stages": {name: {count, total_ms, mean_ms, p50_ms, p95_ms, p99_ms, max_ms}}, "records": [...]}
+	bool writeJSON(const std::string &path)
+	{
+		std::vector<Record> all = collect();
+		std::ofstream out(path.c_str());
+		if (!out.is_open())
+			return false;
+		std::map<std::string, Summary> summaries = summarize(all);
+		out << "{\n\"stages\": {";
+		for (std::map<std::string, Summary>::iterator it = summaries.begin(); it != summaries.end(); ++it)
+		{
+			const Summary &s = it->second;
+			out << (it == summaries.begin() ? "\n" : ",\n") << "\"" << it->first << "\": {\"count\": " << s.count << ", \"total_ms\": " << s.total
+				<< ", \"mean_ms\": " << s.mean << ", \"p50_ms\": " << s.p50 << ", \"p95_ms\": " << s.p95 << ", \"p99_ms\": " << s.p99 << ", \"max_ms\": " << s.max << "}";
+		}
+		out << "\n},\n\"records\": [";
+		for (int i = 0; i < all.size(); i++)
+			out << (i == 0 ? "\n" : ",\n") << "{\"stage\": \"" << all[i].stage << "\", \"frame\": " << all[i].frame << ", \"thread\": " << all[i].thread
+				<< ", \"start_ms\": " << all[i].start_ms << ", \"duration_ms\": " << all[i].duration_ms << "}";
+		out << "\n]\n}\n";
+		return true;
+	}
+
+	//one line per stage with count, total, mean and p50/p95/p99/max in ms
+	void printSummary(std::ostream &out)
+	{
+		std::map<std::string, Summary> summaries = summarize(collect());
+		out << "stage\tcount\ttotal_ms\tmean_ms\tp50_ms\tp95_ms\tp99_ms\tmax_ms" << std::endl;
+		for (std::map<std::string, Summary>::iterator it = summaries.begin(); it != summaries.end(); ++it)
+		{
+			const Summary &s = it->second;
+			out << it->first << "\t" << s.count << "\t" << s.total << "\t" << s.mean << "\t" << s.p50 << "\t" << s.p95 << "\t" << s.p99 << "\t" << s.max << std::endl;
+		}
+	}
+
+private:
+	struct Buffer {
+		int thread;
+		std::vector<Record> records;
+	};
+	struct Summary {
+		int count;
+		double total, mean, p50, p95, p99, max;
+	};
+
+	std::chrono::steady_clock::time_point epoch;
+	unsigned int id;		//unique per object, as addresses may be reused
+	std::mutex mu;
+	std::vector<std::unique_ptr<Buffer> > buffers;		//owned here, so records survive their threads
+
+	Buffer& threadBuffer()
+	{
+		static thread_local unsigned int owner = 0;
+		static thread_local Buffer* buf = nullptr;
+		if (owner != id)
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			buffers.push_back(std::unique_ptr<Buffer>(new Buffer()));
+			buf = buffers.back().get();
+			buf->thread = buffers.size() - 1;
+			buf->records.reserve(1024);
+			owner = id;
+		}
+		return *buf;
+	}
+
+	static std::atomic<unsigned int>& nextId() { static std::atomic<unsigned int> next(1); return next; }
+
+	//nearest rank percentile of sorted values
+	static double percentile(const std::vector<double> &sorted, double p)
+	{
+		int rank = (int)(p / 100.0 * sorted.size() + 0.5);
+		rank = std::min(std::max(rank, 1), (int)sorted.size());
+		return sorted[rank - 1];
+	}
+
+	static std::map<std::string, Summary> summarize(const std::vector<Record> &all)
+	{
+		std::map<std::string, std::vector<double> > durations;
+		for (int i = 0; i < all.size(); i++)
+			durations[all[i].stage].push_back(all[i].duration_ms);
+		std::map<std::string, Summary> summaries;
+		for (std::map<std::string, std::vector<double> >::iterator it = durations.begin(); it != durations.end(); ++it)
+		{
+			std::vector<double> &d = it->second;
+			std::sort(d.begin(), d.end());
+			Summary s;
+			s.count = d.size();
+			s.total = 0;
+			for (int i = 0; i < d.size(); i++)
+				s.total += d[i];
+			s.mean = s.total / s.count;
+			s.p50 = percentile(d, 50);
+			s.p95 = percentile(d, 95);
+			s.p99 = percentile(d, 99);
+			s.max = d.back();
+			summaries[it->first] = s;
+		}
+		return summaries;
+	}
+};
+
+//records the time from construction to destruction (or stop()) as one stage duration
+class ScopedStageTimer {
+public:
+	ScopedStageTimer(StageTimings &timings, const char* stage, int frame = -1)
+		: timings(timings), stage(stage), frame(frame), running(true), start(std::chrono::steady_clock::now()) {}
+	~ScopedStageTimer() { stop(); }
+
+	void stop()
+	{
+		if (!running)
+			return;
+		running = false;
+		timings.record(stage, frame, start, std::chrono::steady_clock::now());
+	}
+
+private:
+	StageTimings &timings;
+	const char* stage;
+	int frame;
+	bool running;
+	std::chrono::steady_clock::time_point start;
+};
+
+#endif
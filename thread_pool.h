@@ -0,0 +1,178 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Persistent work-stealing task pool shared by all parallel stages of the program.
+//Every worker owns a deque: it pops its own newest task from the back and, when empty, steals the oldest task
+//from the front of another worker's deque. Tasks submitted from outside the pool are spread round robin.
+//submit() returns a std::future, so results (and exceptions) are collected by the caller in submission order.
+class ThreadPool {
+public:
+	explicit ThreadPool(int n_threads = 0)
+	{
+		if (n_threads <= 0)
+			n_threads = std::thread::hardware_concurrency();
+		if (n_threads <= 0)
+			n_threads = 1;
+
+		for (int i = 0; i < n_threads; i++)
+			queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+		for (int i = 0; i < n_threads; i++)
+			workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(wake_mu);
+			stop = true;
+		}
+		wake_cv.notify_all();
+		for (int i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	int size() const { return workers.size(); }
+
+	//submit any callable (including member function pointers with their object) and get a future for its result
+	template<typename F, typename... Args>
+	auto submit(F&& f, Args&&... args) -> std::future<decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)())>
+	{
+		typedef decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...)()) result_t;
+		std::shared_ptr<std::packaged_task<result_t()> > task =
+			std::make_shared<std::packaged_task<result_t()> >(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+		std::future<result_t> result = task->get_future();
+		push([task]() { (*task)(); });
+		return result;
+	}
+
+	//run one queued task on the calling thread, if there is any. Returns false when nothing was run.
+	bool runPendingTask()
+	{
+		std::function<void()> task;
+		int self = (worker_index() >= 0 && worker_pool() == this) ? worker_index() : 0;
+		if (!popTask(self, task))
+			return false;
+		task();
+		return true;
+	}
+
+	//wait for a future while helping to execute queued work, so that tasks may safely wait on other tasks
+	template<typename T>
+	void wait(std::future<T>& future)
+	{
+		while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		{
+			if (!runPendingTask())
+				future.wait_for(std::chrono::microseconds(200));
+		}
+	}
+
+	//wait for all futures, in order. Exceptions thrown inside tasks are rethrown here.
+	template<typename T>
+	void wait(std::vector<std::future<T> >& futures)
+	{
+		for (int i = 0; i < futures.size(); i++)
+		{
+			wait(futures[i]);
+			futures[i].get();
+		}
+	}
+
+private:
+	struct WorkerQueue {
+		std::mutex mu;
+		std::deque<std::function<void()> > tasks;
+	};
+
+	std::vector<std::unique_ptr<WorkerQueue> > queues;
+	std::vector<std::thread> workers;
+	std::mutex wake_mu;
+	std::condition_variable wake_cv;
+	int pending = 0;		//guarded by wake_mu
+	bool stop = false;		//guarded by wake_mu
+	std::atomic<unsigned int> next_queue{0};
+
+	static int& worker_index() { static thread_local int index = -1; return index; }
+	static ThreadPool*& worker_pool() { static thread_local ThreadPool* pool = nullptr; return pool; }
+
+	void push(std::function<void()> task)
+	{
+		//workers keep their own subtasks local, outside threads spread work round robin
+		int q = (worker_pool() == this) ? worker_index() : (int)(next_queue++ % queues.size());
+		{
+			std::lock_guard<std::mutex> lock(queues[q]->mu);
+			queues[q]->tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(wake_mu);
+			pending++;
+		}
+		wake_cv.notify_one();
+	}
+
+	bool popTask(int self, std::function<void()> &task)
+	{
+		//own queue first, newest task
+		{
+			std::lock_guard<std::mutex> lock(queues[self]->mu);
+			if (!queues[self]->tasks.empty())
+			{
+				task = std::move(queues[self]->tasks.back());
+				queues[self]->tasks.pop_back();
+				taskTaken();
+				return true;
+			}
+		}
+		//steal oldest task from the other queues
+		for (int i = 1; i < queues.size(); i++)
+		{
+			int victim = (self + i) % queues.size();
+			std::lock_guard<std::mutex> lock(queues[victim]->mu);
+			if (!queues[victim]->tasks.empty())
+			{
+				task = std::move(queues[victim]->tasks.front());
+				queues[victim]->tasks.pop_front();
+				taskTaken();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void taskTaken()
+	{
+		std::lock_guard<std::mutex> lock(wake_mu);
+		pending--;
+	}
+
+	void workerLoop(int index)
+	{
+		worker_index() = index;
+		worker_pool() = this;
+		while (true)
+		{
+			std::function<void()> task;
+			if (popTask(index, task))
+			{
+				task();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(wake_mu);
+			wake_cv.wait(lock, [this]() { return stop || pending > 0; });
+			if (stop && pending == 0)
+				return;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef TRAJECTORY_ALIGNER_H
+#define TRAJECTORY_ALIGNER_H
+
+#include <Eigen/Core>
+#include <Eigen/SVD>
+
+//Rigid alignment of a source trajectory (feature matched UAV positions) to a target trajectory (MAVLink positions)
+//where position i of both is the same frame, so no correspondence search is needed. Keeps running sums of the
+//weighted positions and their cross products, which is all the closed form least squares solution (Umeyama/Horn)
+//needs: adding a position is O(1), and so is moving all source positions by a rigid transform, as the sums
+//transform with it. Sums are kept relative to the first target position, large coordinates do not cancel out.
+//With decay < 1 the weights of earlier positions shrink every cycle, recent positions dominate the fit.
+class TrajectoryAligner {
+public:
+	explicit TrajectoryAligner(double decay = 1.0) : decay_factor(decay) { clear(); }
+
+	void clear()
+	{
+		n = 0;
+		w = 0;
+		sp.setZero();
+		sq.setZero();
+		spq.setZero();
+		origin.setZero();
+		first_p.setZero();
+		first_q.setZero();
+	}
+
+	void setDecay(double decay) { decay_factor = decay; }
+
+	//start of a cycle: age the positions added so far
+	void decay()
+	{
+		if (decay_factor >= 1.0)
+			return;
+		w *= decay_factor;
+		sp *= decay_factor;
+		sq *= decay_factor;
+		spq *= decay_factor;
+	}
+
+	void add(const Eigen::Vector3d &p, const Eigen::Vector3d &q)
+	{
+		if (n == 0)
+		{
+			origin = q;
+			first_p = p - origin;
+			first_q = q - origin;
+		}
+		Eigen::Vector3d pr = p - origin, qr = q - origin;
+		w += 1;
+		sp += pr;
+		sq += qr;
+		spq += pr * qr.transpose();
+		n++;
+	}
+
+	//number of positions added
+	int size() const { return n; }
+
+	//rigid transform moving the source positions onto the target positions with least weighted squared error
+	Eigen::Matrix4d estimate() const
+	{
+		Eigen::Matrix4d T = Eigen::Matrix4d::Identity();
+		if (w <= 0)
+			return T;
+		Eigen::Vector3d mp = sp / w, mq = sq / w;
+		Eigen::Matrix3d R = Eigen::Matrix3d::Identity();
+		if (n >= 3)
+		{
+			Eigen::Matrix3d H = spq - w * mp * mq.transpose();
+			Eigen::JacobiSVD<Eigen::Matrix3d> svd(H, Eigen::ComputeFullU | Eigen::ComputeFullV);
+			Eigen::Matrix3d D = Eigen::Matrix3d::Identity();
+			if ((svd.matrixV() * svd.matrixU().transpose()).determinant() < 0)
+				D(2, 2) = -1;	//reflection, flip the axis of the smallest singular value
+			R = svd.matrixV() * D * svd.matrixU().transpose();
+		}
+		//in relative coordinates q = R p + t_rel, in absolute ones the origin moves by R
+		Eigen::Vector3d t_rel = mq - R * mp;
+		T.block<3, 3>(0, 0) = R;
+		T.block<3, 1>(0, 3) = t_rel + origin - R * origin;
+		return T;
+	}
+
+	//all source positions added so far were moved by the rigid transform T
+	void transformSource(const Eigen::Matrix4d &T)
+	{
+		Eigen::Matrix3d R = T.block<3, 3>(0, 0);
+		Eigen::Vector3d t_rel = T.block<3, 1>(0, 3) + R * origin - origin;
+		spq = R * spq + t_rel * sq.transpose();
+		sp = R * sp + w * t_rel;
+		first_p = R * first_p + t_rel;
+	}
+
+	Eigen::Vector3d sourceMean() const { return w > 0 ? Eigen::Vector3d(sp / w + origin) : origin; }
+	Eigen::Vector3d targetMean() const { return w > 0 ? Eigen::Vector3d(sq / w + origin) : origin; }
+	Eigen::Vector3d firstSource() const { return first_p + origin; }
+	Eigen::Vector3d firstTarget() const { return first_q + origin; }
+
+private:
+	double decay_factor;
+	int n;
+	double w;
+	Eigen::Vector3d sp, sq;		//weighted sums of source and target positions
+	Eigen::Matrix3d spq;		//weighted sum of source * target^T
+	Eigen::Vector3d origin;
+	Eigen::Vector3d first_p, first_q;
+};
+
+#endif
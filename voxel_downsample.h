@@ -0,0 +1,230 @@
+#ifndef VOXEL_DOWNSAMPLE_H
+#define VOXEL_DOWNSAMPLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <vector>
+#include "thread_pool.h"
+#include "voxel_grid.h"
+
+//Voxel grid downsampling of a whole cloud, the replacement of pcl::VoxelGrid.
+//Voxel indices are taken relative to the smallest index in the cloud and packed into a 64 bit key with only as
+//many bits per axis as the extent of the cloud needs, so large extents neither overflow nor need offset points.
+//Keys are computed in parallel and sorted together with the point indices by a parallel LSD radix sort of 8 bit
+//digits, over the bytes the keys actually use. Every run of equal keys is then reduced to its centroid with
+//averaged color, like pcl::VoxelGrid. Output is ordered by key and the same for any number of threads.
+//leaf_z <= 0 makes 2.5D cells: columns covering all heights. Non finite points are skipped.
+//Buffers are kept between calls, an instance must not filter from several threads at once.
+class VoxelDownsampler {
+public:
+	VoxelDownsampler(double leaf_x, double leaf_y, double leaf_z, ThreadPool *pool = NULL)
+		: inv_leaf_x(1.0 / leaf_x), inv_leaf_y(1.0 / leaf_y), inv_leaf_z(leaf_z > 0 ? 1.0 / leaf_z : 0), pool(pool)
+	{
+	}
+
+	//write the centroids of voxels having at least min_points points of in into out, a pcl style cloud
+	template<typename CloudT>
+	void filter(const CloudT &in, CloudT &out, unsigned int min_points = 1)
+	{
+		const size_t n = in.points.size();
+		const int n_blocks = blockCount(n);
+		std::vector<Range> ranges(n_blocks);
+
+		//index bounds and finite points per block
+		parallelFor(n_blocks, [&](int b)
+		{
+			Range &range = ranges[b];
+			for (size_t i = n * b / n_blocks; i < n * (b + 1) / n_blocks; i++)
+			{
+				const typename CloudT::PointType &pt = in.points[i];
+				if (!std::isfinite(pt.x) || !std::isfinite(pt.y) || !std::isfinite(pt.z))
+					continue;
+				int64_t idx[3] = { index(pt.x, inv_leaf_x), index(pt.y, inv_leaf_y), index(pt.z, inv_leaf_z) };
+				for (int a = 0; a < 3; a++)
+				{
+					range.min[a] = std::min(range.min[a], idx[a]);
+					range.max[a] = std::max(range.max[a], idx[a]);
+				}
+				range.count++;
+			}
+		});
+		Range total;
+		for (int b = 0; b < n_blocks; b++)
+		{
+			for (int a = 0; a < 3; a++)
+			{
+				total.min[a] = std::min(total.min[a], ranges[b].min[a]);
+				total.max[a] = std::max(total.max[a], ranges[b].max[a]);
+			}
+			total.count += ranges[b].count;
+		}
+		out.points.clear();
+		if (total.count > 0)
+		{
+			int bits[3];
+			for (int a = 0; a < 3; a++)
+				bits[a] = bitWidth((uint64_t)(total.max[a] - total.min[a]));
+			if (bits[0] + bits[1] + bits[2] > 64)
+				throw "Exception: point cloud extent too large for 64 bit voxel keys, increase the leaf size!";
+			const int shift_x = bits[1] + bits[2], shift_y = bits[2];
+
+			//keys of the finite points, compacted in point order
+			keys.resize(total.count);
+			std::vector<size_t> offsets(n_blocks, 0);
+			for (int b = 1; b < n_blocks; b++)
+				offsets[b] = offsets[b - 1] + ranges[b - 1].count;
+			parallelFor(n_blocks, [&](int b)
+			{
+				KeyIndex *dst = &keys[0] + offsets[b];
+				for (size_t i = n * b / n_blocks; i < n * (b + 1) / n_blocks; i++)
+				{
+					const typename CloudT::PointType &pt = in.points[i];
+					if (!std::isfinite(pt.x) || !std::isfinite(pt.y) || !std::isfinite(pt.z))
+						continue;
+					dst->key = ((uint64_t)(index(pt.x, inv_leaf_x) - total.min[0]) << shift_x)
+						| ((uint64_t)(index(pt.y, inv_leaf_y) - total.min[1]) << shift_y)
+						| (uint64_t)(index(pt.z, inv_leaf_z) - total.min[2]);
+					dst->idx = i;
+					dst++;
+				}
+			});
+			radixSort((bits[0] + bits[1] + bits[2] + 7) / 8);
+			reduceRuns(in, out, min_points);
+		}
+		out.width = out.points.size();
+		out.height = 1;
+	}
+
+private:
+	struct KeyIndex {
+		uint64_t key;
+		uint32_t idx;
+	};
+
+	struct Range {
+		int64_t min[3] = { INT64_MAX, INT64_MAX, INT64_MAX };
+		int64_t max[3] = { INT64_MIN, INT64_MIN, INT64_MIN };
+		size_t count = 0;
+	};
+
+	double inv_leaf_x, inv_leaf_y, inv_leaf_z;
+	ThreadPool *pool;
+	std::vector<KeyIndex> keys, keys_tmp;
+
+	static inline int64_t index(double v, double inv_leaf) { return inv_leaf > 0 ? (int64_t)std::floor(v * inv_leaf) : 0; }
+
+	static int bitWidth(uint64_t v)
+	{
+		int bits = 0;
+		while (v >> bits)
+			bits++;
+		return bits;
+	}
+
+	//blocks of at least 64k points, a few per thread for load balance
+	int blockCount(size_t n) const
+	{
+		if (pool == NULL)
+			return 1;
+		return (int)std::max<size_t>(1, std::min<size_t>(4 * pool->size(), n >> 16));
+	}
+
+	//run f(block) for every block, on the pool if there is one
+	template<typename F>
+	void parallelFor(int n_blocks, F f)
+	{
+		if (pool == NULL || n_blocks == 1)
+		{
+			for (int b = 0; b < n_blocks; b++)
+				f(b);
+			return;
+		}
+		std::vector<std::future<void> > tasks;
+		for (int b = 0; b < n_blocks; b++)
+			tasks.push_back(pool->submit([&f, b]() { f(b); }));
+		pool->wait(tasks);
+	}
+
+	//stable sort of keys by their lowest n_bytes bytes. Every pass counts the digits of each block in parallel,
+	//turns the counts into per block output offsets (digit major, then block) and scatters the blocks in parallel
+	void radixSort(int n_bytes)
+	{
+		const size_t n = keys.size();
+		const int n_blocks = blockCount(n);
+		keys_tmp.resize(n);
+		std::vector<size_t> counts((size_t)n_blocks * 256);
+		for (int pass = 0; pass < n_bytes; pass++)
+		{
+			const int shift = 8 * pass;
+			std::fill(counts.begin(), counts.end(), 0);
+			parallelFor(n_blocks, [&](int b)
+			{
+				size_t *count = &counts[(size_t)b * 256];
+				for (size_t i = n * b / n_blocks; i < n * (b + 1) / n_blocks; i++)
+					count[(keys[i].key >> shift) & 0xFF]++;
+			});
+			size_t sum = 0;
+			for (int d = 0; d < 256; d++)
+			{
+				for (int b = 0; b < n_blocks; b++)
+				{
+					size_t c = counts[(size_t)b * 256 + d];
+					counts[(size_t)b * 256 + d] = sum;
+					sum += c;
+				}
+			}
+			parallelFor(n_blocks, [&](int b)
+			{
+				size_t *offset = &counts[(size_t)b * 256];
+				for (size_t i = n * b / n_blocks; i < n * (b + 1) / n_blocks; i++)
+					keys_tmp[offset[(keys[i].key >> shift) & 0xFF]++] = keys[i];
+			});
+			keys.swap(keys_tmp);
+		}
+	}
+
+	//centroid of every run of equal keys, blocks start at run boundaries and are concatenated in order
+	template<typename CloudT>
+	void reduceRuns(const CloudT &in, CloudT &out, unsigned int min_points)
+	{
+		const size_t n = keys.size();
+		const int n_blocks = blockCount(n);
+		std::vector<size_t> starts(n_blocks + 1, n);
+		for (int b = 0; b < n_blocks; b++)
+		{
+			size_t s = n * b / n_blocks;
+			while (s > 0 && s < n && keys[s].key == keys[s - 1].key)
+				s++;
+			starts[b] = s;
+		}
+		std::vector<std::vector<typename CloudT::PointType> > block_points(n_blocks);
+		parallelFor(n_blocks, [&](int b)
+		{
+			size_t i = starts[b];
+			while (i < starts[b + 1])
+			{
+				VoxelHashGrid::Voxel v = VoxelHashGrid::Voxel();
+				uint64_t key = keys[i].key;
+				for (; i < n && keys[i].key == key; i++)
+				{
+					const typename CloudT::PointType &pt = in.points[keys[i].idx];
+					v.x += pt.x; v.y += pt.y; v.z += pt.z;
+					v.r += pt.r; v.g += pt.g; v.b += pt.b;
+					v.n++;
+				}
+				if (v.n >= min_points)
+					block_points[b].push_back(VoxelHashGrid::makePoint<typename CloudT::PointType>(v.x / v.n, v.y / v.n, v.z / v.n, v));
+			}
+		});
+		size_t n_out = 0;
+		for (int b = 0; b < n_blocks; b++)
+			n_out += block_points[b].size();
+		out.points.reserve(n_out);
+		for (int b = 0; b < n_blocks; b++)
+			out.points.insert(out.points.end(), block_points[b].begin(), block_points[b].end());
+	}
+};
+
+#endif
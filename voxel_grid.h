@@ -0,0 +1,106 @@
+#ifndef VOXEL_GRID_H
+#define VOXEL_GRID_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+//Hashed voxel grid accumulating points as they are produced, without an intermediate cloud.
+//Every voxel keeps running sums of position and color and its point count, exported as the voxel centroid
+//with averaged color, i.e. the same output pcl::VoxelGrid gives for the same leaf size.
+//A leaf_z <= 0 makes 2.5D cells: columns covering all heights.
+class VoxelHashGrid {
+public:
+	struct Voxel {
+		double x, y, z;
+		double r, g, b;
+		unsigned int n;
+	};
+
+	VoxelHashGrid(double leaf_x, double leaf_y, double leaf_z)
+		: inv_leaf_x(1.0 / leaf_x), inv_leaf_y(1.0 / leaf_y), inv_leaf_z(leaf_z > 0 ? 1.0 / leaf_z : 0)
+	{
+	}
+
+	//voxel key: 21 bits per axis, enough for 2 million voxels in each direction
+	uint64_t key(double x, double y, double z) const
+	{
+		int64_t ix = (int64_t)std::floor(x * inv_leaf_x);
+		int64_t iy = (int64_t)std::floor(y * inv_leaf_y);
+		int64_t iz = inv_leaf_z > 0 ? (int64_t)std::floor(z * inv_leaf_z) : 0;
+		return ((uint64_t)(ix & 0x1FFFFF) << 42) | ((uint64_t)(iy & 0x1FFFFF) << 21) | (uint64_t)(iz & 0x1FFFFF);
+	}
+
+	void add(double x, double y, double z, uint8_t r, uint8_t g, uint8_t b)
+	{
+		Voxel &v = voxels[key(x, y, z)];		//value initialized to zeros on insertion
+		v.x += x; v.y += y; v.z += z;
+		v.r += r; v.g += g; v.b += b;
+		v.n++;
+	}
+
+	//merge the sums of a voxel, e.g. one read back from a file
+	void addVoxel(uint64_t k, const Voxel &voxel)
+	{
+		Voxel &v = voxels[k];
+		v.x += voxel.x; v.y += voxel.y; v.z += voxel.z;
+		v.r += voxel.r; v.g += voxel.g; v.b += voxel.b;
+		v.n += voxel.n;
+	}
+
+	void reserve(size_t n) { voxels.reserve(n); }
+	size_t size() const { return voxels.size(); }
+	void clear() { voxels.clear(); }
+
+	//call f(voxel) for every voxel
+	template<typename F>
+	void forEachVoxel(F f) const
+	{
+		for (std::unordered_map<uint64_t, Voxel>::const_iterator it = voxels.begin(); it != voxels.end(); ++it)
+			f(it->second);
+	}
+
+	//call f(key, voxel) for every voxel
+	template<typename F>
+	void forEachEntry(F f) const
+	{
+		for (std::unordered_map<uint64_t, Voxel>::const_iterator it = voxels.begin(); it != voxels.end(); ++it)
+			f(it->first, it->second);
+	}
+
+	//write centroids of voxels having at least min_points points into a pcl style cloud of xyz + packed rgb points
+	template<typename CloudT>
+	void exportTo(CloudT &cloud, unsigned int min_points = 1) const
+	{
+		cloud.points.clear();
+		cloud.points.reserve(voxels.size());
+		for (std::unordered_map<uint64_t, Voxel>::const_iterator it = voxels.begin(); it != voxels.end(); ++it)
+		{
+			const Voxel &v = it->second;
+			if (v.n < min_points)
+				continue;
+			cloud.points.push_back(makePoint<typename CloudT::PointType>(v.x / v.n, v.y / v.n, v.z / v.n, v));
+		}
+		cloud.width = cloud.points.size();
+		cloud.height = 1;
+	}
+
+	template<typename PointT>
+	static PointT makePoint(double x, double y, double z, const Voxel &v)
+	{
+		PointT pt;
+		pt.x = (float)x;
+		pt.y = (float)y;
+		pt.z = (float)z;
+		uint32_t rgb = ((uint32_t)(v.r / v.n) << 16 | (uint32_t)(v.g / v.n) << 8 | (uint32_t)(v.b / v.n));
+		std::memcpy(&pt.rgb, &rgb, sizeof(float));
+		return pt;
+	}
+
+private:
+	double inv_leaf_x, inv_leaf_y, inv_leaf_z;
+	std::unordered_map<uint64_t, Voxel> voxels;
+};
+
+#endif
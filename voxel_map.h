@@ -0,0 +1,320 @@
+#ifndef VOXEL_MAP_H
+#define VOXEL_MAP_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "voxel_grid.h"
+
+//Persistent global map absorbing the clouds of every cycle incrementally.
+//Points are kept in a map frame related to the world frame by the rigid transform T_map. A correction of the
+//whole map (ICP) only updates T_map, new points are taken back into the map frame before insertion and
+//centroids are transformed to world on export. Export cost is O(voxels), independent of points added so far.
+//The map frame is partitioned into ground tiles of tile_cells x tile_cells voxel columns, each its own
+//VoxelHashGrid. With a tile store, tiles not used for the longest time are written to a file per tile whenever
+//the resident voxels need more than the memory budget, and read back when new points fall into them again.
+//Tiles used by the current cloud are never spilled. As corrections only change T_map, spilled tiles stay valid.
+class VoxelMap {
+public:
+	static const int tile_shift = 8;	//256 x 256 voxel columns per tile
+
+	//leaf_z <= 0: 2.5D map with one cell per x,y column
+	VoxelMap(double leaf_xy, double leaf_z) : leaf_xy(leaf_xy), leaf_z(leaf_z), inv_leaf_xy(1.0 / leaf_xy)
+	{
+		setIdentity(T_map);
+		setIdentity(T_map_inv);
+	}
+
+	~VoxelMap()
+	{
+		for (std::unordered_map<uint64_t, Tile>::iterator it = tiles.begin(); it != tiles.end(); ++it)
+			if (!it->second.grid)
+				std::remove(tilePath(it->first).c_str());
+	}
+
+	//spill tiles into files in dir (ending with a separator) when the resident voxels take more than max_bytes
+	void setTileStore(const std::string &dir, size_t max_bytes)
+	{
+		tile_dir = dir;
+		max_resident_bytes = max_bytes;
+	}
+
+	//add world frame points of a pcl style cloud
+	template<typename CloudT>
+	void addCloud(const CloudT &cloud)
+	{
+		use_count++;
+		const double *M = T_map_inv;
+		Tile *tile = NULL;
+		uint64_t tile_key = 0;
+		for (size_t i = 0; i < cloud.points.size(); i++)
+		{
+			const typename CloudT::PointType &pt = cloud.points[i];
+			double x = M[0]*pt.x + M[1]*pt.y + M[2]*pt.z + M[3];
+			double y = M[4]*pt.x + M[5]*pt.y + M[6]*pt.z + M[7];
+			double z = M[8]*pt.x + M[9]*pt.y + M[10]*pt.z + M[11];
+			uint64_t key = tileKey(x, y);
+			//consecutive points are mostly in the same tile
+			if (tile == NULL || key != tile_key)
+			{
+				tile = &residentTile(key);
+				tile_key = key;
+			}
+			tile->grid->add(x, y, z, pt.r, pt.g, pt.b);
+		}
+		points_added += cloud.points.size();
+		spill();
+	}
+
+	//apply a rigid world frame correction T to everything already in the map: T_map = T * T_map
+	//MatrixT is any 4x4 matrix type indexed with (i,j), e.g. Eigen::Matrix4f
+	template<typename MatrixT>
+	void applyCorrection(const MatrixT &T)
+	{
+		double C[16];
+		for (int i = 0; i < 4; i++)
+			for (int j = 0; j < 4; j++)
+			{
+				C[4*i+j] = 0;
+				for (int k = 0; k < 4; k++)
+					C[4*i+j] += T(i,k) * T_map[4*k+j];
+			}
+		std::memcpy(T_map, C, sizeof(C));
+		//rigid inverse: R' and -R't
+		setIdentity(T_map_inv);
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+				T_map_inv[4*i+j] = T_map[4*j+i];
+			T_map_inv[4*i+3] = -(T_map[i] * T_map[3] + T_map[4+i] * T_map[7] + T_map[8+i] * T_map[11]);
+		}
+	}
+
+	//world frame centroids of voxels having at least min_points points. spilled tiles are read, not made resident,
+	//or skipped with resident_only, which keeps the export within the memory budget and free of disk reads
+	template<typename CloudT>
+	void exportTo(CloudT &cloud, unsigned int min_points = 1, bool resident_only = false) const
+	{
+		cloud.points.clear();
+		cloud.points.reserve(resident_only ? residentBytes() / voxel_bytes : size());
+		const double *M = T_map;
+		forEachTile([&](const VoxelHashGrid &grid)
+		{
+			grid.forEachVoxel([&](const VoxelHashGrid::Voxel &v)
+			{
+				if (v.n < min_points)
+					return;
+				double x = v.x / v.n, y = v.y / v.n, z = v.z / v.n;
+				cloud.points.push_back(VoxelHashGrid::makePoint<typename CloudT::PointType>(
+					M[0]*x + M[1]*y + M[2]*z + M[3], M[4]*x + M[5]*y + M[6]*z + M[7], M[8]*x + M[9]*y + M[10]*z + M[11], v));
+			});
+		}, resident_only);
+		cloud.width = cloud.points.size();
+		cloud.height = 1;
+	}
+
+	//write the world frame centroids of voxels having at least min_points points to a binary PLY file tile by tile,
+	//only one spilled tile is in memory at a time. returns the number of points written
+	size_t writePLY(const std::string &path, unsigned int min_points = 1) const
+	{
+		size_t n_out = 0;
+		forEachTile([&](const VoxelHashGrid &grid)
+		{
+			grid.forEachVoxel([&](const VoxelHashGrid::Voxel &v) { n_out += v.n >= min_points; });
+		});
+		std::ofstream file(path.c_str(), std::ios::binary);
+		if (!file)
+			throw "Exception: could not open PLY file for writing!";
+		file << "ply\nformat binary_little_endian 1.0\nelement vertex " << n_out << "\n"
+			<< "property float x\nproperty float y\nproperty float z\n"
+			<< "property uchar red\nproperty uchar green\nproperty uchar blue\nend_header\n";
+		const double *M = T_map;
+		std::vector<char> buffer;
+		forEachTile([&](const VoxelHashGrid &grid)
+		{
+			buffer.clear();
+			grid.forEachVoxel([&](const VoxelHashGrid::Voxel &v)
+			{
+				if (v.n < min_points)
+					return;
+				double x = v.x / v.n, y = v.y / v.n, z = v.z / v.n;
+				float xyz[3] = { (float)(M[0]*x + M[1]*y + M[2]*z + M[3]), (float)(M[4]*x + M[5]*y + M[6]*z + M[7]), (float)(M[8]*x + M[9]*y + M[10]*z + M[11]) };
+				unsigned char rgb[3] = { (unsigned char)(v.r / v.n), (unsigned char)(v.g / v.n), (unsigned char)(v.b / v.n) };
+				buffer.insert(buffer.end(), (const char*)xyz, (const char*)xyz + sizeof(xyz));
+				buffer.insert(buffer.end(), (const char*)rgb, (const char*)rgb + sizeof(rgb));
+			});
+			file.write(buffer.empty() ? NULL : &buffer[0], buffer.size());
+		});
+		if (!file)
+			throw "Exception: could not write PLY file!";
+		return n_out;
+	}
+
+	//voxels in the map, resident or spilled
+	size_t size() const
+	{
+		size_t n = 0;
+		for (std::unordered_map<uint64_t, Tile>::const_iterator it = tiles.begin(); it != tiles.end(); ++it)
+			n += it->second.grid ? it->second.grid->size() : it->second.n_voxels;
+		return n;
+	}
+	size_t pointsAdded() const { return points_added; }
+	int numTiles() const { return tiles.size(); }
+	int numSpilledTiles() const
+	{
+		int n = 0;
+		for (std::unordered_map<uint64_t, Tile>::const_iterator it = tiles.begin(); it != tiles.end(); ++it)
+			n += !it->second.grid;
+		return n;
+	}
+	size_t residentBytes() const
+	{
+		size_t n = 0;
+		for (std::unordered_map<uint64_t, Tile>::const_iterator it = tiles.begin(); it != tiles.end(); ++it)
+			if (it->second.grid)
+				n += it->second.grid->size();
+		return n * voxel_bytes;
+	}
+	long spillCount() const { return n_spills; }
+	long loadCount() const { return n_loads; }
+
+private:
+	struct Tile {
+		std::shared_ptr<VoxelHashGrid> grid;	//NULL while spilled
+		size_t n_voxels = 0;		//voxels in the file while spilled
+		long last_used = 0;			//addCloud call that last added points
+	};
+
+	//approximate size of a voxel in an unordered_map: node with key and value plus bucket pointer
+	static const size_t voxel_bytes = sizeof(void*) + sizeof(uint64_t) + sizeof(VoxelHashGrid::Voxel) + sizeof(void*);
+
+	double leaf_xy, leaf_z, inv_leaf_xy;
+	double T_map[16];		//map to world, row major
+	double T_map_inv[16];	//world to map
+	size_t points_added = 0;
+	std::unordered_map<uint64_t, Tile> tiles;
+	long use_count = 0;
+	std::string tile_dir;
+	size_t max_resident_bytes = 0;	//0: no spilling
+	long n_spills = 0, n_loads = 0;
+
+	//tile of the voxel column of a map frame point, the same floor VoxelHashGrid uses for the voxel
+	uint64_t tileKey(double x, double y) const
+	{
+		int64_t tx = (int64_t)std::floor(x * inv_leaf_xy) >> tile_shift;
+		int64_t ty = (int64_t)std::floor(y * inv_leaf_xy) >> tile_shift;
+		return ((uint64_t)(uint32_t)tx << 32) | (uint32_t)ty;
+	}
+
+	std::string tilePath(uint64_t key) const
+	{
+		char name[64];
+		std::snprintf(name, sizeof(name), "tile_%d_%d.bin", (int)(int32_t)(key >> 32), (int)(int32_t)(key & 0xFFFFFFFF));
+		return tile_dir + name;
+	}
+
+	Tile& residentTile(uint64_t key)
+	{
+		Tile &tile = tiles[key];
+		if (!tile.grid)
+		{
+			tile.grid = std::make_shared<VoxelHashGrid>(leaf_xy, leaf_xy, leaf_z);
+			if (tile.n_voxels > 0)
+			{
+				readTile(key, *tile.grid);
+				std::remove(tilePath(key).c_str());
+				tile.n_voxels = 0;
+				n_loads++;
+			}
+		}
+		tile.last_used = use_count;
+		return tile;
+	}
+
+	//call f(grid) for every tile, spilled ones are read into a temporary grid unless resident_only skips them
+	template<typename F>
+	void forEachTile(F f, bool resident_only = false) const
+	{
+		for (std::unordered_map<uint64_t, Tile>::const_iterator it = tiles.begin(); it != tiles.end(); ++it)
+		{
+			if (it->second.grid)
+				f(*it->second.grid);
+			else if (!resident_only)
+			{
+				VoxelHashGrid grid(leaf_xy, leaf_xy, leaf_z);
+				readTile(it->first, grid);
+				f(grid);
+			}
+		}
+	}
+
+	//write least recently used tiles to files until the resident voxels fit into the budget
+	void spill()
+	{
+		if (max_resident_bytes == 0)
+			return;
+		size_t resident = residentBytes();
+		while (resident > max_resident_bytes)
+		{
+			std::unordered_map<uint64_t, Tile>::iterator lru = tiles.end();
+			for (std::unordered_map<uint64_t, Tile>::iterator it = tiles.begin(); it != tiles.end(); ++it)
+				if (it->second.grid && it->second.last_used < use_count && (lru == tiles.end() || it->second.last_used < lru->second.last_used))
+					lru = it;
+			if (lru == tiles.end())
+				return;		//everything resident is in use
+			Tile &tile = lru->second;
+			writeTile(lru->first, *tile.grid);
+			tile.n_voxels = tile.grid->size();
+			resident -= tile.n_voxels * voxel_bytes;
+			tile.grid.reset();
+			n_spills++;
+		}
+	}
+
+	//tile file: voxel count, then key and sums of every voxel
+	void writeTile(uint64_t key, const VoxelHashGrid &grid) const
+	{
+		std::ofstream file(tilePath(key).c_str(), std::ios::binary);
+		uint64_t n = grid.size();
+		file.write((const char*)&n, sizeof(n));
+		grid.forEachEntry([&](uint64_t k, const VoxelHashGrid::Voxel &v)
+		{
+			file.write((const char*)&k, sizeof(k));
+			file.write((const char*)&v, sizeof(v));
+		});
+		if (!file)
+			throw "Exception: could not write map tile, check the space in the output folder!";
+	}
+
+	void readTile(uint64_t key, VoxelHashGrid &grid) const
+	{
+		std::ifstream file(tilePath(key).c_str(), std::ios::binary);
+		uint64_t n = 0;
+		file.read((char*)&n, sizeof(n));
+		grid.reserve(n);
+		for (uint64_t i = 0; i < n && file; i++)
+		{
+			uint64_t k;
+			VoxelHashGrid::Voxel v;
+			file.read((char*)&k, sizeof(k));
+			file.read((char*)&v, sizeof(v));
+			grid.addVoxel(k, v);
+		}
+		if (!file)
+			throw "Exception: could not read map tile!";
+	}
+
+	static void setIdentity(double *M)
+	{
+		for (int i = 0; i < 16; i++)
+			M[i] = (i % 5 == 0) ? 1.0 : 0.0;
+	}
+};
+
+#endif